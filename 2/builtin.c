@@ -0,0 +1,649 @@
+#include "builtin.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void
+buf_reserve(struct builtin_buf *buf, size_t size)
+{
+	if (buf->capacity - buf->size >= size)
+		return;
+	size_t new_capacity = (buf->capacity + 1) * 2;
+	if (new_capacity - buf->size < size)
+		new_capacity = buf->size + size;
+	buf->data = realloc(buf->data, new_capacity);
+	buf->capacity = new_capacity;
+}
+
+static void
+buf_append(struct builtin_buf *buf, const char *data, size_t size)
+{
+	buf_reserve(buf, size);
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+static void
+buf_putc(struct builtin_buf *buf, char c)
+{
+	buf_reserve(buf, 1);
+	buf->data[buf->size++] = c;
+}
+
+void
+builtin_buf_printf(struct builtin_buf *buf, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int len = vsnprintf(NULL, 0, format, ap);
+	va_end(ap);
+	if (len <= 0)
+		return;
+	buf_reserve(buf, len + 1);
+	va_start(ap, format);
+	vsnprintf(buf->data + buf->size, len + 1, format, ap);
+	va_end(ap);
+	buf->size += len;
+}
+
+int
+builtin_buf_flush(struct builtin_buf *buf, int fd)
+{
+	size_t done = 0;
+	while (done < buf->size) {
+		ssize_t rc = write(fd, buf->data + done, buf->size - done);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += rc;
+	}
+	buf->size = 0;
+	return 0;
+}
+
+void
+builtin_buf_destroy(struct builtin_buf *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+	buf->capacity = 0;
+}
+
+static bool
+is_help_or_version(int argc, char **argv)
+{
+	return argc == 2 && (strcmp(argv[1], "--help") == 0 ||
+			     strcmp(argv[1], "--version") == 0);
+}
+
+static int
+hex_to_bin(char c)
+{
+	if (isdigit((unsigned char)c))
+		return c - '0';
+	return tolower((unsigned char)c) - 'a' + 10;
+}
+
+static bool
+is_octal(char c)
+{
+	return c >= '0' && c <= '7';
+}
+
+/** Character for a simple one-letter escape sequence. */
+static char
+esc_char(char c)
+{
+	switch (c) {
+	case 'a': return '\a';
+	case 'b': return '\b';
+	case 'e': return '\x1B';
+	case 'f': return '\f';
+	case 'n': return '\n';
+	case 'r': return '\r';
+	case 't': return '\t';
+	case 'v': return '\v';
+	default: return c;
+	}
+}
+
+static int
+builtin_true(int argc, char **argv, struct builtin_buf *out)
+{
+	(void)argc;
+	(void)argv;
+	(void)out;
+	return 0;
+}
+
+static int
+builtin_false(int argc, char **argv, struct builtin_buf *out)
+{
+	(void)argc;
+	(void)argv;
+	(void)out;
+	return 1;
+}
+
+static int
+builtin_pwd(int argc, char **argv, struct builtin_buf *out)
+{
+	(void)argc;
+	(void)argv;
+	char *cwd = getcwd(NULL, 0);
+	if (cwd == NULL) {
+		fprintf(stderr, "pwd: %s\n", strerror(errno));
+		return 1;
+	}
+	buf_append(out, cwd, strlen(cwd));
+	buf_putc(out, '\n');
+	free(cwd);
+	return 0;
+}
+
+/** Same as coreutils echo, including -n, -e, -E options. */
+static int
+builtin_echo(int argc, char **argv, struct builtin_buf *out)
+{
+	bool do_escapes = false;
+	bool add_new_line = true;
+	int i = 1;
+	for (; i < argc && argv[i][0] == '-'; ++i) {
+		const char *opt = argv[i] + 1;
+		if (*opt == 0 || opt[strspn(opt, "eEn")] != 0)
+			break;
+		for (; *opt != 0; ++opt) {
+			if (*opt == 'e')
+				do_escapes = true;
+			else if (*opt == 'E')
+				do_escapes = false;
+			else
+				add_new_line = false;
+		}
+	}
+	for (; i < argc; ++i) {
+		const char *s = argv[i];
+		if (!do_escapes) {
+			buf_append(out, s, strlen(s));
+			goto next_arg;
+		}
+		char c;
+		while ((c = *s++) != 0) {
+			if (c != '\\' || *s == 0) {
+				buf_putc(out, c);
+				continue;
+			}
+			switch (c = *s++) {
+			case 'c':
+				return 0;
+			case 'x':
+				if (!isxdigit((unsigned char)*s)) {
+					buf_putc(out, '\\');
+					break;
+				}
+				c = hex_to_bin(*s++);
+				if (isxdigit((unsigned char)*s))
+					c = c * 16 + hex_to_bin(*s++);
+				break;
+			case '0':
+				c = 0;
+				if (!is_octal(*s))
+					break;
+				c = *s++;
+				/* FALLTHROUGH */
+			case '1': case '2': case '3':
+			case '4': case '5': case '6': case '7':
+				c -= '0';
+				if (is_octal(*s))
+					c = c * 8 + (*s++ - '0');
+				if (is_octal(*s))
+					c = c * 8 + (*s++ - '0');
+				break;
+			case '\\':
+				break;
+			case 'a': case 'b': case 'e': case 'f':
+			case 'n': case 'r': case 't': case 'v':
+				c = esc_char(c);
+				break;
+			default:
+				buf_putc(out, '\\');
+				break;
+			}
+			buf_putc(out, c);
+		}
+	next_arg:
+		if (i + 1 < argc)
+			buf_putc(out, ' ');
+	}
+	if (add_new_line)
+		buf_putc(out, '\n');
+	return 0;
+}
+
+struct printf_ctx {
+	/** Arguments left for the conversions. */
+	int argc;
+	char **argv;
+	int exit_code;
+	/** Set by '\c', which stops all the output. */
+	bool is_stopped;
+	struct builtin_buf *out;
+};
+
+static const char *
+printf_next_arg(struct printf_ctx *ctx)
+{
+	if (ctx->argc == 0)
+		return NULL;
+	--ctx->argc;
+	return *ctx->argv++;
+}
+
+/**
+ * Output an escape sequence. @a p points right after the backslash. Returns
+ * how many characters were consumed after the backslash.
+ */
+static int
+printf_esc(struct printf_ctx *ctx, const char *p, bool octal_0)
+{
+	const char *start = p;
+	int value = 0;
+	if (*p == 'x') {
+		/* The format is validated, at least one digit is there. */
+		for (int len = 0; len < 2 && isxdigit((unsigned char)p[1]);
+		     ++len, ++p)
+			value = value * 16 + hex_to_bin(p[1]);
+		++p;
+		buf_putc(ctx->out, value);
+	} else if (is_octal(*p)) {
+		p += octal_0 && *p == '0';
+		for (int len = 0; len < 3 && is_octal(*p); ++len, ++p)
+			value = value * 8 + *p - '0';
+		buf_putc(ctx->out, value);
+	} else if (*p != 0 && strchr("\"\\abcefnrtv", *p) != NULL) {
+		if (*p == 'c')
+			ctx->is_stopped = true;
+		else
+			buf_putc(ctx->out, esc_char(*p));
+		++p;
+	} else {
+		buf_putc(ctx->out, '\\');
+		if (*p != 0)
+			buf_putc(ctx->out, *p++);
+	}
+	return p - start;
+}
+
+static void
+printf_verify_numeric(struct printf_ctx *ctx, const char *s, const char *end)
+{
+	if (errno != 0) {
+		fprintf(stderr, "printf: '%s': %s\n", s, strerror(errno));
+		ctx->exit_code = 1;
+	} else if (*end != 0) {
+		if (s == end)
+			fprintf(stderr, "printf: '%s': expected a numeric "
+				"value\n", s);
+		else
+			fprintf(stderr, "printf: '%s': value not completely "
+				"converted\n", s);
+		ctx->exit_code = 1;
+	}
+}
+
+/**
+ * Character constant like 'a or "a. Its value is the character code. Returns
+ * false if @a s is a normal number.
+ */
+static bool
+printf_char_constant(const char *s, int *value)
+{
+	if ((*s != '"' && *s != '\'') || s[1] == 0)
+		return false;
+	*value = (unsigned char)s[1];
+	if (s[2] != 0) {
+		fprintf(stderr, "printf: warning: %s: character(s) following "
+			"character constant have been ignored\n", s + 2);
+	}
+	return true;
+}
+
+static intmax_t
+printf_arg_int(struct printf_ctx *ctx, const char *s)
+{
+	int c;
+	if (s == NULL)
+		return 0;
+	if (printf_char_constant(s, &c))
+		return c;
+	char *end;
+	errno = 0;
+	intmax_t value = strtoimax(s, &end, 0);
+	printf_verify_numeric(ctx, s, end);
+	return value;
+}
+
+static uintmax_t
+printf_arg_uint(struct printf_ctx *ctx, const char *s)
+{
+	int c;
+	if (s == NULL)
+		return 0;
+	if (printf_char_constant(s, &c))
+		return c;
+	char *end;
+	errno = 0;
+	uintmax_t value = strtoumax(s, &end, 0);
+	printf_verify_numeric(ctx, s, end);
+	return value;
+}
+
+static long double
+printf_arg_float(struct printf_ctx *ctx, const char *s)
+{
+	int c;
+	if (s == NULL)
+		return 0;
+	if (printf_char_constant(s, &c))
+		return c;
+	char *end;
+	errno = 0;
+	long double value = strtold(s, &end);
+	printf_verify_numeric(ctx, s, end);
+	return value;
+}
+
+#define PRINTF_DIRECTIVE(out, spec, has_width, width, has_prec, prec, v) do {\
+	if ((has_width) && (has_prec))					\
+		builtin_buf_printf(out, spec, width, prec, v);		\
+	else if (has_width)						\
+		builtin_buf_printf(out, spec, width, v);		\
+	else if (has_prec)						\
+		builtin_buf_printf(out, spec, prec, v);			\
+	else								\
+		builtin_buf_printf(out, spec, v);			\
+} while (0)
+
+/**
+ * Output one '%' directive except '%%' and '%b'. @a f points at the flags
+ * right after '%'. Returns the position after the directive.
+ */
+static const char *
+printf_directive(struct printf_ctx *ctx, const char *f)
+{
+	char spec[32];
+	int len = 0;
+	spec[len++] = '%';
+	for (; *f != 0 && strchr("-+ #0", *f) != NULL; ++f) {
+		if (len < 16)
+			spec[len++] = *f;
+	}
+	bool has_width = false;
+	bool has_prec = false;
+	int width = 0;
+	int prec = 0;
+	if (*f == '*' || isdigit((unsigned char)*f)) {
+		has_width = true;
+		intmax_t value;
+		if (*f == '*') {
+			value = printf_arg_int(ctx, printf_next_arg(ctx));
+			++f;
+		} else {
+			value = strtoimax(f, (char **)&f, 10);
+		}
+		if (value < INT_MIN || value > INT_MAX) {
+			fprintf(stderr, "printf: invalid field width\n");
+			ctx->exit_code = 1;
+			ctx->is_stopped = true;
+			return f;
+		}
+		width = value;
+		spec[len++] = '*';
+	}
+	if (*f == '.') {
+		++f;
+		has_prec = true;
+		intmax_t value;
+		if (*f == '*') {
+			value = printf_arg_int(ctx, printf_next_arg(ctx));
+			++f;
+		} else {
+			value = strtoimax(f, (char **)&f, 10);
+		}
+		if (value > INT_MAX) {
+			fprintf(stderr, "printf: invalid precision\n");
+			ctx->exit_code = 1;
+			ctx->is_stopped = true;
+			return f;
+		}
+		/* Negative precision is taken as if it was omitted. */
+		if (value < 0) {
+			has_prec = false;
+		} else {
+			prec = value;
+			spec[len++] = '.';
+			spec[len++] = '*';
+		}
+	}
+	while (*f != 0 && strchr("hlLjtz", *f) != NULL)
+		++f;
+	char conv = *f++;
+	const char *arg = printf_next_arg(ctx);
+	struct builtin_buf *out = ctx->out;
+	switch (conv) {
+	case 'd':
+	case 'i':
+		spec[len++] = 'j';
+		spec[len++] = conv;
+		spec[len] = 0;
+		PRINTF_DIRECTIVE(out, spec, has_width, width, has_prec, prec,
+				 printf_arg_int(ctx, arg));
+		break;
+	case 'o':
+	case 'u':
+	case 'x':
+	case 'X':
+		spec[len++] = 'j';
+		spec[len++] = conv;
+		spec[len] = 0;
+		PRINTF_DIRECTIVE(out, spec, has_width, width, has_prec, prec,
+				 printf_arg_uint(ctx, arg));
+		break;
+	case 'c':
+		spec[len++] = conv;
+		spec[len] = 0;
+		PRINTF_DIRECTIVE(out, spec, has_width, width, has_prec, prec,
+				 arg == NULL ? 0 : *arg);
+		break;
+	case 's':
+		spec[len++] = conv;
+		spec[len] = 0;
+		PRINTF_DIRECTIVE(out, spec, has_width, width, has_prec, prec,
+				 arg == NULL ? "" : arg);
+		break;
+	default:
+		spec[len++] = 'L';
+		spec[len++] = conv;
+		spec[len] = 0;
+		PRINTF_DIRECTIVE(out, spec, has_width, width, has_prec, prec,
+				 printf_arg_float(ctx, arg));
+		break;
+	}
+	return f;
+}
+
+/**
+ * Output the format once. Returns how many arguments were consumed.
+ */
+static int
+printf_format(struct printf_ctx *ctx, const char *f)
+{
+	int argc = ctx->argc;
+	while (*f != 0 && !ctx->is_stopped) {
+		if (*f == '\\') {
+			f += printf_esc(ctx, f + 1, false) + 1;
+			continue;
+		}
+		if (*f != '%') {
+			buf_putc(ctx->out, *f++);
+			continue;
+		}
+		++f;
+		if (*f == '%') {
+			buf_putc(ctx->out, *f++);
+		} else if (*f == 'b') {
+			++f;
+			const char *s = printf_next_arg(ctx);
+			while (s != NULL && *s != 0 && !ctx->is_stopped) {
+				if (*s == '\\')
+					s += printf_esc(ctx, s + 1, true) + 1;
+				else
+					buf_putc(ctx->out, *s++);
+			}
+		} else {
+			f = printf_directive(ctx, f);
+		}
+	}
+	return argc - ctx->argc;
+}
+
+static bool
+printf_escapes_are_supported(const char *s)
+{
+	for (; *s != 0; ++s) {
+		if (*s != '\\')
+			continue;
+		++s;
+		if (*s == 'u' || *s == 'U')
+			return false;
+		if (*s == 'x' && !isxdigit((unsigned char)s[1]))
+			return false;
+		if (*s == 0)
+			break;
+	}
+	return true;
+}
+
+/**
+ * Check that the format and arguments don't need anything the builtin can't
+ * reproduce exactly: unicode escapes, locale-dependent grouping and
+ * multibyte character constants, and invalid directives, whose error
+ * messages are better left to the real tool.
+ */
+static bool
+printf_is_supported(int argc, char **argv)
+{
+	if (argc < 2)
+		return false;
+	const char *f = argv[1];
+	bool has_b = false;
+	if (!printf_escapes_are_supported(f))
+		return false;
+	while ((f = strchr(f, '%')) != NULL) {
+		++f;
+		if (*f == '%') {
+			++f;
+			continue;
+		}
+		if (*f == 'b') {
+			has_b = true;
+			++f;
+			continue;
+		}
+		f += strspn(f, "-+ #0");
+		if (*f == '*')
+			++f;
+		else if (strspn(f, "0123456789") > 9)
+			return false;
+		f += strspn(f, "0123456789");
+		if (*f == '.') {
+			++f;
+			if (*f == '*')
+				++f;
+			else if (strspn(f, "0123456789") > 9)
+				return false;
+			f += strspn(f, "0123456789");
+		}
+		f += strspn(f, "hlLjtz");
+		if (*f == 0 || strchr("diouxXfFeEgGaAcs", *f) == NULL)
+			return false;
+	}
+	for (int i = 2; i < argc; ++i) {
+		const char *s = argv[i];
+		if ((s[0] == '"' || s[0] == '\'') && (unsigned char)s[1] >= 0x80)
+			return false;
+		if (has_b && !printf_escapes_are_supported(s))
+			return false;
+	}
+	return true;
+}
+
+/** Same as coreutils printf, except for '%q' and unicode escapes. */
+static int
+builtin_printf(int argc, char **argv, struct builtin_buf *out)
+{
+	if (argc > 1 && strcmp(argv[1], "--") == 0) {
+		--argc;
+		++argv;
+	}
+	struct printf_ctx ctx = {
+		.argc = argc - 2,
+		.argv = argv + 2,
+		.exit_code = 0,
+		.is_stopped = false,
+		.out = out,
+	};
+	int used;
+	do {
+		used = printf_format(&ctx, argv[1]);
+	} while (used > 0 && ctx.argc > 0 && !ctx.is_stopped);
+	if (ctx.argc > 0 && !ctx.is_stopped) {
+		fprintf(stderr, "printf: warning: ignoring excess arguments, "
+			"starting with '%s'\n", ctx.argv[0]);
+	}
+	return ctx.exit_code;
+}
+
+static const struct builtin builtins[] = {
+	{"echo", builtin_echo},
+	{"false", builtin_false},
+	{"printf", builtin_printf},
+	{"pwd", builtin_pwd},
+	{"true", builtin_true},
+};
+
+const struct builtin *
+builtin_find(int argc, char **argv)
+{
+	const struct builtin *b = NULL;
+	for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); ++i) {
+		if (strcmp(builtins[i].name, argv[0]) == 0) {
+			b = &builtins[i];
+			break;
+		}
+	}
+	if (b == NULL || is_help_or_version(argc, argv))
+		return NULL;
+	if (b->run == builtin_pwd && argc > 1)
+		return NULL;
+	if (b->run == builtin_printf) {
+		if (argc > 1 && strcmp(argv[1], "--") == 0) {
+			--argc;
+			++argv;
+		}
+		if (!printf_is_supported(argc, argv))
+			return NULL;
+	}
+	return b;
+}
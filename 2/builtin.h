@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * In-process implementations of the most common trivial commands: echo,
+ * printf, pwd, true, false. They reproduce the output of the coreutils
+ * programs byte to byte, and save the shell a process launch. A builtin never
+ * reads stdin and never changes the shell state, so it can be executed right
+ * inside the shell even as a pipeline stage. Arguments a builtin can't handle
+ * exactly like the external tool (--help, unicode escapes, ...) make it step
+ * aside, and the command is executed as a normal program.
+ */
+
+/** Output collected from a builtin. */
+struct builtin_buf {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+/**
+ * Builtin command function.
+ * @param argc Argument count, including the command name.
+ * @param argv Arguments, argv[0] is the command name.
+ * @param out Buffer to append the output to.
+ * @retval Exit code.
+ */
+typedef int (*builtin_f)(int argc, char **argv, struct builtin_buf *out);
+
+struct builtin {
+	const char *name;
+	builtin_f run;
+};
+
+/**
+ * Find a builtin which can execute the given command.
+ * @retval NULL The command has to be executed as an external program.
+ */
+const struct builtin *
+builtin_find(int argc, char **argv);
+
+/** Append formatted output to the buffer. */
+void
+builtin_buf_printf(struct builtin_buf *buf, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/**
+ * Write all the buffered output into @a fd.
+ * @retval 0 Success.
+ * @retval -1 Write error, errno is set.
+ */
+int
+builtin_buf_flush(struct builtin_buf *buf, int fd);
+
+void
+builtin_buf_destroy(struct builtin_buf *buf);
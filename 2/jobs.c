@@ -0,0 +1,237 @@
+#include "jobs.h"
+
+#include "spawn.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct job_table {
+	/** Jobs in the order they were started. */
+	struct job **jobs;
+	int count;
+	int capacity;
+	/** How many jobs are not done yet. */
+	int running;
+	int max_running;
+	/** Signalfd receiving SIGCHLD. */
+	int signal_fd;
+	/** Signal mask of the process before SIGCHLD was blocked. */
+	sigset_t old_mask;
+};
+
+struct job_table *
+job_table_new(int max_running)
+{
+	struct job_table *table = calloc(1, sizeof(*table));
+	table->max_running = max_running;
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, &table->old_mask);
+	table->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (table->signal_fd < 0)
+		perror("signalfd");
+	return table;
+}
+
+static void
+job_delete(struct job *job)
+{
+	free(job->pids);
+	free(job->command);
+	free(job);
+}
+
+void
+job_table_delete(struct job_table *table)
+{
+	for (int i = 0; i < table->count; ++i)
+		job_delete(table->jobs[i]);
+	free(table->jobs);
+	if (table->signal_fd >= 0)
+		close(table->signal_fd);
+	sigprocmask(SIG_SETMASK, &table->old_mask, NULL);
+	free(table);
+}
+
+int
+job_table_fd(struct job_table *table)
+{
+	return table->signal_fd;
+}
+
+int
+job_table_max_running(struct job_table *table)
+{
+	return table->max_running;
+}
+
+static void
+job_set_done(struct job_table *table, struct job *job)
+{
+	job->state = JOB_STATE_DONE;
+	--table->running;
+}
+
+struct job *
+job_table_add(struct job_table *table, const char *command, const pid_t *pids,
+	      int pid_count, int exit_code)
+{
+	if (table->count == table->capacity) {
+		table->capacity = (table->capacity + 1) * 2;
+		table->jobs = realloc(table->jobs,
+				      sizeof(*table->jobs) * table->capacity);
+	}
+	struct job *job = malloc(sizeof(*job));
+	job->id = table->count == 0 ? 1 : table->jobs[table->count - 1]->id + 1;
+	job->state = JOB_STATE_RUNNING;
+	job->pids = malloc(sizeof(*job->pids) * pid_count);
+	memcpy(job->pids, pids, sizeof(*job->pids) * pid_count);
+	job->pid_count = pid_count;
+	job->exit_code = exit_code;
+	job->command = strdup(command);
+	table->jobs[table->count++] = job;
+	++table->running;
+	bool is_running = false;
+	for (int i = 0; i < pid_count && !is_running; ++i)
+		is_running = pids[i] != 0;
+	if (!is_running)
+		job_set_done(table, job);
+	return job;
+}
+
+/** Collect the job's terminated processes. Returns true if it became done. */
+static bool
+job_reap(struct job_table *table, struct job *job, int options)
+{
+	if (job->state == JOB_STATE_DONE)
+		return false;
+	bool is_running = false;
+	for (int i = 0; i < job->pid_count; ++i) {
+		pid_t pid = job->pids[i];
+		if (pid == 0)
+			continue;
+		int status;
+		pid_t rc;
+		while ((rc = waitpid(pid, &status, options)) < 0 &&
+		       errno == EINTR)
+			;
+		if (rc == 0) {
+			is_running = true;
+			continue;
+		}
+		if (rc == pid && i == job->pid_count - 1)
+			job->exit_code = spawn_exit_code(status);
+		job->pids[i] = 0;
+	}
+	if (is_running)
+		return false;
+	job_set_done(table, job);
+	return true;
+}
+
+int
+job_table_reap(struct job_table *table)
+{
+	struct signalfd_siginfo info;
+	while (read(table->signal_fd, &info, sizeof(info)) == sizeof(info))
+		;
+	int count = 0;
+	for (int i = 0; i < table->count && table->running > 0; ++i)
+		count += job_reap(table, table->jobs[i], WNOHANG);
+	return count;
+}
+
+void
+job_table_wait_slot(struct job_table *table)
+{
+	if (table->max_running == 0)
+		return;
+	job_table_reap(table);
+	while (table->running >= table->max_running) {
+		struct pollfd pfd = {
+			.fd = table->signal_fd,
+			.events = POLLIN,
+		};
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			perror("poll");
+			return;
+		}
+		job_table_reap(table);
+	}
+}
+
+int
+job_table_wait(struct job_table *table, struct job *job)
+{
+	job_reap(table, job, 0);
+	return job->exit_code;
+}
+
+struct job *
+job_table_find(struct job_table *table, const char *spec)
+{
+	if (table->count == 0)
+		return NULL;
+	if (spec[0] != '%') {
+		char *end;
+		long pid = strtol(spec, &end, 10);
+		if (*end != 0 || end == spec)
+			return NULL;
+		for (int i = 0; i < table->count; ++i) {
+			struct job *job = table->jobs[i];
+			for (int j = 0; j < job->pid_count; ++j) {
+				if (job->pids[j] == pid)
+					return job;
+			}
+		}
+		return NULL;
+	}
+	++spec;
+	if (*spec == 0 || strcmp(spec, "+") == 0 || strcmp(spec, "%") == 0)
+		return table->jobs[table->count - 1];
+	if (strcmp(spec, "-") == 0) {
+		if (table->count < 2)
+			return NULL;
+		return table->jobs[table->count - 2];
+	}
+	char *end;
+	long id = strtol(spec, &end, 10);
+	if (*end != 0 || end == spec)
+		return NULL;
+	for (int i = 0; i < table->count; ++i) {
+		if (table->jobs[i]->id == id)
+			return table->jobs[i];
+	}
+	return NULL;
+}
+
+void
+job_table_remove(struct job_table *table, struct job *job)
+{
+	for (int i = 0; i < table->count; ++i) {
+		if (table->jobs[i] != job)
+			continue;
+		if (job->state == JOB_STATE_RUNNING)
+			--table->running;
+		job_delete(job);
+		--table->count;
+		memmove(&table->jobs[i], &table->jobs[i + 1],
+			sizeof(*table->jobs) * (table->count - i));
+		return;
+	}
+}
+
+struct job **
+job_table_jobs(struct job_table *table, int *count)
+{
+	*count = table->count;
+	return table->jobs;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Table of the background jobs of the shell. A job is a command line started
+ * with '&': one or more processes. Finished processes are reaped as soon as
+ * SIGCHLD arrives, so they don't pile up as zombies. SIGCHLD is blocked and
+ * delivered through a signalfd, which the shell polls together with its
+ * input.
+ */
+
+enum job_state {
+	JOB_STATE_RUNNING,
+	JOB_STATE_DONE,
+};
+
+struct job {
+	/** Job number as shown by 'jobs', starting from 1. */
+	int id;
+	enum job_state state;
+	/** Processes of the job. 0 means the process is already reaped. */
+	pid_t *pids;
+	int pid_count;
+	/** Exit code of the job, which is the one of the last process. */
+	int exit_code;
+	/** Command line text for 'jobs'. */
+	char *command;
+};
+
+struct job_table;
+
+/**
+ * Create a job table. SIGCHLD gets blocked in the calling process.
+ * @param max_running Maximal number of jobs running at once, 0 for no limit.
+ */
+struct job_table *
+job_table_new(int max_running);
+
+void
+job_table_delete(struct job_table *table);
+
+/** Descriptor which becomes readable when a child has terminated. */
+int
+job_table_fd(struct job_table *table);
+
+/** Maximal number of jobs running at once, 0 means no limit. */
+int
+job_table_max_running(struct job_table *table);
+
+/**
+ * Register a new job. Its processes are already started.
+ * @param table Job table.
+ * @param command Command line text.
+ * @param pids Processes of the job. 0 for already finished ones.
+ * @param pid_count Process count.
+ * @param exit_code Exit code to use if the last process is already finished.
+ */
+struct job *
+job_table_add(struct job_table *table, const char *command, const pid_t *pids,
+	      int pid_count, int exit_code);
+
+/**
+ * Reap all the terminated children of the jobs without blocking.
+ * @retval Number of jobs which became done.
+ */
+int
+job_table_reap(struct job_table *table);
+
+/**
+ * Block until the number of running jobs is below the limit, so one more
+ * can be started.
+ */
+void
+job_table_wait_slot(struct job_table *table);
+
+/** Block until the job is done and return its exit code. */
+int
+job_table_wait(struct job_table *table, struct job *job);
+
+/**
+ * Find a job by specification: %N, %+, %%, %- or a pid of any of its
+ * processes.
+ * @retval NULL No such job.
+ */
+struct job *
+job_table_find(struct job_table *table, const char *spec);
+
+/** Remove the job from the table. */
+void
+job_table_remove(struct job_table *table, struct job *job);
+
+/**
+ * Get the jobs in the order they were started.
+ * @param[out] count Job count.
+ */
+struct job **
+job_table_jobs(struct job_table *table, int *count);
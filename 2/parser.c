@@ -34,9 +34,10 @@ static char *
 token_strdup(const struct token *t)
 {
 	assert(t->type == TOKEN_TYPE_STR);
-	assert(t->size > 0);
+	/* Can be empty, like ''. */
 	char *res = malloc(t->size + 1);
-	memcpy(res, t->data, t->size);
+	if (t->size > 0)
+		memcpy(res, t->data, t->size);
 	res[t->size] = 0;
 	return res;
 }
@@ -249,13 +250,20 @@ parse_token(const char *pos, const char *end, struct token *out)
 		case '\r':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			/* Spaces after a line continuation, like "\\\n a". */
+			if (out->size == 0) {
+				++pos;
+				continue;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos + 1 - begin;
 		case '\n':
 			if (quote != 0)
 				goto append_and_next;
-			assert(out->size > 0);
+			if (out->size == 0) {
+				out->type = TOKEN_TYPE_NEW_LINE;
+				return pos + 1 - begin;
+			}
 			out->type = TOKEN_TYPE_STR;
 			return pos - begin;
 		case '#':
@@ -394,9 +402,10 @@ close_and_return:
 		pos += used;
 	}
 	if (token.type == TOKEN_TYPE_NEW_LINE) {
-		assert(line->tail != NULL);
 		parser_consume(p, pos - begin);
-		if (line->tail->type != EXPR_TYPE_COMMAND) {
+		/* A line can have no command at all, like "> file". */
+		if (line->tail == NULL ||
+		    line->tail->type != EXPR_TYPE_COMMAND) {
 			res = PARSER_ERR_ENDS_NOT_WITH_A_COMMAND;
 			goto return_no_line;
 		}
@@ -0,0 +1,183 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * Throughput benchmark of the parser. Generates a big script of typical
+ * command lines (arguments, quotes, escapes, pipes, logical operators,
+ * redirects, comments), feeds it to the parser in chunks cut at random
+ * positions, like reads from a pipe are, and pops the lines after each
+ * chunk. Reports lines and megabytes per second and heap allocations per
+ * line. The allocations are counted by wrapping malloc(), calloc() and
+ * realloc() at link time.
+ *
+ * Usage: ./parser_bench [lines=1000000] [max_chunk=4096]
+ */
+
+static unsigned long alloc_count;
+
+void *
+__real_malloc(size_t size);
+
+void *
+__real_calloc(size_t count, size_t size);
+
+void *
+__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+	++alloc_count;
+	return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t count, size_t size)
+{
+	++alloc_count;
+	return __real_calloc(count, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+	++alloc_count;
+	return __real_realloc(ptr, size);
+}
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct script {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+script_append(struct script *s, const char *str)
+{
+	size_t len = strlen(str);
+	if (s->size + len > s->capacity) {
+		s->capacity = (s->capacity + len) * 2;
+		s->data = realloc(s->data, s->capacity);
+	}
+	memcpy(s->data + s->size, str, len);
+	s->size += len;
+}
+
+static const char *const commands[] = {
+	"echo", "grep", "cat", "ls", "printf", "sort", "wc", "make", "cp",
+	"python3",
+};
+
+static const char *const args[] = {
+	"-la", "file.txt", "'single quoted arg'", "\"double \\\"quoted\\\"\"",
+	"--verbose", "a\\ b", "/usr/local/share/some/long/path", "123",
+	"\"multi\\\nline\"", "x",
+};
+
+static const char *const separators[] = {
+	" | ", " && ", " || ",
+};
+
+static const char *
+bench_pick(const char *const *items, size_t count)
+{
+	return items[rand() % count];
+}
+
+#define bench_pick_array(a) bench_pick(a, sizeof(a) / sizeof(a[0]))
+
+static void
+script_generate(struct script *s, long lines)
+{
+	for (long i = 0; i < lines; ++i) {
+		if (rand() % 20 == 0)
+			script_append(s, "# a comment line\n");
+		int cmd_count = 1 + rand() % 3;
+		for (int c = 0; c < cmd_count; ++c) {
+			if (c > 0)
+				script_append(s, bench_pick_array(separators));
+			script_append(s, bench_pick_array(commands));
+			int arg_count = rand() % 5;
+			for (int a = 0; a < arg_count; ++a) {
+				script_append(s, " ");
+				script_append(s, bench_pick_array(args));
+			}
+		}
+		int tail = rand() % 10;
+		if (tail == 0)
+			script_append(s, " > out.txt");
+		else if (tail == 1)
+			script_append(s, " >> log.txt &");
+		else if (tail == 2)
+			script_append(s, " &");
+		script_append(s, "\n");
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	long lines = argc > 1 ? atol(argv[1]) : 1000000;
+	size_t max_chunk = argc > 2 ? strtoul(argv[2], NULL, 10) : 4096;
+	if (lines <= 0 || max_chunk == 0) {
+		fprintf(stderr, "usage: %s [lines] [max_chunk]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	struct script s = {0};
+	srand(0);
+	script_generate(&s, lines);
+
+	struct parser *p = parser_new();
+	long parsed = 0;
+	long errors = 0;
+	size_t chunks = 0;
+	alloc_count = 0;
+	double start = bench_now();
+	for (size_t pos = 0; pos < s.size; ++chunks) {
+		size_t chunk = 1 + rand() % max_chunk;
+		if (chunk > s.size - pos)
+			chunk = s.size - pos;
+		parser_feed(p, s.data + pos, chunk);
+		pos += chunk;
+		while (true) {
+			struct command_line *line = NULL;
+			enum parser_error err = parser_pop_next(p, &line);
+			if (err != PARSER_ERR_NONE) {
+				++errors;
+				continue;
+			}
+			if (line == NULL)
+				break;
+			++parsed;
+			command_line_delete(line);
+		}
+	}
+	double duration = bench_now() - start;
+	unsigned long allocs = alloc_count;
+	parser_delete(p);
+	free(s.data);
+
+	if (parsed != lines || errors != 0) {
+		fprintf(stderr, "parsed %ld lines of %ld, %ld errors\n", parsed,
+			lines, errors);
+		return EXIT_FAILURE;
+	}
+	printf("%ld lines, %.1f MB in %zu chunks of 1-%zu bytes\n", lines,
+	       s.size / 1e6, chunks, max_chunk);
+	printf("%.3f sec, %.0f lines/sec, %.1f MB/sec, %.2f allocs/line\n",
+	       duration, lines / duration, s.size / 1e6 / duration,
+	       (double)allocs / lines);
+	return 0;
+}
@@ -0,0 +1,214 @@
+#include "parser.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Fuzz target of the parser. The parser is resumable: a command line can
+ * arrive in any number of pieces, and the result must not depend on where
+ * the input was cut. The target parses the same input fed at once, byte by
+ * byte and in pseudo-random chunks, and aborts if the results differ. The
+ * first input byte seeds the chunk sizes, the rest is the script.
+ *
+ * Build with clang -fsanitize=fuzzer -DPARSER_FUZZ_LIBFUZZER for libFuzzer.
+ * Without it the file has its own main() for AFL and for plain runs:
+ *
+ *   ./parser_fuzz FILE...    Run the files as inputs, stdin if none.
+ *   ./parser_fuzz -r [N]     Run N random inputs, 100000 by default.
+ */
+
+/** Parse results serialized to be compared. */
+struct fuzz_out {
+	char *data;
+	size_t size;
+	size_t capacity;
+};
+
+static void
+fuzz_out_append(struct fuzz_out *out, const void *data, size_t size)
+{
+	if (out->size + size > out->capacity) {
+		out->capacity = (out->capacity + size) * 2;
+		out->data = realloc(out->data, out->capacity);
+	}
+	memcpy(out->data + out->size, data, size);
+	out->size += size;
+}
+
+static void
+fuzz_out_str(struct fuzz_out *out, const char *str)
+{
+	/* With the terminating zero, so "a" "b" differs from "ab". */
+	fuzz_out_append(out, str, strlen(str) + 1);
+}
+
+static void
+fuzz_out_int(struct fuzz_out *out, int value)
+{
+	fuzz_out_append(out, &value, sizeof(value));
+}
+
+static void
+fuzz_out_line(struct fuzz_out *out, const struct command_line *line)
+{
+	for (const struct expr *e = line->head; e != NULL; e = e->next) {
+		fuzz_out_int(out, e->type);
+		if (e->type != EXPR_TYPE_COMMAND)
+			continue;
+		fuzz_out_str(out, e->cmd.exe);
+		fuzz_out_int(out, e->cmd.arg_count);
+		for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+			fuzz_out_str(out, e->cmd.args[i]);
+	}
+	fuzz_out_int(out, line->out_type);
+	if (line->out_type != OUTPUT_TYPE_STDOUT)
+		fuzz_out_str(out, line->out_file);
+	fuzz_out_int(out, line->is_background);
+}
+
+/** Pop all the complete lines. */
+static void
+fuzz_pop_all(struct parser *p, struct fuzz_out *out)
+{
+	while (true) {
+		struct command_line *line = NULL;
+		enum parser_error err = parser_pop_next(p, &line);
+		if (err != PARSER_ERR_NONE) {
+			fuzz_out_int(out, -(int)err);
+			continue;
+		}
+		if (line == NULL)
+			return;
+		fuzz_out_line(out, line);
+		command_line_delete(line);
+	}
+}
+
+/**
+ * Parse the script fed in chunks. @a seed 0 means the whole script at once,
+ * 1 byte by byte, and other values pseudo-random chunks of 1-16 bytes.
+ */
+static void
+fuzz_parse(const char *script, size_t size, unsigned seed,
+	   struct fuzz_out *out)
+{
+	struct parser *p = parser_new();
+	uint32_t state = seed * 2654435761u + 1;
+	size_t pos = 0;
+	while (pos < size) {
+		size_t chunk = size - pos;
+		if (seed == 1) {
+			chunk = 1;
+		} else if (seed > 1) {
+			/* xorshift32. */
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			if (chunk > state % 16 + 1)
+				chunk = state % 16 + 1;
+		}
+		parser_feed(p, script + pos, chunk);
+		pos += chunk;
+		fuzz_pop_all(p, out);
+	}
+	parser_delete(p);
+}
+
+static void
+fuzz_one(const unsigned char *data, size_t size)
+{
+	if (size == 0)
+		return;
+	unsigned seed = data[0] + 2;
+	const char *script = (const char *)data + 1;
+	--size;
+	struct fuzz_out whole = {0};
+	fuzz_parse(script, size, 0, &whole);
+	for (unsigned s = 1; s <= seed; s += seed - 1) {
+		struct fuzz_out chunked = {0};
+		fuzz_parse(script, size, s, &chunked);
+		if (chunked.size != whole.size || (whole.size != 0 &&
+		    memcmp(chunked.data, whole.data, whole.size) != 0)) {
+			fprintf(stderr, "parse results differ, chunk seed %u\n",
+				s);
+			abort();
+		}
+		free(chunked.data);
+	}
+	free(whole.data);
+}
+
+#ifdef PARSER_FUZZ_LIBFUZZER
+
+int
+LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	fuzz_one(data, size);
+	return 0;
+}
+
+#else
+
+static void
+fuzz_file(FILE *f)
+{
+	size_t size = 0;
+	size_t capacity = 4096;
+	unsigned char *data = malloc(capacity);
+	size_t rc;
+	while ((rc = fread(data + size, 1, capacity - size, f)) > 0) {
+		size += rc;
+		if (size == capacity) {
+			capacity *= 2;
+			data = realloc(data, capacity);
+		}
+	}
+	fuzz_one(data, size);
+	free(data);
+}
+
+/**
+ * Inputs made mostly of the characters the tokenizer cares about, so short
+ * random strings hit the interesting paths.
+ */
+static void
+fuzz_random(long count)
+{
+	static const char alphabet[] = "ab \t\n\\'\"|&>#";
+	unsigned char data[64];
+	srand(0);
+	for (long i = 0; i < count; ++i) {
+		size_t size = 1 + rand() % (sizeof(data) - 1);
+		data[0] = rand();
+		for (size_t j = 1; j < size; ++j)
+			data[j] = alphabet[rand() % (sizeof(alphabet) - 1)];
+		fuzz_one(data, size);
+	}
+	printf("%ld random inputs passed\n", count);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "-r") == 0) {
+		fuzz_random(argc > 2 ? atol(argv[2]) : 100000);
+		return 0;
+	}
+	if (argc == 1) {
+		fuzz_file(stdin);
+		return 0;
+	}
+	for (int i = 1; i < argc; ++i) {
+		FILE *f = fopen(argv[i], "rb");
+		if (f == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		fuzz_file(f);
+		fclose(f);
+	}
+	return 0;
+}
+
+#endif
@@ -773,6 +773,41 @@ test_background(void)
 	unit_test_finish();
 }
 
+static void
+test_empty_tokens(void)
+{
+	unit_test_start();
+	struct parser *p = parser_new();
+	struct command_line *line = NULL;
+
+	const char *str = "echo '' \"\"\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	struct expr *e = line->head;
+	unit_check(strcmp(e->cmd.exe, "echo") == 0, "exe");
+	unit_check(e->cmd.arg_count == 2, "arg count");
+	unit_check(strcmp(e->cmd.args[0], "") == 0, "empty arg 1");
+	unit_check(strcmp(e->cmd.args[1], "") == 0, "empty arg 2");
+	command_line_delete(line);
+
+	unit_msg("Spaces after a line continuation");
+	str = "\\\n  ls\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	command_line_delete(line);
+
+	unit_msg("New line after a line continuation");
+	str = "\\\n\nls\n";
+	parser_feed(p, str, strlen(str));
+	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse");
+	unit_check(strcmp(line->head->cmd.exe, "ls") == 0, "exe");
+	command_line_delete(line);
+
+	parser_delete(p);
+	unit_test_finish();
+}
+
 static void
 test_error_one(struct parser *p, const char *expr, enum parser_error err)
 {
@@ -808,6 +843,8 @@ test_errors(void)
 	test_error_one(p, "exe |", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe &&", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 	test_error_one(p, "exe ||", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, "> test.txt", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
+	test_error_one(p, " &", PARSER_ERR_ENDS_NOT_WITH_A_COMMAND);
 
 	parser_feed(p, "echo\n", 5);
 	unit_check(parser_pop_next(p, &line) == PARSER_ERR_NONE, "parse ok");
@@ -833,6 +870,7 @@ main(void)
 	test_multiline_string();
 	test_logical_operators();
 	test_background();
+	test_empty_tokens();
 	test_errors();
 	return 0;
 }
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include "path_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** Search path used by execvp() when $PATH is not set. */
+static const char *const default_path = "/bin:/usr/bin";
+
+struct path_cache {
+	/** Entries in the order they were added. */
+	struct path_entry *entries;
+	uint32_t count;
+	uint32_t capacity;
+	/**
+	 * Open addressing hash index with linear probing. A slot stores an
+	 * entry index + 1, 0 means the slot is free. Its size is a power of
+	 * 2 and at least twice bigger than the entry count.
+	 */
+	uint32_t *slots;
+	uint32_t slot_count;
+	/** $PATH the entries were resolved with. */
+	char *path_env;
+};
+
+static uint32_t
+path_cache_hash(const char *name)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (; *name != 0; ++name)
+		h = (h ^ (unsigned char)*name) * 16777619u;
+	return h;
+}
+
+/** Slot which either holds @a name or is the free one to put it to. */
+static uint32_t *
+path_cache_slot(struct path_cache *cache, const char *name)
+{
+	uint32_t mask = cache->slot_count - 1;
+	uint32_t i = path_cache_hash(name) & mask;
+	while (cache->slots[i] != 0) {
+		struct path_entry *e = &cache->entries[cache->slots[i] - 1];
+		if (strcmp(e->name, name) == 0)
+			break;
+		i = (i + 1) & mask;
+	}
+	return &cache->slots[i];
+}
+
+static void
+path_cache_reindex(struct path_cache *cache)
+{
+	uint32_t slot_count = cache->slot_count;
+	if (slot_count == 0)
+		slot_count = 16;
+	while (slot_count < cache->capacity * 2)
+		slot_count *= 2;
+	if (slot_count != cache->slot_count) {
+		free(cache->slots);
+		cache->slots = malloc(sizeof(*cache->slots) * slot_count);
+		cache->slot_count = slot_count;
+	}
+	memset(cache->slots, 0, sizeof(*cache->slots) * slot_count);
+	for (uint32_t i = 0; i < cache->count; ++i)
+		*path_cache_slot(cache, cache->entries[i].name) = i + 1;
+}
+
+struct path_cache *
+path_cache_new(void)
+{
+	struct path_cache *cache = calloc(1, sizeof(*cache));
+	path_cache_reindex(cache);
+	return cache;
+}
+
+void
+path_cache_clear(struct path_cache *cache)
+{
+	for (uint32_t i = 0; i < cache->count; ++i) {
+		free(cache->entries[i].name);
+		free(cache->entries[i].path);
+	}
+	cache->count = 0;
+	memset(cache->slots, 0, sizeof(*cache->slots) * cache->slot_count);
+}
+
+void
+path_cache_delete(struct path_cache *cache)
+{
+	path_cache_clear(cache);
+	free(cache->entries);
+	free(cache->slots);
+	free(cache->path_env);
+	free(cache);
+}
+
+/** Flush the cache if $PATH has changed since the entries were resolved. */
+static void
+path_cache_check_env(struct path_cache *cache)
+{
+	const char *path_env = getenv("PATH");
+	if (path_env == NULL)
+		path_env = default_path;
+	if (cache->path_env != NULL && strcmp(cache->path_env, path_env) == 0)
+		return;
+	path_cache_clear(cache);
+	free(cache->path_env);
+	cache->path_env = strdup(path_env);
+}
+
+/** Find the command in $PATH the same way execvp() does. */
+static char *
+path_cache_search(const struct path_cache *cache, const char *name)
+{
+	size_t name_len = strlen(name);
+	const char *dir = cache->path_env;
+	while (true) {
+		const char *end = strchrnul(dir, ':');
+		size_t dir_len = end - dir;
+		char *path = malloc(dir_len + name_len + 2);
+		if (dir_len == 0) {
+			/* An empty entry means the current directory. */
+			path[0] = '.';
+			dir_len = 1;
+		} else {
+			memcpy(path, dir, dir_len);
+		}
+		path[dir_len] = '/';
+		memcpy(path + dir_len + 1, name, name_len + 1);
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    access(path, X_OK) == 0)
+			return path;
+		free(path);
+		if (*end == 0)
+			return NULL;
+		dir = end + 1;
+	}
+}
+
+static struct path_entry *
+path_cache_insert(struct path_cache *cache, const char *name, char *path)
+{
+	uint32_t *slot = path_cache_slot(cache, name);
+	if (*slot != 0) {
+		struct path_entry *e = &cache->entries[*slot - 1];
+		free(e->path);
+		e->path = path;
+		return e;
+	}
+	if (cache->count == cache->capacity) {
+		cache->capacity = (cache->capacity + 1) * 2;
+		cache->entries = realloc(cache->entries,
+					 sizeof(*cache->entries) *
+					 cache->capacity);
+		path_cache_reindex(cache);
+		slot = path_cache_slot(cache, name);
+	}
+	struct path_entry *e = &cache->entries[cache->count];
+	e->name = strdup(name);
+	e->path = path;
+	*slot = ++cache->count;
+	return e;
+}
+
+const char *
+path_cache_find(struct path_cache *cache, const char *name, bool *is_cached)
+{
+	*is_cached = false;
+	if (strchr(name, '/') != NULL)
+		return name;
+	path_cache_check_env(cache);
+	uint32_t slot = *path_cache_slot(cache, name);
+	if (slot != 0) {
+		struct path_entry *e = &cache->entries[slot - 1];
+		*is_cached = true;
+		++e->hits;
+		return e->path;
+	}
+	char *path = path_cache_search(cache, name);
+	if (path == NULL)
+		return NULL;
+	struct path_entry *e = path_cache_insert(cache, name, path);
+	e->hits = 1;
+	return e->path;
+}
+
+int
+path_cache_add(struct path_cache *cache, const char *name)
+{
+	path_cache_check_env(cache);
+	char *path = path_cache_search(cache, name);
+	if (path == NULL)
+		return -1;
+	path_cache_insert(cache, name, path)->hits = 0;
+	return 0;
+}
+
+void
+path_cache_forget(struct path_cache *cache, const char *name)
+{
+	uint32_t slot = *path_cache_slot(cache, name);
+	if (slot == 0)
+		return;
+	struct path_entry *e = &cache->entries[slot - 1];
+	free(e->name);
+	free(e->path);
+	/* Removal is rare, keep the order and rebuild the index. */
+	--cache->count;
+	memmove(e, e + 1, (cache->count - (slot - 1)) * sizeof(*e));
+	path_cache_reindex(cache);
+}
+
+const struct path_entry *
+path_cache_entries(struct path_cache *cache, uint32_t *count)
+{
+	*count = cache->count;
+	return cache->entries;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Cache of resolved command paths, like the one behind the bash 'hash'
+ * builtin. Without it every launch probes each $PATH directory until the
+ * command is found, which for a script calling the same tools thousands of
+ * times is mostly failing syscalls. The cache is flushed when $PATH changes,
+ * and single entries are dropped when their path stops working.
+ */
+
+struct path_cache;
+
+struct path_entry {
+	/** Command name as typed. */
+	char *name;
+	/** Resolved path of the executable. */
+	char *path;
+	/** How many times the entry was used. */
+	uint32_t hits;
+};
+
+struct path_cache *
+path_cache_new(void);
+
+void
+path_cache_delete(struct path_cache *cache);
+
+/**
+ * Find the executable for a command name. Names containing '/' are returned
+ * as is and not cached.
+ * @param cache Path cache.
+ * @param name Command name.
+ * @param[out] is_cached Set to true if the path came from the cache and was
+ *     not checked now, so it might be stale.
+ *
+ * @retval NULL The command was not found in $PATH.
+ * @retval not NULL Path to execute. Valid until the next cache change.
+ */
+const char *
+path_cache_find(struct path_cache *cache, const char *name, bool *is_cached);
+
+/**
+ * Search for the command in $PATH and remember it with zero hits, even if
+ * it was cached already.
+ * @retval 0 Success.
+ * @retval -1 The command was not found.
+ */
+int
+path_cache_add(struct path_cache *cache, const char *name);
+
+/** Drop a single entry, if it exists. */
+void
+path_cache_forget(struct path_cache *cache, const char *name);
+
+/** Drop all the entries. */
+void
+path_cache_clear(struct path_cache *cache);
+
+/** Cached entries in the order they were added. */
+const struct path_entry *
+path_cache_entries(struct path_cache *cache, uint32_t *count);
@@ -0,0 +1,127 @@
+#define _GNU_SOURCE
+#include "spawn.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Throughput benchmark of the shell's data path. Runs
+ * 'cat bigfile | cat | cat > out' in the shell with the in-shell zero-copy
+ * 'cat' and with /bin/cat, each with the default and with enlarged pipe
+ * buffers, and reports MB/sec.
+ *
+ * Usage: ./pipe_bench [shell=./a.out] [size_mb=512] [runs=3]
+ */
+
+static const char *const big_path = "pipe_bench.in";
+static const char *const out_path = "pipe_bench.out";
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+bench_make_file(size_t size)
+{
+	int fd = open(big_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	char buf[1 << 16];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	for (size_t done = 0; done < size; done += sizeof(buf)) {
+		if (write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+			close(fd);
+			return -1;
+		}
+	}
+	close(fd);
+	return 0;
+}
+
+/** Run the script in the shell, return the time it took or -1. */
+static double
+bench_run(const char *shell, const char *pipe_size, const char *script)
+{
+	int fd = memfd_create("pipe_bench", MFD_CLOEXEC);
+	if (fd < 0 || write(fd, script, strlen(script)) < 0 ||
+	    lseek(fd, 0, SEEK_SET) != 0) {
+		perror("script");
+		return -1;
+	}
+	char *argv[] = {(char *)shell, "-P", (char *)pipe_size, NULL};
+	struct spawn_request req = {
+		.argv = argv,
+		.path = shell,
+		.in_fd = fd,
+		.out_fd = -1,
+		.out_file = NULL,
+		.out_append = false,
+	};
+	int exit_code;
+	double start = bench_now();
+	pid_t pid = spawn_command(&req, SPAWN_MODE_SPAWN, &exit_code);
+	close(fd);
+	if (pid <= 0)
+		return -1;
+	int status;
+	waitpid(pid, &status, 0);
+	double duration = bench_now() - start;
+	if (spawn_exit_code(status) != 0) {
+		fprintf(stderr, "the shell failed\n");
+		return -1;
+	}
+	return duration;
+}
+
+static void
+bench_case(const char *name, const char *shell, const char *cat,
+	   const char *pipe_size, size_t size_mb, int runs)
+{
+	char script[256];
+	snprintf(script, sizeof(script), "%s %s | %s | %s > %s\n", cat,
+		 big_path, cat, cat, out_path);
+	double best = -1;
+	for (int i = 0; i < runs; ++i) {
+		double t = bench_run(shell, pipe_size, script);
+		if (t < 0)
+			exit(EXIT_FAILURE);
+		if (best < 0 || t < best)
+			best = t;
+	}
+	printf("%-28s %.3f sec, %.0f MB/sec\n", name, best, size_mb / best);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *shell = argc > 1 ? argv[1] : "./a.out";
+	size_t size_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 512;
+	int runs = argc > 3 ? atoi(argv[3]) : 3;
+	if (bench_make_file(size_mb << 20) != 0) {
+		perror(big_path);
+		return EXIT_FAILURE;
+	}
+	printf("cat %zu MB | cat | cat > out, best of %d\n", size_mb, runs);
+	bench_case("/bin/cat, default pipes", shell, "/bin/cat", "0", size_mb,
+		   runs);
+	bench_case("/bin/cat, 1 MB pipes", shell, "/bin/cat", "1048576",
+		   size_mb, runs);
+	bench_case("shell cat, default pipes", shell, "cat", "0", size_mb,
+		   runs);
+	bench_case("shell cat, 1 MB pipes", shell, "cat", "1048576", size_mb,
+		   runs);
+	unlink(big_path);
+	unlink(out_path);
+	return 0;
+}
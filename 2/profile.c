@@ -0,0 +1,146 @@
+#include "profile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct profile {
+	/** Entries in the order the commands were first seen. */
+	struct profile_entry *entries;
+	int count;
+	int capacity;
+};
+
+struct profile *
+profile_new(void)
+{
+	return calloc(1, sizeof(struct profile));
+}
+
+void
+profile_delete(struct profile *profile)
+{
+	for (int i = 0; i < profile->count; ++i)
+		free(profile->entries[i].name);
+	free(profile->entries);
+	free(profile);
+}
+
+double
+profile_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+profile_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+ * A script uses a handful of distinct commands, so a linear search is
+ * cheaper than a hash here.
+ */
+static struct profile_entry *
+profile_entry(struct profile *profile, const char *name)
+{
+	for (int i = 0; i < profile->count; ++i) {
+		if (strcmp(profile->entries[i].name, name) == 0)
+			return &profile->entries[i];
+	}
+	if (profile->count == profile->capacity) {
+		profile->capacity = (profile->capacity + 1) * 2;
+		profile->entries = realloc(profile->entries,
+					   sizeof(*profile->entries) *
+					   profile->capacity);
+	}
+	struct profile_entry *e = &profile->entries[profile->count++];
+	memset(e, 0, sizeof(*e));
+	e->name = strdup(name);
+	return e;
+}
+
+void
+profile_add(struct profile *profile, const char *name, double wall_time,
+	    const struct rusage *usage)
+{
+	struct profile_entry *e = profile_entry(profile, name);
+	++e->count;
+	e->wall_time += wall_time;
+	e->user_time += profile_seconds(&usage->ru_utime);
+	e->sys_time += profile_seconds(&usage->ru_stime);
+	if (usage->ru_maxrss > e->max_rss)
+		e->max_rss = usage->ru_maxrss;
+	e->voluntary_switches += usage->ru_nvcsw;
+	e->involuntary_switches += usage->ru_nivcsw;
+}
+
+static int
+profile_entry_cmp(const void *a, const void *b)
+{
+	const struct profile_entry *ea = *(const struct profile_entry **)a;
+	const struct profile_entry *eb = *(const struct profile_entry **)b;
+	if (ea->wall_time != eb->wall_time)
+		return ea->wall_time < eb->wall_time ? 1 : -1;
+	return strcmp(ea->name, eb->name);
+}
+
+void
+profile_print(struct profile *profile, FILE *out)
+{
+	struct profile_entry *sorted[profile->count + 1];
+	for (int i = 0; i < profile->count; ++i)
+		sorted[i] = &profile->entries[i];
+	qsort(sorted, profile->count, sizeof(sorted[0]), profile_entry_cmp);
+	fprintf(out, "%-16s %8s %10s %10s %10s %12s %9s %9s\n", "command",
+		"runs", "wall, s", "user, s", "sys, s", "max RSS, KiB",
+		"vol cs", "invol cs");
+	for (int i = 0; i < profile->count; ++i) {
+		const struct profile_entry *e = sorted[i];
+		fprintf(out, "%-16s %8lu %10.3f %10.3f %10.3f %12ld %9ld %9ld\n",
+			e->name, e->count, e->wall_time, e->user_time,
+			e->sys_time, e->max_rss, e->voluntary_switches,
+			e->involuntary_switches);
+	}
+}
+
+static void
+profile_json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+	for (; *s != 0; ++s) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+int
+profile_save_json(struct profile *profile, const char *path)
+{
+	FILE *out = fopen(path, "w");
+	if (out == NULL)
+		return -1;
+	fprintf(out, "{\"commands\": [");
+	for (int i = 0; i < profile->count; ++i) {
+		const struct profile_entry *e = &profile->entries[i];
+		fprintf(out, "%s\n  {\"name\": ", i == 0 ? "" : ",");
+		profile_json_string(out, e->name);
+		fprintf(out, ", \"runs\": %lu, \"wall_sec\": %.6f, "
+			"\"user_sec\": %.6f, \"sys_sec\": %.6f, "
+			"\"max_rss_kib\": %ld, \"voluntary_ctx_switches\": %ld, "
+			"\"involuntary_ctx_switches\": %ld}", e->count,
+			e->wall_time, e->user_time, e->sys_time, e->max_rss,
+			e->voluntary_switches, e->involuntary_switches);
+	}
+	fprintf(out, "\n]}\n");
+	return fclose(out) == 0 ? 0 : -1;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdio.h>
+#include <sys/resource.h>
+
+/**
+ * Execution profile of the shell, like 'time' for every command. Each
+ * finished pipeline stage contributes its wall time and the resource usage
+ * returned by wait4(): user and system CPU, maximal RSS and context
+ * switches. The numbers are aggregated per command name and can be printed
+ * as a table or saved as JSON.
+ */
+
+struct profile;
+
+/** Totals of one command name. */
+struct profile_entry {
+	char *name;
+	/** How many times the command was run. */
+	unsigned long count;
+	double wall_time;
+	double user_time;
+	double sys_time;
+	/** Biggest maximal RSS of a single run, in KiB. */
+	long max_rss;
+	long voluntary_switches;
+	long involuntary_switches;
+};
+
+struct profile *
+profile_new(void);
+
+void
+profile_delete(struct profile *profile);
+
+/** Monotonic time in seconds to measure wall time with. */
+double
+profile_now(void);
+
+/**
+ * Account one run of a command.
+ * @param profile Profile.
+ * @param name Command name.
+ * @param wall_time Wall time of the run in seconds.
+ * @param usage Resource usage of the run.
+ */
+void
+profile_add(struct profile *profile, const char *name, double wall_time,
+	    const struct rusage *usage);
+
+/** Print the summary table, the most time consuming commands first. */
+void
+profile_print(struct profile *profile, FILE *out);
+
+/**
+ * Save the profile as JSON.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+profile_save_json(struct profile *profile, const char *path);
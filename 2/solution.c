@@ -1,134 +1,1057 @@
+#define _GNU_SOURCE
 #include "parser.h"
+#include "builtin.h"
+#include "jobs.h"
+#include "path_cache.h"
+#include "profile.h"
+#include "spawn.h"
+#include "xfer.h"
 #include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdlib.h>
 
-int cmd_cd(const struct expr *e) {
-    if (e->cmd.arg_count == 0) {
+/** State of the shell shared by all the command lines. */
+struct shell {
+    /** Exit code of the last command line. */
+    int exit_code;
+    /** Set by 'exit'. The shell stops after the current line. */
+    bool is_exiting;
+    /** Resolved paths of external commands. */
+    struct path_cache *paths;
+    /** Background jobs. */
+    struct job_table *jobs;
+    /** Buffer size for the pipes between stages, 0 for the system default. */
+    int pipe_size;
+    /** Resource usage of the commands, NULL when profiling is off. */
+    struct profile *profile;
+    /** Set between 'parallel' and 'end' while the group is being read. */
+    bool is_in_group;
+    /** Command lines of the parallel group being read. */
+    struct command_line **group;
+    int group_size;
+    int group_capacity;
+};
+
+/** Command which works with the shell state, so it can't be a plain builtin. */
+struct shell_command {
+    const char *name;
+    int (*run)(struct shell *sh, int argc, char **argv, struct builtin_buf *out);
+};
+
+static int cmd_cd(struct shell *sh, int argc, char **argv, struct builtin_buf *out) {
+    (void)sh;
+    (void)out;
+    if (argc < 2) {
+        return 0;
+    }
+
+    if (chdir(argv[1]) != 0) {
+        fprintf(stderr, "cd: %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int cmd_exit(struct shell *sh, int argc, char **argv, struct builtin_buf *out) {
+    (void)out;
+    sh->is_exiting = true;
+    if (argc < 2) {
+        return sh->exit_code;
+    }
+    return atoi(argv[1]);
+}
+
+static int cmd_hash(struct shell *sh, int argc, char **argv, struct builtin_buf *out) {
+    bool is_delete = false;
+    int exit_code = 0;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; ++i) {
+        if (!strcmp(argv[i], "-r")) {
+            path_cache_clear(sh->paths);
+        } else if (!strcmp(argv[i], "-d")) {
+            is_delete = true;
+        } else {
+            fprintf(stderr, "hash: %s: invalid option\n"
+                    "hash: usage: hash [-r] [-d] [name ...]\n", argv[i]);
+            return 2;
+        }
+    }
+    if (argc == 1) {
+        uint32_t count;
+        const struct path_entry *entries = path_cache_entries(sh->paths, &count);
+        if (count == 0) {
+            builtin_buf_printf(out, "hash: hash table empty\n");
+            return 0;
+        }
+        builtin_buf_printf(out, "hits\tcommand\n");
+        for (uint32_t j = 0; j < count; ++j)
+            builtin_buf_printf(out, "%4u\t%s\n", entries[j].hits, entries[j].path);
+        return 0;
+    }
+    for (; i < argc; ++i) {
+        if (strchr(argv[i], '/') != NULL)
+            continue;
+        uint32_t count;
+        const struct path_entry *entries = path_cache_entries(sh->paths, &count);
+        bool is_found = false;
+        for (uint32_t j = 0; j < count && !is_found; ++j)
+            is_found = !strcmp(entries[j].name, argv[i]);
+        if (is_delete && is_found) {
+            path_cache_forget(sh->paths, argv[i]);
+        } else if (is_delete || path_cache_add(sh->paths, argv[i]) != 0) {
+            fprintf(stderr, "hash: %s: not found\n", argv[i]);
+            exit_code = 1;
+        }
+    }
+    return exit_code;
+}
+
+static const char *job_state_str(const struct job *job, char *buf, size_t size) {
+    if (job->state == JOB_STATE_RUNNING)
+        return "Running";
+    if (job->exit_code == 0)
+        return "Done";
+    snprintf(buf, size, "Exit %d", job->exit_code);
+    return buf;
+}
+
+static int cmd_jobs(struct shell *sh, int argc, char **argv, struct builtin_buf *out) {
+    (void)argc;
+    (void)argv;
+    int count;
+    struct job **jobs;
+
+    job_table_reap(sh->jobs);
+    jobs = job_table_jobs(sh->jobs, &count);
+    for (int i = 0; i < count; ++i) {
+        struct job *job = jobs[i];
+        char state[32];
+        char mark = i == count - 1 ? '+' : i == count - 2 ? '-' : ' ';
+        builtin_buf_printf(out, "[%d]%c  %-24s%s\n", job->id, mark,
+                           job_state_str(job, state, sizeof(state)), job->command);
+    }
+    /* Like in bash, a finished job is reported once and then forgotten. */
+    for (int i = 0; i < count; ++i) {
+        if (jobs[i]->state == JOB_STATE_DONE) {
+            job_table_remove(sh->jobs, jobs[i]);
+            jobs = job_table_jobs(sh->jobs, &count);
+            --i;
+        }
+    }
+    return 0;
+}
+
+static int cmd_wait(struct shell *sh, int argc, char **argv, struct builtin_buf *out) {
+    (void)out;
+    int exit_code = 0;
+
+    if (argc < 2) {
+        int count;
+        struct job **jobs = job_table_jobs(sh->jobs, &count);
+        while (count > 0) {
+            job_table_wait(sh->jobs, jobs[0]);
+            job_table_remove(sh->jobs, jobs[0]);
+            jobs = job_table_jobs(sh->jobs, &count);
+        }
         return 0;
     }
+    for (int i = 1; i < argc; ++i) {
+        struct job *job = job_table_find(sh->jobs, argv[i]);
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", argv[i]);
+            exit_code = 127;
+            continue;
+        }
+        exit_code = job_table_wait(sh->jobs, job);
+        job_table_remove(sh->jobs, job);
+    }
+    return exit_code;
+}
+
+/**
+ * There is no terminal job control, so 'fg' can't give the job the terminal.
+ * It only brings the job to the foreground in the sense that the shell waits
+ * for it.
+ */
+static int cmd_fg(struct shell *sh, int argc, char **argv, struct builtin_buf *out) {
+    const char *spec = argc < 2 ? "%+" : argv[1];
+    struct job *job = job_table_find(sh->jobs, spec);
 
-    return chdir(e->cmd.args[0]);
+    (void)out;
+    if (job == NULL) {
+        fprintf(stderr, "fg: %s: no such job\n", argc < 2 ? "current" : spec);
+        return 1;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    int exit_code = job_table_wait(sh->jobs, job);
+    job_table_remove(sh->jobs, job);
+    return exit_code;
 }
 
-void cmd_exit(const struct expr *e) {
-    if (e->cmd.arg_count == 0) {
-        exit(0);
+static const struct shell_command shell_commands[] = {
+    {"cd", cmd_cd},
+    {"exit", cmd_exit},
+    {"fg", cmd_fg},
+    {"hash", cmd_hash},
+    {"jobs", cmd_jobs},
+    {"wait", cmd_wait},
+};
+
+static const struct shell_command *shell_command_find(const char *name) {
+    for (size_t i = 0; i < sizeof(shell_commands) / sizeof(shell_commands[0]); ++i) {
+        if (!strcmp(shell_commands[i].name, name))
+            return &shell_commands[i];
     }
-    exit(atoi(e->cmd.args[0]));
+    return NULL;
 }
 
-int execute_base_command(const struct expr *e) {
-    char *exec_args[e->cmd.arg_count + 2];
-    exec_args[0] = e->cmd.exe;
+static void fill_argv(const struct expr *e, char **argv) {
+    argv[0] = e->cmd.exe;
 
     for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
-        exec_args[i + 1] = e->cmd.args[i];
+        argv[i + 1] = e->cmd.args[i];
 
-    exec_args[e->cmd.arg_count + 1] = NULL;
-    return execvp(e->cmd.exe, exec_args);
+    argv[e->cmd.arg_count + 1] = NULL;
 }
 
-static int execute_command(const struct command_line *line) {
-    const struct expr *e = line->head;
-    if (e->type == EXPR_TYPE_COMMAND) {
-        pid_t pid;
-        int pipe_fd[2];
-
-        for (; e != NULL; e = e->next) {
-            if (e->next && e->next->type == EXPR_TYPE_PIPE) {
-                if (pipe(pipe_fd) == -1) {
-                    perror("pipe");
-                    return EXIT_FAILURE;
-                }
-
-                pid = fork();
-
-                if (pid == -1) {
-                    perror("fork");
-                    return EXIT_FAILURE;
-                } else if (pid == 0) {
-                    close(pipe_fd[0]);
-
-                    dup2(pipe_fd[1], STDOUT_FILENO);
-                    close(pipe_fd[1]);
-
-                    return execute_base_command(e);
-                } else {
-                    close(pipe_fd[1]);
-
-                    dup2(pipe_fd[0], STDIN_FILENO);
-                    close(pipe_fd[0]);
-
-                    waitpid(pid, NULL, 0);
-                }
-            } else if (e->cmd.exe != NULL) {
-                int output_fd;
-
-                if (line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-                    output_fd = open(line->out_file, O_APPEND | O_RDWR | O_CREAT, 0664);
-                } else if (line->out_type == OUTPUT_TYPE_FILE_NEW) {
-                    output_fd = open(line->out_file, O_CREAT | O_WRONLY | O_TRUNC, 0664);
-                } else {
-                    output_fd = STDOUT_FILENO;
-                }
-
-                pid = fork();
-
-                if (pid == -1) {
-                    perror("fork");
-                    return EXIT_FAILURE;
-                } else if (pid == 0) {
-                    if (line->out_type == OUTPUT_TYPE_FILE_NEW || line->out_type == OUTPUT_TYPE_FILE_APPEND) {
-                        dup2(output_fd, STDOUT_FILENO);
-                        close(output_fd);
-                    }
-                    return execute_base_command(e);
-                } else {
-                    if (!line->is_background) {
-                        waitpid(pid, NULL, 0);
-                    } else {
-                        printf("Background process ID: %d\n", pid);
-                    }
-                }
+/** A started command of a pipeline. */
+struct stage {
+    /** Pid of the running child, or 0 when it is already reaped. */
+    pid_t pid;
+    int exit_code;
+    /** Command name. */
+    const char *name;
+    /** Start and end time and resource usage, collected when profiling. */
+    double start_time;
+    double end_time;
+    struct rusage usage;
+};
+
+static int pidfd_open(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+/**
+ * Reap all the stages of a pipeline in the order they terminate. They all are
+ * already running, so no stage can block the others on a full pipe. Children
+ * are watched via pidfds. If one can't be opened (old kernel, descriptor
+ * limit), that child is simply waited for after the others.
+ */
+static void wait_stages(struct stage *stages, int count) {
+    struct pollfd fds[count];
+    int index[count];
+    int nfds = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (stages[i].pid == 0)
+            continue;
+        int fd = pidfd_open(stages[i].pid);
+        if (fd < 0)
+            continue;
+        fds[nfds].fd = fd;
+        fds[nfds].events = POLLIN;
+        index[nfds++] = i;
+    }
+    while (nfds > 0) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+        for (int i = 0; i < nfds; ++i) {
+            if (fds[i].revents == 0)
+                continue;
+            struct stage *s = &stages[index[i]];
+            int status;
+            if (wait4(s->pid, &status, 0, &s->usage) == s->pid)
+                s->exit_code = spawn_exit_code(status);
+            s->end_time = profile_now();
+            s->pid = 0;
+            close(fds[i].fd);
+            --nfds;
+            fds[i] = fds[nfds];
+            index[i] = index[nfds];
+            --i;
+        }
+    }
+    for (int i = 0; i < nfds; ++i)
+        close(fds[i].fd);
+    for (int i = 0; i < count; ++i) {
+        struct stage *s = &stages[i];
+        int status;
+        if (s->pid == 0)
+            continue;
+        if (wait4(s->pid, &status, 0, &s->usage) == s->pid)
+            s->exit_code = spawn_exit_code(status);
+        s->end_time = profile_now();
+        s->pid = 0;
+    }
+}
+
+static int open_output_file(const struct spawn_request *req) {
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+                (req->out_append ? O_APPEND : O_TRUNC);
+    int fd = open(req->out_file, flags, 0664);
+    if (fd < 0)
+        fprintf(stderr, "%s: %s\n", req->out_file, strerror(errno));
+    return fd;
+}
+
+static int run_command(struct shell *sh, const struct shell_command *c,
+                       const struct builtin *b, int argc, char **argv,
+                       struct builtin_buf *out) {
+    if (c != NULL)
+        return c->run(sh, argc, argv, out);
+    return b->run(argc, argv, out);
+}
+
+/**
+ * Shell commands inside a pipeline or in background act on a subshell, like
+ * in bash, and don't affect the shell itself. Without @a c the subshell runs
+ * 'cat'.
+ */
+static void fork_subshell(struct shell *sh, const struct shell_command *c,
+                          int argc, char **argv, const struct spawn_request *req,
+                          struct stage *s) {
+    fflush(stdout);
+    s->pid = fork();
+    if (s->pid < 0) {
+        perror("fork");
+        s->pid = 0;
+        s->exit_code = 1;
+        return;
+    }
+    if (s->pid != 0)
+        return;
+    signal(SIGPIPE, SIG_DFL);
+    int fd = req->out_fd;
+    if (req->out_file != NULL && (fd = open_output_file(req)) < 0)
+        _exit(1);
+    if (fd >= 0)
+        dup2(fd, STDOUT_FILENO);
+    if (req->in_fd >= 0)
+        dup2(req->in_fd, STDIN_FILENO);
+    close_range(STDERR_FILENO + 1, ~0U, 0);
+    if (c == NULL)
+        _exit(xfer_cat(argc, argv, STDIN_FILENO, STDOUT_FILENO));
+    struct builtin_buf out = {0};
+    int exit_code = run_command(sh, c, NULL, argc, argv, &out);
+    builtin_buf_flush(&out, STDOUT_FILENO);
+    _exit(exit_code);
+}
+
+/**
+ * 'cat' only moves data, so the shell does it itself with in-kernel
+ * transfers instead of launching the program. Copying files to a file or to
+ * the terminal is done right in the shell. Reading stdin or feeding a pipe
+ * can block, so it is done in a forked subshell.
+ */
+static void run_cat(struct shell *sh, int argc, char **argv,
+                    const struct spawn_request *req, bool is_subshell,
+                    struct stage *s) {
+    bool is_in_shell = !is_subshell && argc > 1;
+
+    for (int i = 1; i < argc && is_in_shell; ++i)
+        is_in_shell = strcmp(argv[i], "-") != 0;
+    if (!is_in_shell) {
+        fork_subshell(sh, NULL, argc, argv, req, s);
+        return;
+    }
+    int fd = STDOUT_FILENO;
+    if (req->out_file != NULL && (fd = open_output_file(req)) < 0) {
+        s->exit_code = 1;
+        return;
+    }
+    fflush(stdout);
+    s->exit_code = xfer_cat(argc, argv, STDIN_FILENO, fd);
+    if (fd != STDOUT_FILENO)
+        close(fd);
+}
+
+/**
+ * Execute a command right in the shell. A subshell is forked only to feed a
+ * pipe with more output than the pipe can take at once, because the reader
+ * is not started yet.
+ */
+static void run_in_shell(struct shell *sh, const struct shell_command *c,
+                         const struct builtin *b, int argc, char **argv,
+                         const struct spawn_request *req, struct stage *s) {
+    struct builtin_buf out = {0};
+    int fd = STDOUT_FILENO;
+
+    if (req->out_file != NULL) {
+        if ((fd = open_output_file(req)) < 0) {
+            s->exit_code = 1;
+            return;
+        }
+    } else if (req->out_fd >= 0) {
+        fd = req->out_fd;
+    }
+    s->exit_code = run_command(sh, c, b, argc, argv, &out);
+
+    if (req->out_file == NULL && req->out_fd >= 0) {
+        int capacity = fcntl(fd, F_GETPIPE_SZ);
+        if (capacity < 0)
+            capacity = PIPE_BUF;
+        /* Try to make the whole output fit into the pipe instead. */
+        if (out.size > (size_t)capacity && out.size <= INT_MAX &&
+            fcntl(fd, F_SETPIPE_SZ, (int)out.size) >= 0)
+            capacity = fcntl(fd, F_GETPIPE_SZ);
+        if (out.size > (size_t)capacity) {
+            fflush(stdout);
+            s->pid = fork();
+            if (s->pid == 0) {
+                signal(SIGPIPE, SIG_DFL);
+                /* Don't keep the pipe's read end, or it never breaks. */
+                dup2(fd, STDOUT_FILENO);
+                close_range(STDERR_FILENO + 1, ~0U, 0);
+                builtin_buf_flush(&out, STDOUT_FILENO);
+                _exit(s->exit_code);
+            }
+            if (s->pid < 0) {
+                perror("fork");
+                s->pid = 0;
+                s->exit_code = 1;
             }
+            builtin_buf_destroy(&out);
+            return;
         }
+    } else if (fd == STDOUT_FILENO) {
+        fflush(stdout);
     }
+    /* The shell ignores SIGPIPE, so report it the way a killed tool would. */
+    if (builtin_buf_flush(&out, fd) != 0 && errno == EPIPE)
+        s->exit_code = 128 + SIGPIPE;
+    if (req->out_file != NULL)
+        close(fd);
+    builtin_buf_destroy(&out);
+}
+
+/**
+ * Launch an external command by its cached path. A stale cache entry is
+ * dropped and the command is looked up again.
+ */
+static void spawn_external(struct shell *sh, struct spawn_request *req,
+                           struct stage *s) {
+    bool is_cached;
+    req->path = path_cache_find(sh->paths, req->argv[0], &is_cached);
+    if (req->path == NULL) {
+        /* Like bash, the output file is created even for a bad command. */
+        int fd = -1;
+        if (req->out_file != NULL && (fd = open_output_file(req)) < 0) {
+            s->exit_code = 1;
+            return;
+        }
+        if (fd >= 0)
+            close(fd);
+        fprintf(stderr, "%s: command not found\n", req->argv[0]);
+        s->exit_code = 127;
+        return;
+    }
+    req->is_quiet = is_cached;
+    s->pid = spawn_command(req, SPAWN_MODE_SPAWN, &s->exit_code);
+    if (s->pid == 0 && is_cached) {
+        path_cache_forget(sh->paths, req->argv[0]);
+        spawn_external(sh, req, s);
+    }
+}
+
+/** Start one command of a pipeline in the most lightweight way possible. */
+static void start_stage(struct shell *sh, int argc, char **argv,
+                        struct spawn_request *req, bool is_subshell,
+                        struct stage *s) {
+    const struct shell_command *c = shell_command_find(argv[0]);
+    const struct builtin *b = c == NULL ? builtin_find(argc, argv) : NULL;
+
+    struct rusage before;
+
+    memset(s, 0, sizeof(*s));
+    s->name = argv[0];
+    if (sh->profile != NULL) {
+        s->start_time = profile_now();
+        getrusage(RUSAGE_SELF, &before);
+    }
+    if (c == NULL && !strcmp(argv[0], "cat") && xfer_cat_is_supported(argc, argv))
+        run_cat(sh, argc, argv, req, is_subshell, s);
+    else if (c != NULL && is_subshell)
+        fork_subshell(sh, c, argc, argv, req, s);
+    else if (c != NULL || b != NULL)
+        run_in_shell(sh, c, b, argc, argv, req, s);
+    else
+        spawn_external(sh, req, s);
+    if (sh->profile != NULL && s->pid == 0) {
+        /* Executed right in the shell, account the shell's own usage. */
+        struct rusage after;
+        getrusage(RUSAGE_SELF, &after);
+        s->end_time = profile_now();
+        timersub(&after.ru_utime, &before.ru_utime, &s->usage.ru_utime);
+        timersub(&after.ru_stime, &before.ru_stime, &s->usage.ru_stime);
+        s->usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+        s->usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    }
+}
+
+static int pipeline_length(const struct expr *e) {
+    int count = 1;
+    for (; e->next != NULL && e->next->type == EXPR_TYPE_PIPE; e = e->next->next)
+        ++count;
+    return count;
+}
+
+/**
+ * Start all the commands of the pipeline beginning at @a e, connected with
+ * pipes. Stages which could not be started get pid 0 and their exit code.
+ * Returns how many stages were started, or -1 on a system error.
+ */
+static int start_pipeline(struct shell *sh, const struct command_line *line,
+                          const struct expr *e, struct stage *stages) {
+    bool is_subshell = line->is_background || pipeline_length(e) > 1;
+    int count = 0;
+    int in_fd = -1;
+
+    /* Background jobs must not steal the input of the shell. */
+    if (line->is_background &&
+        (in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("/dev/null");
+        return -1;
+    }
+
+    for (;; e = e->next->next) {
+        char *argv[e->cmd.arg_count + 2];
+        fill_argv(e, argv);
+        struct spawn_request req = {
+            .argv = argv,
+            .path = NULL,
+            .is_quiet = false,
+            .in_fd = in_fd,
+            .out_fd = -1,
+            .out_file = NULL,
+            .out_append = false,
+        };
+        int pipe_fd[2] = {-1, -1};
+        bool is_last = e->next == NULL || e->next->type != EXPR_TYPE_PIPE;
+
+        if (!is_last) {
+            if (pipe2(pipe_fd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                break;
+            }
+            /* Bigger pipes mean fewer context switches between stages. */
+            if (sh->pipe_size > 0)
+                fcntl(pipe_fd[1], F_SETPIPE_SZ, sh->pipe_size);
+            req.out_fd = pipe_fd[1];
+        } else if (e->next == NULL && line->out_type != OUTPUT_TYPE_STDOUT) {
+            req.out_file = line->out_file;
+            req.out_append = line->out_type == OUTPUT_TYPE_FILE_APPEND;
+        }
+
+        struct stage *s = &stages[count];
+        start_stage(sh, e->cmd.arg_count + 1, argv, &req, is_subshell, s);
+
+        if (in_fd >= 0)
+            close(in_fd);
+        if (pipe_fd[1] >= 0)
+            close(pipe_fd[1]);
+        in_fd = pipe_fd[0];
+
+        if (s->pid == -1) {
+            perror("spawn");
+            break;
+        }
+        ++count;
+        if (is_last)
+            return count;
+    }
+    if (in_fd >= 0)
+        close(in_fd);
+    wait_stages(stages, count);
+    return -1;
+}
+
+/**
+ * Execute the pipelines of the line one by one and wait for them. '&&' and
+ * '||' have the same priority and short-circuit left to right: a skipped
+ * pipeline keeps the status of the previous one.
+ */
+static int run_pipelines(struct shell *sh, const struct command_line *line) {
+    int exit_code = 0;
+    enum expr_type op = EXPR_TYPE_COMMAND;
+
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        if (e->type != EXPR_TYPE_COMMAND) {
+            op = e->type;
+            continue;
+        }
+
+        int count = pipeline_length(e);
+        bool is_skipped = (op == EXPR_TYPE_AND && exit_code != 0) ||
+                          (op == EXPR_TYPE_OR && exit_code == 0);
+        if (is_skipped) {
+            for (int i = 1; i < count; ++i)
+                e = e->next->next;
+            continue;
+        }
+
+        struct stage stages[count];
+
+        if (start_pipeline(sh, line, e, stages) < 0)
+            return EXIT_FAILURE;
+        for (int i = 1; i < count; ++i)
+            e = e->next->next;
+
+        wait_stages(stages, count);
+        if (sh->profile != NULL) {
+            for (int i = 0; i < count; ++i) {
+                struct stage *st = &stages[i];
+                profile_add(sh->profile, st->name,
+                            st->end_time - st->start_time, &st->usage);
+            }
+        }
+        /* Like bash, the status of a pipeline is that of its last stage. */
+        exit_code = stages[count - 1].exit_code;
+        if (sh->is_exiting)
+            break;
+    }
+    return exit_code;
+}
+
+/** Command line text as shown by 'jobs'. */
+static char *command_line_text(const struct command_line *line) {
+    struct builtin_buf text = {0};
+
+    for (const struct expr *e = line->head; e != NULL; e = e->next) {
+        switch (e->type) {
+        case EXPR_TYPE_COMMAND:
+            builtin_buf_printf(&text, "%s", e->cmd.exe);
+            for (uint32_t i = 0; i < e->cmd.arg_count; ++i)
+                builtin_buf_printf(&text, " %s", e->cmd.args[i]);
+            break;
+        case EXPR_TYPE_PIPE:
+            builtin_buf_printf(&text, " | ");
+            break;
+        case EXPR_TYPE_AND:
+            builtin_buf_printf(&text, " && ");
+            break;
+        case EXPR_TYPE_OR:
+            builtin_buf_printf(&text, " || ");
+            break;
+        }
+    }
+    if (line->out_type == OUTPUT_TYPE_FILE_NEW)
+        builtin_buf_printf(&text, " > %s", line->out_file);
+    else if (line->out_type == OUTPUT_TYPE_FILE_APPEND)
+        builtin_buf_printf(&text, " >> %s", line->out_file);
+    builtin_buf_printf(&text, " &");
+    return text.data;
+}
+
+/**
+ * Start the line as a background job. A single pipeline is started as is and
+ * its stages become the job. A longer line needs to be driven by somebody, so
+ * it is executed by a forked subshell.
+ */
+static int start_job(struct shell *sh, const struct command_line *line) {
+    const struct expr *e = line->head;
+    int count = pipeline_length(e);
+    char *command = command_line_text(line);
+
+    job_table_wait_slot(sh->jobs);
+    for (int i = 1; i < count; ++i)
+        e = e->next->next;
+    if (e->next == NULL) {
+        struct stage stages[count];
+        pid_t pids[count];
+        if (start_pipeline(sh, line, line->head, stages) < 0) {
+            free(command);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < count; ++i)
+            pids[i] = stages[i].pid;
+        job_table_add(sh->jobs, command, pids, count, stages[count - 1].exit_code);
+        free(command);
+        return 0;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        free(command);
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        int fd = open("/dev/null", O_RDONLY);
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+        struct command_line fg_line = *line;
+        fg_line.is_background = false;
+        int exit_code = run_pipelines(sh, &fg_line);
+        fflush(stdout);
+        _exit(exit_code);
+    }
+    job_table_add(sh->jobs, command, &pid, 1, 0);
+    free(command);
     return 0;
 }
 
-static int execute_command_line(const struct command_line *line) {
+static int execute_command(struct shell *sh, const struct command_line *line) {
+    if (line->is_background)
+        return start_job(sh, line);
+    return run_pipelines(sh, line);
+}
+
+/** Whether the line is the bare word @a keyword. */
+static bool is_keyword(const struct command_line *line, const char *keyword) {
+    const struct expr *e = line->head;
+    return e != NULL && e->next == NULL && e->cmd.arg_count == 0 &&
+           !line->is_background && line->out_type == OUTPUT_TYPE_STDOUT &&
+           !strcmp(e->cmd.exe, keyword);
+}
+
+/** A command line of a parallel group running in its own subshell. */
+struct group_job {
+    pid_t pid;
+    /** Pidfd of the process, or -1 if it couldn't be opened. */
+    int pidfd;
+    /** Captured stdout of the job. */
+    int out_fd;
+    /** Captured stderr of the job. */
+    int err_fd;
+    int exit_code;
+    bool is_done;
+};
+
+static void group_job_close(struct group_job *job) {
+    if (job->pidfd >= 0)
+        close(job->pidfd);
+    if (job->out_fd >= 0)
+        close(job->out_fd);
+    if (job->err_fd >= 0)
+        close(job->err_fd);
+    job->pidfd = job->out_fd = job->err_fd = -1;
+}
 
-    if (line->head->cmd.exe != NULL && !strcmp(line->head->cmd.exe, "cd")) {
-        cmd_cd(line->head);
-    } else if (line->head->cmd.exe != NULL && !strcmp(line->head->cmd.exe, "exit")) {
-        cmd_exit(line->head);
-    } else {
-//        pid_t pid = fork();
-//        if (pid == 0) {
-//            return execute_command(line);
-//        } else {
-//            wait(NULL);
-//        }
-            return execute_command(line);
+/** Start a line of the group with its output going to memory files. */
+static int group_job_start(struct shell *sh, struct command_line *line,
+                           struct group_job *job) {
+    job->pidfd = -1;
+    job->is_done = false;
+    job->exit_code = 0;
+    job->out_fd = memfd_create("parallel-out", MFD_CLOEXEC);
+    job->err_fd = memfd_create("parallel-err", MFD_CLOEXEC);
+    if (job->out_fd < 0 || job->err_fd < 0) {
+        perror("memfd_create");
+        group_job_close(job);
+        return -1;
     }
+    fflush(stdout);
+    job->pid = fork();
+    if (job->pid < 0) {
+        perror("fork");
+        group_job_close(job);
+        return -1;
+    }
+    if (job->pid == 0) {
+        int fd = open("/dev/null", O_RDONLY);
+        if (fd >= 0) {
+            dup2(fd, STDIN_FILENO);
+            close(fd);
+        }
+        dup2(job->out_fd, STDOUT_FILENO);
+        dup2(job->err_fd, STDERR_FILENO);
+        int exit_code = execute_command(sh, line);
+        fflush(stdout);
+        _exit(exit_code);
+    }
+    job->pidfd = pidfd_open(job->pid);
     return 0;
 }
 
-int main(void) {
+static void group_job_reap(struct group_job *job) {
+    int status;
+
+    if (waitpid(job->pid, &status, 0) == job->pid)
+        job->exit_code = spawn_exit_code(status);
+    job->is_done = true;
+}
+
+/** Block until at least one of the running jobs is done. */
+static void group_wait_any(struct group_job *jobs, int count) {
+    struct pollfd fds[count];
+    int index[count];
+    int nfds = 0;
+
+    for (int i = 0; i < count; ++i) {
+        if (jobs[i].pid == 0 || jobs[i].is_done)
+            continue;
+        if (jobs[i].pidfd < 0) {
+            group_job_reap(&jobs[i]);
+            return;
+        }
+        fds[nfds].fd = jobs[i].pidfd;
+        fds[nfds].events = POLLIN;
+        index[nfds++] = i;
+    }
+    if (nfds == 0)
+        return;
+    while (poll(fds, nfds, -1) < 0) {
+        if (errno != EINTR) {
+            perror("poll");
+            group_job_reap(&jobs[index[0]]);
+            return;
+        }
+    }
+    for (int i = 0; i < nfds; ++i) {
+        if (fds[i].revents != 0)
+            group_job_reap(&jobs[index[i]]);
+    }
+}
+
+/**
+ * Run the lines of the parallel group concurrently, at most -j at once, or
+ * one per CPU. Each line runs in a subshell with its output captured, and
+ * the outputs are printed in the order of the lines as soon as all the
+ * lines before are done, so they never interleave. The status of the group
+ * is the first nonzero status of its lines in order, or 0.
+ */
+static int run_group(struct shell *sh) {
+    int count = sh->group_size;
+    struct group_job jobs[count];
+    int limit = job_table_max_running(sh->jobs);
+    int started = 0;
+    int relayed = 0;
     int exit_code = 0;
+
+    if (limit == 0)
+        limit = sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit < 1)
+        limit = 1;
+    while (relayed < count) {
+        int running = 0;
+        for (int i = relayed; i < started; ++i)
+            running += !jobs[i].is_done;
+        if (started < count && running < limit) {
+            struct group_job *job = &jobs[started];
+            if (group_job_start(sh, sh->group[started], job) != 0) {
+                job->pid = 0;
+                job->exit_code = 1;
+                job->is_done = true;
+            }
+            ++started;
+            continue;
+        }
+        for (; relayed < started && jobs[relayed].is_done; ++relayed) {
+            struct group_job *job = &jobs[relayed];
+            fflush(stdout);
+            if (lseek(job->out_fd, 0, SEEK_SET) == 0)
+                xfer_all(job->out_fd, STDOUT_FILENO);
+            if (lseek(job->err_fd, 0, SEEK_SET) == 0)
+                xfer_all(job->err_fd, STDERR_FILENO);
+            group_job_close(job);
+            if (exit_code == 0)
+                exit_code = job->exit_code;
+        }
+        if (running > 0)
+            group_wait_any(jobs + relayed, started - relayed);
+    }
+    return exit_code;
+}
+
+static void group_clear(struct shell *sh) {
+    for (int i = 0; i < sh->group_size; ++i)
+        command_line_delete(sh->group[i]);
+    free(sh->group);
+    sh->group = NULL;
+    sh->group_size = 0;
+    sh->group_capacity = 0;
+    sh->is_in_group = false;
+}
+
+/**
+ * Execute a parsed line, or collect it into a parallel group. The group is
+ * opt-in: it starts with a line 'parallel' and ends with a line 'end'.
+ * Takes ownership of the line.
+ */
+static void handle_line(struct shell *sh, struct command_line *line) {
+    if (!sh->is_in_group) {
+        if (is_keyword(line, "parallel"))
+            sh->is_in_group = true;
+        else
+            sh->exit_code = execute_command(sh, line);
+        command_line_delete(line);
+        return;
+    }
+    if (is_keyword(line, "end")) {
+        command_line_delete(line);
+        sh->exit_code = run_group(sh);
+        group_clear(sh);
+        return;
+    }
+    if (is_keyword(line, "parallel")) {
+        fprintf(stderr, "parallel: nested groups are not supported\n");
+        command_line_delete(line);
+        return;
+    }
+    if (sh->group_size == sh->group_capacity) {
+        sh->group_capacity = (sh->group_capacity + 1) * 2;
+        sh->group = realloc(sh->group, sizeof(*sh->group) * sh->group_capacity);
+    }
+    sh->group[sh->group_size++] = line;
+}
+
+/**
+ * Report the background jobs which are done and forget them, so the table
+ * doesn't grow with every '&'. Like bash, only an interactive shell reports
+ * them, on stderr.
+ */
+static void forget_done_jobs(struct shell *sh) {
+    int count;
+    struct job **jobs = job_table_jobs(sh->jobs, &count);
+    bool is_interactive = isatty(STDIN_FILENO);
+
+    for (int i = 0; i < count; ++i) {
+        struct job *job = jobs[i];
+        if (job->state != JOB_STATE_DONE)
+            continue;
+        if (is_interactive) {
+            char state[32];
+            char mark = i == count - 1 ? '+' : i == count - 2 ? '-' : ' ';
+            fprintf(stderr, "[%d]%c  %-24s%s\n", job->id, mark,
+                    job_state_str(job, state, sizeof(state)), job->command);
+        }
+        job_table_remove(sh->jobs, job);
+        jobs = job_table_jobs(sh->jobs, &count);
+        --i;
+    }
+}
+
+/**
+ * Reap the terminated background children, if SIGCHLD is pending, and
+ * forget the jobs which are done. One read() can bring many command lines,
+ * so this is checked before each of them too.
+ */
+static void handle_sigchld(struct shell *sh) {
+    struct pollfd pfd = {.fd = job_table_fd(sh->jobs), .events = POLLIN};
+
+    if (poll(&pfd, 1, 0) > 0) {
+        job_table_reap(sh->jobs);
+        forget_done_jobs(sh);
+    }
+}
+
+/**
+ * Wait until either input is available or a child has terminated. Terminated
+ * background children are reaped right away, so they don't stay zombies even
+ * when the shell is idle, and the finished jobs are forgotten.
+ */
+static int wait_input(struct shell *sh) {
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = job_table_fd(sh->jobs), .events = POLLIN},
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (fds[1].revents != 0) {
+            job_table_reap(sh->jobs);
+            forget_done_jobs(sh);
+        }
+        if (fds[0].revents != 0)
+            return 0;
+    }
+}
+
+/**
+ * Pipe buffer size for pipelines. It is the default limit for unprivileged
+ * processes in /proc/sys/fs/pipe-max-size. A bigger size is silently not
+ * applied.
+ */
+enum { DEFAULT_PIPE_SIZE = 1 << 20 };
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-j max_jobs] [-P pipe_size] [-p profile.json]\n", name);
+}
+
+int main(int argc, char **argv) {
+    int max_jobs = 0;
+    int pipe_size = DEFAULT_PIPE_SIZE;
+    int opt;
+
+    const char *profile_path = NULL;
+
+    while ((opt = getopt(argc, argv, "j:P:p:")) != -1) {
+        char *end;
+        switch (opt) {
+        case 'j':
+            max_jobs = strtol(optarg, &end, 10);
+            if (*end != 0 || end == optarg || max_jobs < 0) {
+                fprintf(stderr, "%s: invalid job limit '%s'\n", argv[0], optarg);
+                return 2;
+            }
+            break;
+        case 'P':
+            pipe_size = strtol(optarg, &end, 10);
+            if (*end != 0 || end == optarg || pipe_size < 0) {
+                fprintf(stderr, "%s: invalid pipe size '%s'\n", argv[0], optarg);
+                return 2;
+            }
+            break;
+        case 'p':
+            profile_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct shell sh = {
+        .exit_code = 0,
+        .is_exiting = false,
+        .paths = path_cache_new(),
+        .jobs = job_table_new(max_jobs),
+        .pipe_size = pipe_size,
+        .profile = profile_path != NULL ? profile_new() : NULL,
+        .is_in_group = false,
+        .group = NULL,
+        .group_size = 0,
+        .group_capacity = 0,
+    };
     const size_t buf_size = 1024;
     char buf[buf_size];
-    int rc;
+    int rc = 0;
     struct parser *p = parser_new();
-    while ((rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
+
+    signal(SIGPIPE, SIG_IGN);
+    while (!sh.is_exiting && (rc = wait_input(&sh)) == 0 &&
+           (rc = read(STDIN_FILENO, buf, buf_size)) > 0) {
         parser_feed(p, buf, rc);
         struct command_line *line = NULL;
-        while (exit_code == 0) {
+        while (!sh.is_exiting) {
             enum parser_error err = parser_pop_next(p, &line);
             if (err == PARSER_ERR_NONE && line == NULL)
                 break;
@@ -136,14 +1059,27 @@ int main(void) {
                 fprintf(stderr, "Error: %d\n", (int)err);
                 continue;
             }
-            exit_code = execute_command_line(line);
-            command_line_delete(line);
+            handle_sigchld(&sh);
+            handle_line(&sh, line);
         }
     }
+    if (sh.is_in_group) {
+        fprintf(stderr, "parallel: missing 'end'\n");
+        sh.exit_code = 2;
+        group_clear(&sh);
+    }
     if (rc < 0) {
         perror("read");
-        exit_code = EXIT_FAILURE;
+        sh.exit_code = EXIT_FAILURE;
     }
     parser_delete(p);
-    return exit_code;
+    path_cache_delete(sh.paths);
+    job_table_delete(sh.jobs);
+    if (sh.profile != NULL) {
+        profile_print(sh.profile, stderr);
+        if (profile_save_json(sh.profile, profile_path) != 0)
+            fprintf(stderr, "%s: %s\n", profile_path, strerror(errno));
+        profile_delete(sh.profile);
+    }
+    return sh.exit_code;
 }
@@ -0,0 +1,275 @@
+#include "spawn.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+static int
+spawn_out_flags(const struct spawn_request *req)
+{
+	return O_WRONLY | O_CREAT | (req->out_append ? O_APPEND : O_TRUNC);
+}
+
+/**
+ * Whether the error returned by posix_spawn() means the command itself can't
+ * be executed, so retrying via fork() makes no sense.
+ */
+static bool
+spawn_is_exec_error(int err)
+{
+	switch (err) {
+	case ENOENT:
+	case EACCES:
+	case ENOEXEC:
+	case ENOTDIR:
+	case ELOOP:
+	case ENAMETOOLONG:
+	case EISDIR:
+	case E2BIG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/** Report an exec failure like bash does, and return its exit code. */
+static int
+spawn_report_exec_error(const char *name, int err)
+{
+	if (err == ENOENT && strchr(name, '/') == NULL) {
+		fprintf(stderr, "%s: command not found\n", name);
+		return 127;
+	}
+	fprintf(stderr, "%s: %s\n", name, strerror(err));
+	return err == ENOENT ? 127 : 126;
+}
+
+/**
+ * Find @a name in $PATH the way posix_spawnp() does. Returns a new string
+ * or NULL.
+ */
+static char *
+spawn_search_path(const char *name)
+{
+	if (strchr(name, '/') != NULL)
+		return strdup(name);
+	const char *dirs = getenv("PATH");
+	if (dirs == NULL)
+		dirs = "/bin:/usr/bin";
+	size_t name_len = strlen(name);
+	while (true) {
+		const char *end = strchr(dirs, ':');
+		size_t dir_len = end != NULL ? (size_t)(end - dirs) :
+				 strlen(dirs);
+		char *path = malloc(dir_len + name_len + 2);
+		if (path == NULL)
+			return NULL;
+		if (dir_len == 0) {
+			strcpy(path, name);
+		} else {
+			memcpy(path, dirs, dir_len);
+			path[dir_len] = '/';
+			strcpy(path + dir_len + 1, name);
+		}
+		struct stat st;
+		if (stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+		    access(path, X_OK) == 0)
+			return path;
+		free(path);
+		if (end == NULL)
+			return NULL;
+		dirs = end + 1;
+	}
+}
+
+/**
+ * Arguments to run a file which the kernel refused to execute as a shell
+ * script, like execvp() does: /bin/sh path argv[1] ... Returns a new
+ * vector or NULL.
+ */
+static char **
+spawn_script_argv(const char *path, char **argv)
+{
+	int argc = 0;
+	while (argv[argc] != NULL)
+		++argc;
+	char **sh_argv = malloc((argc + 2) * sizeof(*sh_argv));
+	if (sh_argv == NULL)
+		return NULL;
+	sh_argv[0] = "/bin/sh";
+	sh_argv[1] = (char *)path;
+	/* argv[1] ... argv[argc - 1] and the terminating NULL. */
+	memcpy(sh_argv + 2, argv + 1, argc * sizeof(*argv));
+	return sh_argv;
+}
+
+static int
+spawn_script_posix(const char *path, char **argv,
+		   const posix_spawn_file_actions_t *actions,
+		   const posix_spawnattr_t *attr, pid_t *pid)
+{
+	char **sh_argv = spawn_script_argv(path, argv);
+	if (sh_argv == NULL)
+		return ENOMEM;
+	int rc = posix_spawn(pid, "/bin/sh", actions, attr, sh_argv, environ);
+	free(sh_argv);
+	return rc;
+}
+
+static pid_t
+spawn_command_fork(const struct spawn_request *req)
+{
+	pid_t pid = fork();
+	if (pid != 0)
+		return pid;
+	signal(SIGPIPE, SIG_DFL);
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	if (req->in_fd >= 0 && dup2(req->in_fd, STDIN_FILENO) < 0) {
+		perror("dup2");
+		_exit(1);
+	}
+	if (req->out_file != NULL) {
+		int fd = open(req->out_file, spawn_out_flags(req), 0664);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s\n", req->out_file,
+				strerror(errno));
+			_exit(1);
+		}
+		if (fd != STDOUT_FILENO) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+	} else if (req->out_fd >= 0 && dup2(req->out_fd, STDOUT_FILENO) < 0) {
+		perror("dup2");
+		_exit(1);
+	}
+	if (req->path != NULL) {
+		execv(req->path, req->argv);
+		if (errno == ENOEXEC) {
+			char **sh_argv = spawn_script_argv(req->path,
+							   req->argv);
+			if (sh_argv != NULL)
+				execv("/bin/sh", sh_argv);
+			errno = ENOEXEC;
+		}
+		/* A stale path. Let execvp() find the command again. */
+		if (errno != ENOENT || strchr(req->argv[0], '/') != NULL)
+			_exit(spawn_report_exec_error(req->argv[0], errno));
+	}
+	execvp(req->argv[0], req->argv);
+	_exit(spawn_report_exec_error(req->argv[0], errno));
+}
+
+static int
+spawn_command_posix(const struct spawn_request *req, pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	sigset_t sigmask;
+	int rc = posix_spawn_file_actions_init(&actions);
+	if (rc != 0)
+		return rc;
+	rc = posix_spawnattr_init(&attr);
+	if (rc != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return rc;
+	}
+	/* The shell ignores SIGPIPE, but the commands must not. */
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	/* Neither must they inherit SIGCHLD blocked by the job table. */
+	sigemptyset(&sigmask);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+					POSIX_SPAWN_SETSIGMASK);
+	if (req->in_fd >= 0) {
+		rc = posix_spawn_file_actions_adddup2(&actions, req->in_fd,
+						      STDIN_FILENO);
+	}
+	if (rc == 0 && req->out_file != NULL) {
+		rc = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO,
+						      req->out_file,
+						      spawn_out_flags(req),
+						      0664);
+	} else if (rc == 0 && req->out_fd >= 0) {
+		rc = posix_spawn_file_actions_adddup2(&actions, req->out_fd,
+						      STDOUT_FILENO);
+	}
+	if (rc == 0 && req->path != NULL)
+		rc = posix_spawn(pid, req->path, &actions, &attr, req->argv,
+				 environ);
+	else if (rc == 0)
+		rc = posix_spawnp(pid, req->argv[0], &actions, &attr,
+				  req->argv, environ);
+	if (rc == ENOEXEC && req->path != NULL) {
+		rc = spawn_script_posix(req->path, req->argv, &actions, &attr,
+					pid);
+	} else if (rc == ENOEXEC) {
+		char *path = spawn_search_path(req->argv[0]);
+		if (path != NULL) {
+			rc = spawn_script_posix(path, req->argv, &actions,
+						&attr, pid);
+			free(path);
+		}
+	}
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	return rc;
+}
+
+int
+spawn_exit_code(int status)
+{
+	if (WIFSIGNALED(status))
+		return 128 + WTERMSIG(status);
+	return WEXITSTATUS(status);
+}
+
+pid_t
+spawn_command(const struct spawn_request *req, enum spawn_mode mode,
+	      int *exit_code)
+{
+	if (mode == SPAWN_MODE_FORK)
+		return spawn_command_fork(req);
+	pid_t pid;
+	int rc = spawn_command_posix(req, &pid);
+	if (rc == 0)
+		return pid;
+	if (!spawn_is_exec_error(rc))
+		return spawn_command_fork(req);
+	if (req->is_quiet) {
+		*exit_code = rc == ENOENT ? 127 : 126;
+		return 0;
+	}
+	/*
+	 * The child has already exited and was reaped by posix_spawn(). The
+	 * error can belong either to the output file action or to exec, so
+	 * check the file separately to report the right one.
+	 */
+	if (req->out_file != NULL) {
+		int fd = open(req->out_file, spawn_out_flags(req) | O_CLOEXEC,
+			      0664);
+		if (fd < 0) {
+			fprintf(stderr, "%s: %s\n", req->out_file,
+				strerror(errno));
+			*exit_code = 1;
+			return 0;
+		}
+		close(fd);
+	}
+	*exit_code = spawn_report_exec_error(req->argv[0], rc);
+	return 0;
+}
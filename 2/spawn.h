@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Process launching for the shell. A command is started either via
+ * posix_spawn(), which on Linux uses a CLONE_VFORK-style child sharing the
+ * parent's address space and therefore does not copy page tables, or via
+ * the classic fork() + exec(). The former is much cheaper for a shell with
+ * a big resident heap. All descriptor plumbing (pipes, '>' and '>>') is
+ * described declaratively in the request, so both paths do exactly the same.
+ */
+
+enum spawn_mode {
+	/** posix_spawn() with file actions. Falls back to fork() on failure. */
+	SPAWN_MODE_SPAWN,
+	/** Always fork() + exec(). */
+	SPAWN_MODE_FORK,
+};
+
+struct spawn_request {
+	/** NULL-terminated argument vector. argv[0] is the command name. */
+	char **argv;
+	/**
+	 * Resolved path of the executable, or NULL to search argv[0] in
+	 * $PATH.
+	 */
+	const char *path;
+	/**
+	 * Don't report a failure to execute @a path. It is used when the
+	 * path comes from a cache and the caller retries with a fresh one.
+	 */
+	bool is_quiet;
+	/** Descriptor to become stdin of the child, or -1 to inherit. */
+	int in_fd;
+	/** Descriptor to become stdout of the child, or -1 to inherit. */
+	int out_fd;
+	/**
+	 * File to open as stdout of the child, or NULL. Takes precedence over
+	 * @a out_fd.
+	 */
+	const char *out_file;
+	/** Append to @a out_file instead of truncating it. */
+	bool out_append;
+};
+
+/**
+ * Start a command described by @a req. Descriptors which the child must not
+ * inherit are expected to be opened with O_CLOEXEC by the caller. SIGPIPE is
+ * reset to the default action in the child, so the shell can ignore it, and
+ * the signal mask of the child is empty.
+ *
+ * @param req Launch request.
+ * @param mode Launch method.
+ * @param[out] exit_code Exit code of the command. Is set only when the
+ *     command could not be executed at all.
+ *
+ * @retval > 0 Pid of the started child.
+ * @retval 0 The command could not be executed (not found, no permission,
+ *     bad output file). The error is already reported to stderr, and
+ *     @a exit_code is set the way bash does it: 127, 126, or 1 for a bad
+ *     output file. In SPAWN_MODE_FORK such errors are detected in the
+ *     child, which then exits with the same code.
+ * @retval -1 System error, errno is set.
+ */
+pid_t
+spawn_command(const struct spawn_request *req, enum spawn_mode mode,
+	      int *exit_code);
+
+/** Convert a wait() status to an exit code: 128 + signal for a killed one. */
+int
+spawn_exit_code(int status);
@@ -0,0 +1,69 @@
+#include "spawn.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+
+/**
+ * Benchmark of the shell's process launch path. Starts 'true' in a loop while
+ * the process holds a big resident heap, like a long-running shell does, and
+ * reports how many commands per second each launch method achieves.
+ *
+ * Usage: ./spawn_bench [heap_mb] [count]
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_mode(const char *name, enum spawn_mode mode, int count)
+{
+	char *argv[] = {"true", NULL};
+	struct spawn_request req = {
+		.argv = argv,
+		.in_fd = -1,
+		.out_fd = -1,
+		.out_file = NULL,
+		.out_append = false,
+	};
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		int exit_code;
+		pid_t pid = spawn_command(&req, mode, &exit_code);
+		if (pid <= 0) {
+			fprintf(stderr, "failed to launch 'true'\n");
+			exit(EXIT_FAILURE);
+		}
+		waitpid(pid, NULL, 0);
+	}
+	double duration = bench_now() - start;
+	printf("%-6s %d launches in %.3f sec, %.0f launches/sec\n", name,
+	       count, duration, count / duration);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t heap_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+	int count = argc > 2 ? atoi(argv[2]) : 2000;
+	size_t heap_size = heap_mb * 1024 * 1024;
+	char *heap = malloc(heap_size);
+	if (heap == NULL && heap_size != 0) {
+		fprintf(stderr, "can't allocate %zu MB\n", heap_mb);
+		return EXIT_FAILURE;
+	}
+	/* Make the heap resident, so fork() has page tables to copy. */
+	memset(heap, 1, heap_size);
+	printf("resident heap: %zu MB\n", heap_mb);
+	bench_mode("spawn", SPAWN_MODE_SPAWN, count);
+	bench_mode("fork", SPAWN_MODE_FORK, count);
+	free(heap);
+	return 0;
+}
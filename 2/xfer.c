@@ -0,0 +1,169 @@
+#define _GNU_SOURCE
+#include "xfer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** How much to ask the kernel to move per call. */
+enum { XFER_CHUNK = 1 << 20 };
+
+enum xfer_method {
+	XFER_COPY_FILE_RANGE,
+	XFER_SPLICE,
+	XFER_SENDFILE,
+	XFER_READ_WRITE,
+};
+
+/** Whether the error means the method is not supported for these fds. */
+static bool
+xfer_is_unsupported(int err)
+{
+	return err == EINVAL || err == EXDEV || err == ENOSYS ||
+	       err == EOPNOTSUPP || err == EBADF || err == ESPIPE;
+}
+
+static ssize_t
+xfer_read_write(int src, int dst)
+{
+	char buf[1 << 16];
+	ssize_t rc = read(src, buf, sizeof(buf));
+	if (rc <= 0)
+		return rc;
+	for (ssize_t done = 0; done < rc;) {
+		ssize_t n = write(dst, buf + done, rc - done);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += n;
+	}
+	return rc;
+}
+
+int
+xfer_all(int src, int dst)
+{
+	struct stat src_st, dst_st;
+	if (fstat(src, &src_st) != 0 || fstat(dst, &dst_st) != 0)
+		return -1;
+	enum xfer_method method;
+	if (S_ISFIFO(src_st.st_mode) || S_ISFIFO(dst_st.st_mode))
+		method = XFER_SPLICE;
+	else if (S_ISREG(src_st.st_mode) && S_ISREG(dst_st.st_mode))
+		method = XFER_COPY_FILE_RANGE;
+	else if (S_ISREG(src_st.st_mode))
+		method = XFER_SENDFILE;
+	else
+		method = XFER_READ_WRITE;
+	while (true) {
+		ssize_t rc;
+		switch (method) {
+		case XFER_COPY_FILE_RANGE:
+			rc = copy_file_range(src, NULL, dst, NULL, XFER_CHUNK,
+					     0);
+			break;
+		case XFER_SPLICE:
+			rc = splice(src, NULL, dst, NULL, XFER_CHUNK,
+				    SPLICE_F_MOVE);
+			break;
+		case XFER_SENDFILE:
+			rc = sendfile(dst, src, NULL, XFER_CHUNK);
+			break;
+		default:
+			rc = xfer_read_write(src, dst);
+			break;
+		}
+		if (rc == 0)
+			return 0;
+		if (rc > 0)
+			continue;
+		if (errno == EINTR)
+			continue;
+		if (method == XFER_READ_WRITE || !xfer_is_unsupported(errno))
+			return -1;
+		/*
+		 * Offsets are shared by all the methods, so the next one just
+		 * continues where the failed one stopped.
+		 */
+		if (method == XFER_COPY_FILE_RANGE)
+			method = XFER_SENDFILE;
+		else if (method == XFER_SPLICE && S_ISREG(src_st.st_mode))
+			method = XFER_SENDFILE;
+		else
+			method = XFER_READ_WRITE;
+	}
+}
+
+bool
+xfer_cat_is_supported(int argc, char **argv)
+{
+	for (int i = 1; i < argc; ++i) {
+		if (argv[i][0] == '-' && argv[i][1] != 0)
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Refuse to copy a regular file into itself from before its end, which
+ * would never finish. The same check as in coreutils.
+ */
+static bool
+xfer_is_same_file(int in_fd, int out_fd)
+{
+	struct stat in_st, out_st;
+	if (fstat(in_fd, &in_st) != 0 || fstat(out_fd, &out_st) != 0)
+		return false;
+	return S_ISREG(in_st.st_mode) && in_st.st_dev == out_st.st_dev &&
+	       in_st.st_ino == out_st.st_ino &&
+	       lseek(in_fd, 0, SEEK_CUR) < out_st.st_size;
+}
+
+static int
+xfer_cat_fd(const char *name, int fd, int out_fd)
+{
+	if (xfer_is_same_file(fd, out_fd)) {
+		fprintf(stderr, "cat: %s: input file is output file\n", name);
+		return 1;
+	}
+	if (xfer_all(fd, out_fd) == 0)
+		return 0;
+	/* Like the program killed by SIGPIPE, which the shell ignores. */
+	if (errno == EPIPE)
+		return 128 + SIGPIPE;
+	fprintf(stderr, "cat: %s: %s\n", name, strerror(errno));
+	return 1;
+}
+
+int
+xfer_cat(int argc, char **argv, int in_fd, int out_fd)
+{
+	if (argc < 2)
+		return xfer_cat_fd("-", in_fd, out_fd);
+	int exit_code = 0;
+	for (int i = 1; i < argc; ++i) {
+		bool is_stdin = strcmp(argv[i], "-") == 0;
+		int fd = is_stdin ? in_fd : open(argv[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "cat: %s: %s\n", argv[i],
+				strerror(errno));
+			exit_code = 1;
+			continue;
+		}
+		int rc = xfer_cat_fd(argv[i], fd, out_fd);
+		if (!is_stdin)
+			close(fd);
+		if (rc != 0)
+			exit_code = rc;
+		if (rc == 128 + SIGPIPE)
+			break;
+	}
+	return exit_code;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Data transfer between descriptors inside the kernel. Whenever the shell
+ * itself has to move data (a relayed job output, 'cat' of a file into a
+ * pipe or a pipe into a file), it is done with copy_file_range() between
+ * files, splice() when one of the ends is a pipe, and sendfile() otherwise,
+ * so the data never goes through user space. Plain read() + write() is the
+ * last resort for descriptors none of them supports, like a terminal.
+ */
+
+/**
+ * Copy everything from the current offset of @a src till its end to the
+ * current offset of @a dst.
+ * @retval 0 Success.
+ * @retval -1 Error, errno is set.
+ */
+int
+xfer_all(int src, int dst);
+
+/**
+ * 'cat' without options: write the files one after another to @a out_fd,
+ * "-" meaning @a in_fd. With no files copy @a in_fd. Errors are reported to
+ * stderr in the coreutils format.
+ * @param argc Argument count, including the command name.
+ * @param argv Arguments, argv[0] is the command name.
+ * @retval Exit code.
+ */
+int
+xfer_cat(int argc, char **argv, int in_fd, int out_fd);
+
+/** Whether xfer_cat() can execute the command exactly like coreutils cat. */
+bool
+xfer_cat_is_supported(int argc, char **argv);
@@ -0,0 +1,1091 @@
+#include "userfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Benchmarks of UserFS. Each one prints its own results.
+ *
+ * Usage: ./bench [name...], all benchmarks by default.
+ */
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench_fail(const char *what)
+{
+	fprintf(stderr, "%s failed, error %d\n", what, (int)ufs_errno());
+	exit(EXIT_FAILURE);
+}
+
+/** Open and close existing files at random, with @a count files in total. */
+static void
+bench_open_one(int count)
+{
+	char name[32];
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		ufs_close(fd);
+	}
+	double create_time = bench_now() - start;
+
+	const int opens = 1000000;
+	srand(0);
+	start = bench_now();
+	for (int i = 0; i < opens; ++i) {
+		sprintf(name, "file%d", rand() % count);
+		int fd = ufs_open(name, 0);
+		if (fd < 0)
+			bench_fail("open");
+		ufs_close(fd);
+	}
+	double open_time = bench_now() - start;
+
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		if (ufs_delete(name) != 0)
+			bench_fail("delete");
+	}
+	printf("%8d files: %10.0f creates/sec, %10.0f opens/sec\n", count,
+	       count / create_time, opens / open_time);
+}
+
+static void
+bench_open(void)
+{
+	printf("-- open of existing files by name\n");
+	bench_open_one(1000);
+	bench_open_one(100000);
+	bench_open_one(1000000);
+}
+
+/**
+ * Keep @a count descriptors open, and replace random ones with new ones,
+ * so the free slots are scattered.
+ */
+static void
+bench_descriptors_one(int count)
+{
+	int *fds = malloc(sizeof(*fds) * count);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("create");
+	ufs_close(fd);
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", 0);
+		if (fds[i] < 0)
+			bench_fail("open");
+	}
+	const int replaces = 1000000;
+	srand(0);
+	double start = bench_now();
+	for (int i = 0; i < replaces; ++i) {
+		int j = rand() % count;
+		if (ufs_close(fds[j]) != 0)
+			bench_fail("close");
+		fds[j] = ufs_open("file", 0);
+		if (fds[j] < 0)
+			bench_fail("open");
+	}
+	double duration = bench_now() - start;
+	for (int i = 0; i < count; ++i)
+		ufs_close(fds[i]);
+	ufs_delete("file");
+	free(fds);
+	printf("%8d open: %10.0f close+open/sec\n", count,
+	       replaces / duration);
+}
+
+static void
+bench_descriptors(void)
+{
+	printf("-- replace random descriptors of many open ones\n");
+	bench_descriptors_one(1);
+	bench_descriptors_one(1000);
+	bench_descriptors_one(100000);
+}
+
+/** Open and close existing files at random in a directory @a depth deep. */
+static void
+bench_dirs_open(int depth)
+{
+	char dir[512] = "";
+	for (int i = 0; i < depth; ++i) {
+		strcat(dir, "dir/");
+		dir[strlen(dir) - 1] = 0;
+		if (ufs_mkdir(dir) != 0)
+			bench_fail("mkdir");
+		strcat(dir, "/");
+	}
+	const int count = 1000;
+	char name[600];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "%sfile%d", dir, i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		ufs_close(fd);
+	}
+	const int opens = 1000000;
+	srand(0);
+	double start = bench_now();
+	for (int i = 0; i < opens; ++i) {
+		sprintf(name, "%sfile%d", dir, rand() % count);
+		int fd = ufs_open(name, 0);
+		if (fd < 0)
+			bench_fail("open");
+		ufs_close(fd);
+	}
+	double open_time = bench_now() - start;
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "%sfile%d", dir, i);
+		if (ufs_delete(name) != 0)
+			bench_fail("delete");
+	}
+	for (int i = 0; i < depth; ++i) {
+		dir[strlen(dir) - 1] = 0;
+		if (ufs_rmdir(dir) != 0)
+			bench_fail("rmdir");
+		char *slash = strrchr(dir, '/');
+		if (slash != NULL)
+			slash[1] = 0;
+		else
+			dir[0] = 0;
+	}
+	printf("depth %3d: %10.0f opens/sec\n", depth, opens / open_time);
+}
+
+/** Time of listing the directory @a path @a count times. */
+static double
+bench_dirs_list(const char *path, int count)
+{
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		struct ufs_dir *dir = ufs_opendir(path);
+		if (dir == NULL)
+			bench_fail("opendir");
+		while (ufs_readdir(dir) != NULL) {
+		}
+		ufs_closedir(dir);
+	}
+	return bench_now() - start;
+}
+
+static void
+bench_dirs(void)
+{
+	printf("-- open of existing files by path\n");
+	const int depths[] = {0, 1, 4, 16, 64};
+	for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i)
+		bench_dirs_open(depths[i]);
+
+	const int file_count = 100000;
+	const int dir_size = 100;
+	printf("-- list %d files of %d\n", dir_size, file_count + dir_size);
+	char name[32];
+	if (ufs_mkdir("small") != 0)
+		bench_fail("mkdir");
+	for (int i = 0; i < file_count + dir_size; ++i) {
+		if (i < dir_size)
+			sprintf(name, "small/file%d", i);
+		else
+			sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		ufs_close(fd);
+	}
+	const int list_count = 10000;
+	double small_time = bench_dirs_list("small", list_count);
+	double root_time = bench_dirs_list("/", 10);
+	printf("the directory: %10.0f lists/sec, %10.0f entries/sec\n",
+	       list_count / small_time, list_count * dir_size / small_time);
+	printf("the root:      %10.0f lists/sec, %10.0f entries/sec\n",
+	       10 / root_time, 10.0 * (file_count + 1) / root_time);
+	for (int i = 0; i < file_count + dir_size; ++i) {
+		if (i < dir_size)
+			sprintf(name, "small/file%d", i);
+		else
+			sprintf(name, "file%d", i);
+		if (ufs_delete(name) != 0)
+			bench_fail("delete");
+	}
+	if (ufs_rmdir("small") != 0)
+		bench_fail("rmdir");
+}
+
+/** Random 4 KiB reads across a file of the max size. */
+static void
+bench_random_read(void)
+{
+	const size_t file_size = 100 * 1024 * 1024;
+	const size_t io_size = 4096;
+	const int reads = 1000000;
+	printf("-- random %zu byte reads in a %zu MB file\n", io_size,
+	       file_size >> 20);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("create");
+	char *buf = malloc(1024 * 1024);
+	memset(buf, 'a', 1024 * 1024);
+	double start = bench_now();
+	for (size_t done = 0; done < file_size; done += 1024 * 1024) {
+		if (ufs_write(fd, buf, 1024 * 1024) < 0)
+			bench_fail("write");
+	}
+	double write_time = bench_now() - start;
+
+	srand(0);
+	start = bench_now();
+	for (int i = 0; i < reads; ++i) {
+		size_t offset = (size_t)rand() % (file_size - io_size + 1);
+		if (ufs_pread(fd, buf, io_size, offset) != (ssize_t)io_size)
+			bench_fail("pread");
+	}
+	double pread_time = bench_now() - start;
+
+	start = bench_now();
+	for (int i = 0; i < reads; ++i) {
+		off_t offset = rand() % (file_size - io_size + 1);
+		if (ufs_seek(fd, offset, UFS_SEEK_SET) != offset)
+			bench_fail("seek");
+		if (ufs_read(fd, buf, io_size) != (ssize_t)io_size)
+			bench_fail("read");
+	}
+	double seek_time = bench_now() - start;
+	printf("sequential write: %.0f MB/sec\n",
+	       file_size / 1e6 / write_time);
+	printf("pread:       %10.0f reads/sec, %.0f MB/sec\n",
+	       reads / pread_time, reads * io_size / 1e6 / pread_time);
+	printf("seek + read: %10.0f reads/sec, %.0f MB/sec\n",
+	       reads / seek_time, reads * io_size / 1e6 / seek_time);
+	free(buf);
+	ufs_close(fd);
+	ufs_delete("file");
+}
+
+/** Sequential 1 MB writes and reads of a max size file vs memcpy(). */
+static void
+bench_sequential(void)
+{
+	const size_t file_size = 100 * 1024 * 1024;
+	const size_t io_size = 1024 * 1024;
+	printf("-- sequential %zu byte writes and reads of a %zu MB file\n",
+	       io_size, file_size >> 20);
+	char *buf = malloc(io_size);
+	memset(buf, 'a', io_size);
+	char *copy = malloc(file_size);
+	/* Fault the pages in, the file blocks are reused between runs too. */
+	memset(copy, 1, file_size);
+	double start = bench_now();
+	for (size_t done = 0; done < file_size; done += io_size)
+		memcpy(copy + done, buf, io_size);
+	double write_time = bench_now() - start;
+	start = bench_now();
+	for (size_t done = 0; done < file_size; done += io_size)
+		memcpy(buf, copy + done, io_size);
+	double read_time = bench_now() - start;
+	free(copy);
+	printf("%-22s write %6.0f MB/sec, read %6.0f MB/sec\n", "memcpy",
+	       file_size / 1e6 / write_time, file_size / 1e6 / read_time);
+
+	const size_t block_sizes[] = {512, 4096, 64 * 1024};
+	for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]);
+	     ++i) {
+		if (ufs_set_min_block_size(block_sizes[i]) != 0)
+			bench_fail("set block size");
+		int fd = ufs_open("file", UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		start = bench_now();
+		for (size_t done = 0; done < file_size; done += io_size) {
+			if (ufs_write(fd, buf, io_size) != (ssize_t)io_size)
+				bench_fail("write");
+		}
+		write_time = bench_now() - start;
+		if (ufs_seek(fd, 0, UFS_SEEK_SET) != 0)
+			bench_fail("seek");
+		start = bench_now();
+		for (size_t done = 0; done < file_size; done += io_size) {
+			if (ufs_read(fd, buf, io_size) != (ssize_t)io_size)
+				bench_fail("read");
+		}
+		read_time = bench_now() - start;
+		ufs_close(fd);
+		ufs_delete("file");
+		printf("min block %-12zu write %6.0f MB/sec, read %6.0f MB/sec\n",
+		       block_sizes[i], file_size / 1e6 / write_time,
+		       file_size / 1e6 / read_time);
+	}
+	ufs_set_min_block_size(512);
+	free(buf);
+}
+
+/** Create, write, close and delete cycles with files of @a size bytes. */
+static void
+bench_churn_one(size_t size)
+{
+	const int files = 64;
+	const int cycles = 200000;
+	char name[32];
+	char *buf = malloc(size);
+	memset(buf, 'a', size);
+	double start = bench_now();
+	for (int i = 0; i < cycles; ++i) {
+		/* Keep several files alive so frees and allocations mix. */
+		sprintf(name, "file%d", i % files);
+		if (i >= files && ufs_delete(name) != 0)
+			bench_fail("delete");
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		if (ufs_write(fd, buf, size) != (ssize_t)size)
+			bench_fail("write");
+		ufs_close(fd);
+	}
+	double duration = bench_now() - start;
+	for (int i = 0; i < files; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	free(buf);
+	printf("%8zu bytes: %10.0f cycles/sec\n", size, cycles / duration);
+}
+
+static void
+bench_churn(void)
+{
+	printf("-- create, write, close, delete cycles\n");
+	bench_churn_one(100);
+	bench_churn_one(4096);
+	bench_churn_one(64 * 1024);
+	bench_churn_one(1024 * 1024);
+}
+
+/** Checksum of a max size file through ufs_read() and ufs_read_map(). */
+static void
+bench_map(void)
+{
+	const size_t file_size = 100 * 1024 * 1024;
+	const size_t io_size = 4 * 1024 * 1024;
+	printf("-- checksum of a %zu MB file by %zu KB ranges\n",
+	       file_size >> 20, io_size >> 10);
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("create");
+	char *buf = malloc(io_size);
+	for (size_t i = 0; i < io_size; ++i)
+		buf[i] = i;
+	for (size_t done = 0; done < file_size; done += io_size) {
+		if (ufs_write(fd, buf, io_size) < 0)
+			bench_fail("write");
+	}
+
+	uint64_t read_sum = 0;
+	double start = bench_now();
+	for (size_t done = 0; done < file_size; done += io_size) {
+		if (ufs_pread(fd, buf, io_size, done) != (ssize_t)io_size)
+			bench_fail("pread");
+		const uint64_t *words = (const uint64_t *)buf;
+		for (size_t i = 0; i < io_size / sizeof(*words); ++i)
+			read_sum += words[i];
+	}
+	double read_time = bench_now() - start;
+
+	uint64_t map_sum = 0;
+	start = bench_now();
+	for (size_t done = 0; done < file_size; done += io_size) {
+		struct ufs_map map;
+		if (ufs_read_map(fd, done, io_size, &map) != (ssize_t)io_size)
+			bench_fail("map");
+		for (int j = 0; j < map.iovcnt; ++j) {
+			const uint64_t *words = map.iov[j].iov_base;
+			size_t count = map.iov[j].iov_len / sizeof(*words);
+			for (size_t i = 0; i < count; ++i)
+				map_sum += words[i];
+		}
+		ufs_read_unmap(&map);
+	}
+	double map_time = bench_now() - start;
+	if (map_sum != read_sum)
+		bench_fail("checksum");
+	printf("pread:    %6.0f MB/sec\n", file_size / 1e6 / read_time);
+	printf("read_map: %6.0f MB/sec\n", file_size / 1e6 / map_time);
+	free(buf);
+	ufs_close(fd);
+	ufs_delete("file");
+}
+
+/** Read all the files fileN, N < @a count, of @a size bytes each. */
+static void
+bench_read_files(int count, size_t size, char *buf, size_t buf_size)
+{
+	char name[32];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		if (fd < 0)
+			bench_fail("open");
+		for (size_t done = 0; done < size; done += buf_size) {
+			if (ufs_read(fd, buf, buf_size) != (ssize_t)buf_size)
+				bench_fail("read");
+		}
+		ufs_close(fd);
+	}
+}
+
+/** Save files into an image and load them back, against writing them. */
+static void
+bench_image(void)
+{
+	const int count = 64;
+	const size_t file_size = 8 * 1024 * 1024;
+	const size_t io_size = 1024 * 1024;
+	const char *path = "bench.img";
+	printf("-- image of %d files of %zu MB\n", count, file_size >> 20);
+	char *buf = malloc(io_size);
+	memset(buf, 'a', io_size);
+	char name[32];
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		for (size_t done = 0; done < file_size; done += io_size) {
+			if (ufs_write(fd, buf, io_size) < 0)
+				bench_fail("write");
+		}
+		ufs_close(fd);
+	}
+	double write_time = bench_now() - start;
+	start = bench_now();
+	if (ufs_save(path) != 0)
+		bench_fail("save");
+	double save_time = bench_now() - start;
+	ufs_destroy();
+
+	start = bench_now();
+	if (ufs_load(path) != 0)
+		bench_fail("load");
+	double load_time = bench_now() - start;
+	start = bench_now();
+	bench_read_files(count, file_size, buf, io_size);
+	double first_read_time = bench_now() - start;
+	start = bench_now();
+	bench_read_files(count, file_size, buf, io_size);
+	double second_read_time = bench_now() - start;
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	unlink(path);
+	free(buf);
+	double total = count * file_size / 1e6;
+	printf("write the files: %8.3f sec, %6.0f MB/sec\n", write_time,
+	       total / write_time);
+	printf("save:            %8.3f sec, %6.0f MB/sec\n", save_time,
+	       total / save_time);
+	printf("load:            %8.3f sec\n", load_time);
+	printf("first read:      %8.3f sec, %6.0f MB/sec\n", first_read_time,
+	       total / first_read_time);
+	printf("second read:     %8.3f sec, %6.0f MB/sec\n", second_read_time,
+	       total / second_read_time);
+}
+
+enum {
+	THREADS_FILE_SIZE = 16 * 1024 * 1024,
+	THREADS_IO_SIZE = 4096,
+	THREADS_TOTAL_OPS = 800000,
+};
+
+struct bench_thread {
+	pthread_t thread;
+	int fd;
+	int ops;
+	unsigned seed;
+};
+
+static void *
+bench_thread_pread(void *arg)
+{
+	struct bench_thread *t = arg;
+	char buf[THREADS_IO_SIZE];
+	for (int i = 0; i < t->ops; ++i) {
+		size_t offset = rand_r(&t->seed) %
+				(THREADS_FILE_SIZE - THREADS_IO_SIZE);
+		if (ufs_pread(t->fd, buf, sizeof(buf), offset) != sizeof(buf))
+			bench_fail("pread");
+	}
+	return NULL;
+}
+
+static void *
+bench_thread_pwrite(void *arg)
+{
+	struct bench_thread *t = arg;
+	char buf[THREADS_IO_SIZE];
+	memset(buf, 'a', sizeof(buf));
+	for (int i = 0; i < t->ops; ++i) {
+		size_t offset = rand_r(&t->seed) %
+				(THREADS_FILE_SIZE - THREADS_IO_SIZE);
+		if (ufs_pwrite(t->fd, buf, sizeof(buf), offset) != sizeof(buf))
+			bench_fail("pwrite");
+	}
+	return NULL;
+}
+
+/**
+ * Run @a count threads doing random 4 KiB I/O, either all in one file or
+ * each in its own one. The total number of operations is fixed.
+ */
+static void
+bench_threads_one(int count, void *(*func)(void *), bool is_shared)
+{
+	struct bench_thread threads[count];
+	char name[32];
+	char *buf = malloc(THREADS_FILE_SIZE);
+	memset(buf, 'a', THREADS_FILE_SIZE);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", is_shared ? 0 : i);
+		threads[i].fd = ufs_open(name, UFS_CREATE);
+		if (threads[i].fd < 0)
+			bench_fail("open");
+		if ((i == 0 || !is_shared) &&
+		    ufs_write(threads[i].fd, buf, THREADS_FILE_SIZE) < 0)
+			bench_fail("write");
+		threads[i].ops = THREADS_TOTAL_OPS / count;
+		threads[i].seed = i;
+	}
+	free(buf);
+	double start = bench_now();
+	for (int i = 0; i < count; ++i)
+		pthread_create(&threads[i].thread, NULL, func, &threads[i]);
+	for (int i = 0; i < count; ++i)
+		pthread_join(threads[i].thread, NULL);
+	double duration = bench_now() - start;
+	for (int i = 0; i < count; ++i) {
+		ufs_close(threads[i].fd);
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	printf("%2d threads: %10.0f ops/sec\n", count,
+	       THREADS_TOTAL_OPS / duration);
+}
+
+static void
+bench_threads(void)
+{
+	const int counts[] = {1, 2, 4, 8};
+	const int counts_size = sizeof(counts) / sizeof(counts[0]);
+	printf("-- random 4 KiB preads of one file\n");
+	for (int i = 0; i < counts_size; ++i)
+		bench_threads_one(counts[i], bench_thread_pread, true);
+	printf("-- random 4 KiB pwrites of a file per thread\n");
+	for (int i = 0; i < counts_size; ++i)
+		bench_threads_one(counts[i], bench_thread_pwrite, false);
+	printf("-- random 4 KiB pwrites of one file\n");
+	for (int i = 0; i < counts_size; ++i)
+		bench_threads_one(counts[i], bench_thread_pwrite, true);
+}
+
+static void
+bench_wal_one(int batch_size)
+{
+	const int count = 4096;
+	const size_t io_size = 4096;
+	const char *path = "bench_wal.img";
+	char buf[io_size];
+	memset(buf, 'a', io_size);
+	if (batch_size > 0 && ufs_wal_open(path, batch_size, 0) != 0)
+		bench_fail("wal open");
+	int fd = ufs_open("file", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("open");
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		if (ufs_write(fd, buf, io_size) < 0)
+			bench_fail("write");
+	}
+	/* The writes are committed when the last batch is synced. */
+	if (batch_size > 0 && ufs_wal_sync() != 0)
+		bench_fail("wal sync");
+	double duration = bench_now() - start;
+	if (batch_size > 0 && ufs_wal_close() != 0)
+		bench_fail("wal close");
+	ufs_close(fd);
+	ufs_delete("file");
+	char wal_path[64];
+	sprintf(wal_path, "%s.wal", path);
+	unlink(wal_path);
+	if (batch_size > 0)
+		printf("batch %4d: %10.0f writes/sec\n", batch_size,
+		       count / duration);
+	else
+		printf("no log:     %10.0f writes/sec\n", count / duration);
+}
+
+static void
+bench_wal(void)
+{
+	const int batch_sizes[] = {0, 1, 8, 64, 512};
+	printf("-- committed 4 KiB writes with the write-ahead log\n");
+	for (size_t i = 0; i < sizeof(batch_sizes) / sizeof(batch_sizes[0]);
+	     ++i)
+		bench_wal_one(batch_sizes[i]);
+}
+
+/** Resident memory of the process in MB. */
+static double
+bench_rss_mb(void)
+{
+	long pages = 0;
+	long rss = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f != NULL) {
+		if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+			rss = 0;
+		fclose(f);
+	}
+	return rss * (double)sysconf(_SC_PAGESIZE) / 1e6;
+}
+
+static void
+bench_clone_one(bool is_clone)
+{
+	const int count = 64;
+	const size_t file_size = 16 * 1024 * 1024;
+	const size_t io_size = 1024 * 1024;
+	char *buf = malloc(io_size);
+	memset(buf, 'a', io_size);
+	int fd = ufs_open("template", UFS_CREATE);
+	if (fd < 0)
+		bench_fail("create");
+	for (size_t done = 0; done < file_size; done += io_size) {
+		if (ufs_write(fd, buf, io_size) < 0)
+			bench_fail("write");
+	}
+	ufs_close(fd);
+	char name[32];
+	double start_rss = bench_rss_mb();
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "copy%d", i);
+		if (is_clone) {
+			if (ufs_clone("template", name) != 0)
+				bench_fail("clone");
+			continue;
+		}
+		int src = ufs_open("template", 0);
+		int dst = ufs_open(name, UFS_CREATE);
+		if (src < 0 || dst < 0)
+			bench_fail("open");
+		ssize_t rc;
+		while ((rc = ufs_read(src, buf, io_size)) > 0) {
+			if (ufs_write(dst, buf, rc) < 0)
+				bench_fail("write");
+		}
+		ufs_close(src);
+		ufs_close(dst);
+	}
+	double copy_time = bench_now() - start;
+	double copy_rss = bench_rss_mb();
+	/* Customize the head of each copy. */
+	start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "copy%d", i);
+		fd = ufs_open(name, 0);
+		if (ufs_pwrite(fd, buf, 4096, 0) < 0)
+			bench_fail("pwrite");
+		ufs_close(fd);
+	}
+	double write_time = bench_now() - start;
+	double write_rss = bench_rss_mb();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "copy%d", i);
+		ufs_delete(name);
+	}
+	ufs_delete("template");
+	free(buf);
+	/* The slabs are kept until destruction, the next run starts anew. */
+	ufs_destroy();
+	printf("%s: %8.4f sec, %8.0f copies/sec, +%5.0f MB; "
+	       "4 KiB writes: %.4f sec, +%3.0f MB\n",
+	       is_clone ? "ufs_clone " : "read/write", copy_time,
+	       count / copy_time, copy_rss - start_rss, write_time,
+	       write_rss - copy_rss);
+}
+
+static void
+bench_clone(void)
+{
+	printf("-- 64 copies of a 16 MB file\n");
+	bench_clone_one(false);
+	bench_clone_one(true);
+}
+
+static double
+bench_dedup_write(bool is_duplicate, struct ufs_dedup_stats *stats)
+{
+	const int count = 64;
+	const size_t file_size = 4 * 1024 * 1024;
+	const size_t io_size = 64 * 1024;
+	char *buf = malloc(io_size);
+	char name[32];
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		for (size_t done = 0; done < file_size; done += io_size) {
+			/* The first bytes of each chunk make it unique. */
+			int tag[2] = {is_duplicate ? 0 : i, done / io_size};
+			memset(buf, 'a', io_size);
+			for (size_t pos = 0; pos < io_size; pos += 512)
+				memcpy(buf + pos, tag, sizeof(tag));
+			if (ufs_write(fd, buf, io_size) < 0)
+				bench_fail("write");
+		}
+		ufs_close(fd);
+	}
+	double duration = bench_now() - start;
+	ufs_dedup_stats(stats);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	free(buf);
+	return count * file_size / 1e6 / duration;
+}
+
+static void
+bench_dedup_one(bool is_enabled, bool is_duplicate)
+{
+	ufs_set_dedup(is_enabled);
+	/*
+	 * The best of several runs: the speed depends on the order of the
+	 * blocks in the free lists left by the previous run.
+	 */
+	struct ufs_dedup_stats stats;
+	double speed = 0;
+	for (int i = 0; i < 5; ++i) {
+		double run_speed = bench_dedup_write(is_duplicate, &stats);
+		if (run_speed > speed)
+			speed = run_speed;
+	}
+	ufs_set_dedup(false);
+	printf("dedup %-3s %-9s data: %6.0f MB/sec", is_enabled ? "on" : "off",
+	       is_duplicate ? "duplicate" : "unique", speed);
+	if (is_enabled) {
+		printf(", ratio %5.2f, saved %5.0f MB",
+		       (double)stats.logical_bytes / stats.bytes,
+		       (stats.logical_bytes - stats.bytes) / 1e6);
+	}
+	printf("\n");
+}
+
+static void
+bench_dedup(void)
+{
+	printf("-- 64 files of 4 MB written by 64 KiB with the dedup\n");
+	bench_dedup_one(false, false);
+	bench_dedup_one(true, false);
+	bench_dedup_one(false, true);
+	bench_dedup_one(true, true);
+}
+
+/** Random 4 KiB reads of the files, MB/sec. */
+static double
+bench_compression_read(int count, size_t file_size)
+{
+	const int reads = 20000;
+	const size_t io_size = 4096;
+	char buf[io_size];
+	char name[32];
+	int fds[count];
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		fds[i] = ufs_open(name, 0);
+	}
+	srand(0);
+	double start = bench_now();
+	for (int i = 0; i < reads; ++i) {
+		size_t offset = (size_t)rand() % (file_size - io_size);
+		if (ufs_pread(fds[rand() % count], buf, io_size, offset) < 0)
+			bench_fail("pread");
+	}
+	double duration = bench_now() - start;
+	for (int i = 0; i < count; ++i)
+		ufs_close(fds[i]);
+	return reads * io_size / 1e6 / duration;
+}
+
+static void
+bench_compression(void)
+{
+	const int count = 64;
+	const size_t file_size = 4 * 1024 * 1024;
+	printf("-- %d files of %zu MB of log lines\n", count, file_size >> 20);
+	char *data = malloc(file_size);
+	size_t size = 0;
+	for (long line = 0; size < file_size; ++line) {
+		char buf[128];
+		int len = snprintf(buf, sizeof(buf),
+				   "2024-01-01 12:%02ld:%02ld INFO request %ld "
+				   "handled in %ld ms\n", line / 60 % 60,
+				   line % 60, line * 7919 % 100000, line % 97);
+		if ((size_t)len > file_size - size)
+			len = file_size - size;
+		memcpy(data + size, buf, len);
+		size += len;
+	}
+	char name[32];
+	double start_rss = bench_rss_mb();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		/* Each file differs a bit, not to be the same blocks. */
+		memcpy(data, &i, sizeof(i));
+		if (fd < 0 || ufs_write(fd, data, file_size) < 0)
+			bench_fail("write");
+		ufs_close(fd);
+	}
+	free(data);
+	double raw_rss = bench_rss_mb();
+	double raw_read = bench_compression_read(count, file_size);
+	/* The first pass finds all the blocks hot after the reads. */
+	ufs_compress_cold();
+	double start = bench_now();
+	ufs_compress_cold();
+	double pass_time = bench_now() - start;
+	double compressed_rss = bench_rss_mb();
+	double compressed_read = bench_compression_read(count, file_size);
+	struct ufs_compression_stats stats;
+	ufs_compression_stats(&stats);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	printf("raw:        %5.0f MB RSS, reads %6.0f MB/sec\n",
+	       raw_rss - start_rss, raw_read);
+	printf("compressed: %5.0f MB RSS, reads %6.0f MB/sec, "
+	       "pass %.3f sec\n", compressed_rss - start_rss,
+	       compressed_read, pass_time);
+	printf("ratio %.1f, cache hits %zu, misses %zu\n",
+	       (double)stats.raw_bytes / stats.compressed_bytes,
+	       stats.cache_hit_count, stats.cache_miss_count);
+	ufs_destroy();
+}
+
+/** Copy @a src to @a dst, skipping the holes if @a is_sparse. */
+static void
+bench_sparse_copy(const char *src, const char *dst, size_t file_size,
+		  bool is_sparse, char *buf, size_t io_size)
+{
+	int in = ufs_open(src, 0);
+	int out = ufs_open(dst, UFS_CREATE);
+	if (in < 0 || out < 0)
+		bench_fail("open");
+	off_t pos = 0;
+	while ((size_t)pos < file_size) {
+		off_t end = file_size;
+		if (is_sparse) {
+			pos = ufs_seek_data(in, pos);
+			end = ufs_seek_hole(in, pos);
+		}
+		for (; pos < end; pos += io_size) {
+			size_t len = io_size;
+			if (len > (size_t)(end - pos))
+				len = end - pos;
+			if (ufs_pread(in, buf, len, pos) < 0 ||
+			    ufs_pwrite(out, buf, len, pos) < 0)
+				bench_fail("copy");
+		}
+		pos = end;
+	}
+	if (ufs_resize(out, file_size) != 0)
+		bench_fail("resize");
+	ufs_close(in);
+	ufs_close(out);
+}
+
+static void
+bench_sparse(void)
+{
+	const int count = 4;
+	const size_t file_size = 100 * 1024 * 1024;
+	const size_t io_size = 1024 * 1024;
+	const int writes = 16;
+	printf("-- %d files of %zu MB with %d writes of 4 KiB each\n", count,
+	       file_size >> 20, writes);
+	char *buf = malloc(io_size);
+	memset(buf, 'a', io_size);
+	char name[32];
+	double start_rss = bench_rss_mb();
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0 || ufs_resize(fd, file_size) != 0)
+			bench_fail("resize");
+		ufs_close(fd);
+	}
+	double resize_time = bench_now() - start;
+	double resize_rss = bench_rss_mb();
+	srand(0);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		for (int j = 0; j < writes; ++j) {
+			size_t pos = (size_t)rand() % (file_size - 4096);
+			if (ufs_pwrite(fd, buf, 4096, pos) < 0)
+				bench_fail("pwrite");
+		}
+		ufs_close(fd);
+	}
+	printf("resize:      %8.4f sec, +%5.0f MB\n", resize_time,
+	       resize_rss - start_rss);
+	/* The sparse copy first, the full one would leave it free blocks. */
+	for (int is_sparse = 1; is_sparse >= 0; --is_sparse) {
+		double copy_rss = bench_rss_mb();
+		start = bench_now();
+		for (int i = 0; i < count; ++i) {
+			char copy[32];
+			sprintf(name, "file%d", i);
+			sprintf(copy, "copy%d", i);
+			bench_sparse_copy(name, copy, file_size, is_sparse, buf,
+					  io_size);
+		}
+		double copy_time = bench_now() - start;
+		printf("%s %8.4f sec, +%5.0f MB\n",
+		       is_sparse ? "sparse copy:" : "full copy:  ", copy_time,
+		       bench_rss_mb() - copy_rss);
+		for (int i = 0; i < count; ++i) {
+			sprintf(name, "copy%d", i);
+			ufs_delete(name);
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	free(buf);
+	ufs_destroy();
+}
+
+/**
+ * Write files of sizes from 64 bytes to 256 KiB by appends of 4 KiB at
+ * most, with the min block size @a min_block_size, and show how much
+ * memory they take.
+ */
+static void
+bench_stats_one(size_t min_block_size)
+{
+	const int count = 5000;
+	const size_t io_size = 4096;
+	char buf[io_size];
+	memset(buf, 'a', io_size);
+	char name[32];
+	if (ufs_set_min_block_size(min_block_size) != 0)
+		bench_fail("min block size");
+	srand(0);
+	double start = bench_now();
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd < 0)
+			bench_fail("create");
+		size_t size = (size_t)64 << (rand() % 12);
+		size += (size_t)rand() % size;
+		for (size_t done = 0; done < size; done += io_size) {
+			size_t len = size - done < io_size ? size - done :
+							     io_size;
+			if (ufs_write(fd, buf, len) < 0)
+				bench_fail("write");
+		}
+		ufs_close(fd);
+	}
+	double duration = bench_now() - start;
+	struct ufs_fs_stats stats;
+	ufs_fs_stats(&stats);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		ufs_delete(name);
+	}
+	/* The slabs are kept until destruction, the next run starts anew. */
+	ufs_destroy();
+	printf("%6zu: %6.0f MB/sec, %6.1f MB in %7zu blocks, "
+	       "slack %5.1f MB (%4.1f%%), slabs %6.1f MB\n", min_block_size,
+	       stats.write_bytes / 1e6 / duration,
+	       stats.allocated_bytes / 1e6, stats.block_count,
+	       stats.slack_bytes / 1e6,
+	       100.0 * stats.slack_bytes / stats.allocated_bytes,
+	       stats.slab_bytes / 1e6);
+}
+
+static void
+bench_stats(void)
+{
+	printf("-- 5000 files of 64 B to 256 KiB written by appends, "
+	       "by min block size\n");
+	bench_stats_one(64);
+	bench_stats_one(512);
+	bench_stats_one(4096);
+	bench_stats_one(65536);
+	ufs_set_min_block_size(512);
+}
+
+struct bench {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct bench benches[] = {
+	{"open", bench_open},
+	{"descriptors", bench_descriptors},
+	{"dirs", bench_dirs},
+	{"random_read", bench_random_read},
+	{"sequential", bench_sequential},
+	{"churn", bench_churn},
+	{"map", bench_map},
+	{"image", bench_image},
+	{"threads", bench_threads},
+	{"wal", bench_wal},
+	{"clone", bench_clone},
+	{"dedup", bench_dedup},
+	{"compression", bench_compression},
+	{"sparse", bench_sparse},
+	{"stats", bench_stats},
+};
+
+int
+main(int argc, char **argv)
+{
+	int count = sizeof(benches) / sizeof(benches[0]);
+	for (int i = 0; i < count; ++i) {
+		bool is_selected = argc == 1;
+		for (int j = 1; j < argc && !is_selected; ++j)
+			is_selected = strcmp(argv[j], benches[i].name) == 0;
+		if (is_selected)
+			benches[i].run();
+	}
+	ufs_destroy();
+	return 0;
+}
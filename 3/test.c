@@ -2,7 +2,11 @@
 #include "unit.h"
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static void
 test_open(void)
@@ -70,6 +74,268 @@ test_stress_open(void)
 	unit_test_finish();
 }
 
+static void
+test_name_index(void)
+{
+	unit_test_start();
+
+	const int count = 10000;
+	char name[16];
+	unit_msg("create %d files, then delete every other one", count);
+	for (int i = 0; i < count; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_close(fd) != 0);
+	}
+	for (int i = 1; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i) {
+		sprintf(name, "file%d", i);
+		int fd = ufs_open(name, 0);
+		ok = (fd != -1) == (i % 2 == 0);
+		if (fd != -1)
+			ufs_close(fd);
+	}
+	unit_check(ok, "remaining files are found, deleted are not");
+	for (int i = 0; i < count; i += 2) {
+		sprintf(name, "file%d", i);
+		unit_fail_if(ufs_delete(name) != 0);
+	}
+	unit_check(ufs_open("file0", 0) == -1, "all are deleted");
+
+	unit_test_finish();
+}
+
+static int
+test_compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * Sorted entries of the directory @a path as "a b/ c", with a slash after
+ * the directories, or "-" if there is no directory.
+ */
+static void
+test_list(const char *path, char *buf)
+{
+	struct ufs_dir *dir = ufs_opendir(path);
+	if (dir == NULL) {
+		strcpy(buf, "-");
+		return;
+	}
+	char names[16][64];
+	char *sorted[16];
+	int count = 0;
+	const struct ufs_dirent *e;
+	while ((e = ufs_readdir(dir)) != NULL && count < 16) {
+		sprintf(names[count], "%s%s", e->name, e->is_dir ? "/" : "");
+		sorted[count] = names[count];
+		++count;
+	}
+	ufs_closedir(dir);
+	qsort(sorted, count, sizeof(sorted[0]), test_compare_names);
+	buf[0] = 0;
+	for (int i = 0; i < count; ++i) {
+		if (i > 0)
+			strcat(buf, " ");
+		strcat(buf, sorted[i]);
+	}
+}
+
+/** Read the whole small file @a path into @a buf as a string. */
+static void
+test_read_file(const char *path, char *buf)
+{
+	int fd = ufs_open(path, 0);
+	ssize_t size = fd == -1 ? -1 : ufs_read(fd, buf, 63);
+	if (size >= 0)
+		buf[size] = 0;
+	else
+		strcpy(buf, "-");
+	if (fd != -1)
+		ufs_close(fd);
+}
+
+static void
+test_write_file(const char *path, const char *data)
+{
+	int fd = ufs_open(path, UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, data, strlen(data)) != (ssize_t)strlen(data));
+	unit_fail_if(ufs_close(fd) != 0);
+}
+
+static void
+test_dirs(void)
+{
+	unit_test_start();
+
+	char buf[1024];
+	unit_check(ufs_mkdir("d") == 0, "mkdir");
+	unit_check(ufs_mkdir("d") == -1, "mkdir twice");
+	unit_fail_if(ufs_errno() != UFS_ERR_EXISTS);
+	unit_check(ufs_mkdir("x/y") == -1, "mkdir without a parent");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	unit_check(ufs_mkdir("d//y") == -1 && ufs_mkdir("d/") == -1 &&
+		   ufs_mkdir("/") == -1 && ufs_open("", UFS_CREATE) == -1,
+		   "bad paths");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_open("x/f", UFS_CREATE) == -1,
+		   "no file without a directory");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+
+	test_write_file("d/f1", "d/f1");
+	test_write_file("/d/f2", "d/f2");
+	test_write_file("f1", "f1");
+	unit_fail_if(ufs_mkdir("d/sub") != 0);
+	test_write_file("d/sub/f3", "d/sub/f3");
+	test_read_file("d/f1", buf);
+	unit_check(strcmp(buf, "d/f1") == 0, "a file in a directory");
+	test_read_file("/f1", buf);
+	unit_check(strcmp(buf, "f1") == 0, "same name in the root");
+	test_read_file("d/sub/f3", buf);
+	unit_check(strcmp(buf, "d/sub/f3") == 0, "a file in a subdirectory");
+	unit_check(ufs_open("d/f3", 0) == -1 && ufs_open("f1/f", 0) == -1,
+		   "no such files");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	unit_check(ufs_open("d", 0) == -1 && ufs_delete("d") == -1,
+		   "a directory is not a file");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_mkdir("d/f1") == -1, "mkdir over a file");
+	unit_fail_if(ufs_errno() != UFS_ERR_EXISTS);
+
+	test_list("d", buf);
+	unit_check(strcmp(buf, "f1 f2 sub/") == 0, "list a directory");
+	test_list("/", buf);
+	unit_check(strcmp(buf, "d/ f1") == 0, "list the root");
+	test_list("d/sub/f3", buf);
+	unit_check(strcmp(buf, "-") == 0, "a file is not listed");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	struct ufs_dir *dir = ufs_opendir("d/sub");
+	unit_fail_if(ufs_delete("d/sub/f3") != 0);
+	const struct ufs_dirent *e = ufs_readdir(dir);
+	unit_check(e != NULL && strcmp(e->name, "f3") == 0 && !e->is_dir &&
+		   ufs_readdir(dir) == NULL, "a listing is taken at once");
+	ufs_closedir(dir);
+	test_write_file("d/sub/f3", "d/sub/f3");
+
+	unit_check(ufs_rmdir("d") == -1, "rmdir of a non-empty directory");
+	unit_fail_if(ufs_errno() != UFS_ERR_NOT_EMPTY);
+	unit_check(ufs_rmdir("d/f1") == -1, "rmdir of a file");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_rmdir("d/none") == -1, "rmdir of nothing");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+
+	int fd = ufs_open("d/f1", 0);
+	unit_check(ufs_rename("d/f1", "d/sub/g") == 0, "rename a file");
+	unit_check(ufs_open("d/f1", 0) == -1, "the old name is gone");
+	test_read_file("d/sub/g", buf);
+	unit_check(strcmp(buf, "d/f1") == 0, "the new name is found");
+	unit_fail_if(ufs_write(fd, "D", 1) != 1);
+	test_read_file("d/sub/g", buf);
+	unit_check(strcmp(buf, "D/f1") == 0, "a descriptor follows the file");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_rename("d/f2", "d/sub/g") == 0, "rename over a file");
+	test_read_file("d/sub/g", buf);
+	unit_check(strcmp(buf, "d/f2") == 0, "the file is replaced");
+	unit_check(ufs_rename("d/sub/g", "d/sub") == -1,
+		   "rename a file over a directory");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_rename("d/none", "d/g") == -1, "rename nothing");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+
+	/* The path of "d/sub" is cached by the lookups above. */
+	unit_check(ufs_rename("d/sub", "e") == 0, "rename a directory");
+	unit_check(ufs_open("d/sub/f3", 0) == -1, "the old path is gone");
+	test_read_file("e/f3", buf);
+	unit_check(strcmp(buf, "d/sub/f3") == 0, "the entries are moved");
+	unit_check(ufs_rename("d", "d/x") == -1 &&
+		   ufs_rename("/", "y") == -1, "rename into itself");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_rename("d", "e") == -1, "rename over a non-empty one");
+	unit_fail_if(ufs_errno() != UFS_ERR_NOT_EMPTY);
+	unit_check(ufs_rename("e", "d") == 0, "rename over an empty one");
+	test_list("d", buf);
+	unit_check(strcmp(buf, "f3 g") == 0, "the empty one is replaced");
+	test_list("/", buf);
+	unit_check(strcmp(buf, "d/ f1") == 0, "the old one is gone");
+
+	char path[256] = "d";
+	for (int i = 0; i < 30; ++i) {
+		strcat(path, "/n");
+		unit_fail_if(ufs_mkdir(path) != 0);
+	}
+	strcat(path, "/f");
+	test_write_file(path, "deep");
+	test_read_file(path, buf);
+	unit_check(strcmp(buf, "deep") == 0, "a deep path");
+	unit_check(ufs_rename("d/n", "n") == 0, "rename a deep tree");
+	test_read_file(path + 2, buf);
+	unit_check(strcmp(buf, "deep") == 0, "a deep path after the rename");
+
+	const char *image = "test_dirs.ufs";
+	const char *wal_path = "test_dirs.ufs.wal";
+	unlink(image);
+	unlink(wal_path);
+	unit_fail_if(ufs_mkdir("empty") != 0);
+	unit_check(ufs_save(image) == 0, "save");
+	unit_fail_if(ufs_wal_open(image, 1, 0) != 0);
+	unit_fail_if(ufs_mkdir("w") != 0);
+	test_write_file("w/f", "w/f");
+	unit_fail_if(ufs_rename("d", "w/d") != 0);
+	unit_fail_if(ufs_rmdir("empty") != 0);
+	unit_fail_if(ufs_wal_close() != 0);
+	struct ufs_snapshot *snapshot = ufs_snapshot_create();
+	unit_fail_if(ufs_rename("w", "w2") != 0);
+	unit_fail_if(ufs_mkdir("w2/new") != 0);
+	unit_check(ufs_snapshot_restore(snapshot) == 0, "snapshot restore");
+	test_list("/", buf);
+	unit_check(strcmp(buf, "f1 n/ w/") == 0, "the root is restored");
+	test_list("w", buf);
+	unit_check(strcmp(buf, "d/ f") == 0, "a directory is restored");
+	ufs_snapshot_delete(snapshot);
+
+	unit_fail_if(ufs_rename("w", "w2") != 0);
+	unit_fail_if(ufs_mkdir("f1/x") != -1);
+	unit_fail_if(ufs_delete("f1") != 0);
+	unit_fail_if(ufs_mkdir("f1") != 0);
+	unit_check(ufs_load(image) == 0, "load the image and the log");
+	test_list("/", buf);
+	unit_check(strcmp(buf, "f1 n/ w/ w2/") == 0,
+		   "the directories are loaded");
+	test_list("w", buf);
+	unit_check(strcmp(buf, "d/ f") == 0, "the log is replayed");
+	test_read_file("w/d/f3", buf);
+	unit_check(strcmp(buf, "d/sub/f3") == 0, "a moved file is loaded");
+	test_read_file("f1", buf);
+	unit_check(strcmp(buf, "f1") == 0,
+		   "a loaded file replaces a directory");
+	test_read_file(path + 2, buf);
+	unit_check(strcmp(buf, "deep") == 0, "a deep path is loaded");
+
+	unit_fail_if(ufs_delete("f1") != 0);
+	unit_fail_if(ufs_delete("w/f") != 0 || ufs_delete("w2/f") != 0);
+	unit_fail_if(ufs_delete("w/d/f3") != 0 || ufs_delete("w/d/g") != 0);
+	unit_fail_if(ufs_delete("w2/d/f3") != 0 || ufs_delete("w2/d/g") != 0);
+	unit_fail_if(ufs_delete(path + 2) != 0);
+	for (*strrchr(path, '/') = 0; strlen(path) > 1;
+	     *strrchr(path, '/') = 0)
+		unit_fail_if(ufs_rmdir(path + 2) != 0);
+	unit_fail_if(ufs_rmdir("w/d") != 0 || ufs_rmdir("w") != 0);
+	unit_fail_if(ufs_rmdir("w2/d") != 0 || ufs_rmdir("w2") != 0);
+	test_list("/", buf);
+	unit_check(strcmp(buf, "") == 0, "all are removed");
+	unlink(image);
+	unlink(wal_path);
+
+	unit_test_finish();
+}
+
 static void
 test_close(void)
 {
@@ -90,6 +356,32 @@ test_close(void)
 	unit_check(ufs_close(fd) == -1, "close it second time");
 	unit_check(ufs_errno() == UFS_ERR_NO_FILE, "errno is set");
 
+	int fd2 = ufs_open("file", 0);
+	unit_fail_if(fd2 == -1);
+	unit_check(fd2 != fd, "a reused slot has a new number");
+	unit_check(ufs_close(fd) == -1 && ufs_write(fd, "a", 1) == -1,
+		   "the closed descriptor doesn't hit the new one");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+
+	const int count = 1000;
+	int fds[count];
+	for (int i = 0; i < count; ++i) {
+		fds[i] = ufs_open("file", 0);
+		unit_fail_if(fds[i] == -1);
+	}
+	for (int i = 0; i < count; ++i)
+		unit_fail_if(ufs_close(fds[i]) != 0);
+	unit_check(ufs_write(fd2, "a", 1) == 1,
+		   "a descriptor survives the table shrink");
+	bool ok = true;
+	for (int i = 0; i < count && ok; ++i)
+		ok = ufs_close(fds[i]) == -1;
+	unit_check(ok, "closed descriptors stay invalid");
+	fd = ufs_open("file", 0);
+	unit_check(fd != -1 && ufs_close(fd) == 0, "open after the shrink");
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
 	unit_test_finish();
 }
 
@@ -441,6 +733,1040 @@ test_resize(void)
 #endif
 }
 
+static void
+test_sparse(void)
+{
+#ifdef NEED_RESIZE
+	unit_test_start();
+
+	const size_t size = 100 * 1024 * 1024;
+	const size_t mid = size / 2 + 12345;
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_resize(fd, size) == 0, "grow to the max size");
+	unit_check(ufs_seek_data(fd, 0) == (off_t)size,
+		   "the growth is a hole");
+	unit_check(ufs_seek_hole(fd, 0) == 0, "a hole from the start");
+	char buf[4096];
+	unit_check(ufs_pread(fd, buf, sizeof(buf), mid - 100) == sizeof(buf),
+		   "read the hole");
+	bool ok = true;
+	for (size_t i = 0; i < sizeof(buf) && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "the hole is zeros");
+
+	unit_fail_if(ufs_pwrite(fd, "abc", 3, mid) != 3);
+	off_t data = ufs_seek_data(fd, 0);
+	off_t hole = ufs_seek_hole(fd, data);
+	unit_check(data > 0 && data <= (off_t)mid, "data before the write");
+	unit_check(hole >= (off_t)mid + 3 && hole < (off_t)size,
+		   "a hole after it");
+	unit_check(ufs_seek_data(fd, mid + 1) == (off_t)mid + 1,
+		   "data from inside the data");
+	unit_check(ufs_seek_data(fd, hole) == (off_t)size,
+		   "no data after the hole");
+	unit_check(ufs_seek_hole(fd, size + 10) == (off_t)size,
+		   "the hole at the end");
+	unit_check(ufs_pread(fd, buf, 6, mid - 2) == 6 &&
+		   memcmp(buf, "\0\0abc\0", 6) == 0,
+		   "the written block is zeros around the data");
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 0,
+		   "the position is not moved");
+
+	struct ufs_map map;
+	unit_check(ufs_read_map(fd, mid - 10, 4096, &map) == 4096,
+		   "map the data and the hole");
+	ok = true;
+	size_t pos = mid - 10;
+	for (int i = 0; i < map.iovcnt; ++i) {
+		const char *p = map.iov[i].iov_base;
+		for (size_t j = 0; j < map.iov[i].iov_len; ++j, ++pos) {
+			char expected = pos >= mid && pos < mid + 3 ?
+					"abc"[pos - mid] : 0;
+			ok = ok && p[j] == expected;
+		}
+	}
+	unit_check(ok, "the map is right");
+	ufs_read_unmap(&map);
+
+	unit_fail_if(ufs_clone("file", "copy") != 0);
+	int copy = ufs_open("copy", 0);
+	unit_fail_if(copy == -1);
+	unit_check(ufs_seek_data(copy, 0) == data &&
+		   ufs_seek_hole(copy, data) == hole, "a clone has the holes");
+	unit_fail_if(ufs_close(copy) != 0);
+	unit_fail_if(ufs_delete("copy") != 0);
+
+	unit_fail_if(ufs_resize(fd, mid + 1) != 0);
+	unit_fail_if(ufs_resize(fd, size) != 0);
+	unit_check(ufs_pread(fd, buf, 3, mid) == 3 &&
+		   memcmp(buf, "a\0\0", 3) == 0,
+		   "data cut by resize doesn't come back");
+
+	unit_check(ufs_seek_data(fd, -1) == -1, "negative offset");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_seek_hole(-1, 0) == -1, "invalid fd");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+#endif
+}
+
+static void
+test_stats(void)
+{
+	unit_test_start();
+
+	struct ufs_fs_stats before, after;
+	ufs_fs_stats(&before);
+	unit_fail_if(ufs_mkdir("s") != 0);
+	int fd = ufs_open("s/a", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[1000];
+	for (size_t i = 0; i < sizeof(buf); ++i)
+		buf[i] = 'a' + i % 26;
+	unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_pread(fd, buf, 10, 0) != 10);
+	int fd2 = ufs_open("s/b", UFS_CREATE);
+	unit_fail_if(fd2 == -1);
+	unit_fail_if(ufs_resize(fd2, 10 * 1024 * 1024) != 0);
+
+	struct ufs_stat st;
+	unit_check(ufs_stat("s/a", &st) == 0 && !st.is_dir, "stat a file");
+	unit_check(st.size == sizeof(buf) && st.block_count > 0,
+		   "size and blocks");
+	unit_check(st.slack_bytes > 0 &&
+		   st.allocated_bytes == st.size + st.slack_bytes,
+		   "the last block is partially used");
+	struct ufs_stat sparse;
+	unit_check(ufs_stat("/s/b", &sparse) == 0 &&
+		   sparse.size == 10 * 1024 * 1024 && sparse.block_count == 0 &&
+		   sparse.allocated_bytes == 0 && sparse.slack_bytes == 0,
+		   "a hole takes no memory");
+	struct ufs_stat dir;
+	unit_check(ufs_stat("s", &dir) == 0 && dir.is_dir && dir.size == 0,
+		   "stat a directory");
+	unit_check(ufs_stat("/", &dir) == 0 && dir.is_dir, "stat the root");
+	unit_check(ufs_stat("s/c", &dir) == -1, "no such file");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	unit_check(ufs_stat("s//a", &dir) == -1, "bad path");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+
+	ufs_fs_stats(&after);
+	unit_check(after.file_count == before.file_count + 2 &&
+		   after.dir_count == before.dir_count + 1, "fs counts");
+	unit_check(after.logical_bytes == before.logical_bytes + st.size +
+		   sparse.size, "fs logical size");
+	unit_check(after.block_count == before.block_count + st.block_count &&
+		   after.allocated_bytes == before.allocated_bytes +
+		   st.allocated_bytes, "fs blocks");
+	unit_check(after.slab_bytes >= st.allocated_bytes,
+		   "the slabs hold the blocks");
+	unit_check(after.partial_block_count ==
+		   before.partial_block_count + 1 &&
+		   after.slack_bytes == before.slack_bytes + st.slack_bytes,
+		   "fs fragmentation");
+	unit_check(after.open_descriptor_count ==
+		   before.open_descriptor_count + 2, "fs descriptors");
+	unit_check(after.write_count == before.write_count + 1 &&
+		   after.write_bytes == before.write_bytes + sizeof(buf) &&
+		   after.read_count == before.read_count + 1 &&
+		   after.read_bytes == before.read_bytes + 10, "fs I/O");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(fd2) != 0);
+	unit_fail_if(ufs_delete("s/a") != 0);
+	unit_fail_if(ufs_delete("s/b") != 0);
+	unit_fail_if(ufs_rmdir("s") != 0);
+	ufs_fs_stats(&after);
+	unit_check(after.file_count == before.file_count &&
+		   after.dir_count == before.dir_count &&
+		   after.block_count == before.block_count &&
+		   after.allocated_bytes == before.allocated_bytes &&
+		   after.open_descriptor_count ==
+		   before.open_descriptor_count, "all is freed");
+
+	unit_test_finish();
+}
+
+static void
+test_positional_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char buf[2048];
+	unit_check(ufs_pwrite(fd, "abc", 3, 1000) == 3, "pwrite beyond end");
+	unit_check(ufs_pread(fd, buf, sizeof(buf), 0) == 1003,
+		   "the gap is a part of the file");
+	bool ok = true;
+	for (int i = 0; i < 1000 && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok && memcmp(buf + 1000, "abc", 3) == 0,
+		   "the gap is zeros");
+	unit_check(ufs_read(fd, buf, 1) == 1 && buf[0] == 0,
+		   "pwrite and pread don't move the position");
+	unit_check(ufs_pread(fd, buf, 10, 1003) == 0, "pread at the end");
+	unit_check(ufs_pread(fd, buf, 10, 5000) == 0, "pread beyond the end");
+
+	unit_check(ufs_pwrite(fd, "xyz", 3, 511) == 3,
+		   "pwrite across a block border");
+	unit_check(ufs_pread(fd, buf, 5, 510) == 5 &&
+		   memcmp(buf, "\0xyz\0", 5) == 0, "pread across it");
+
+	unit_check(ufs_seek(fd, 0, UFS_SEEK_CUR) == 1, "seek to current");
+	unit_check(ufs_seek(fd, -3, UFS_SEEK_END) == 1000, "seek from end");
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 3 &&
+		   memcmp(buf, "abc", 3) == 0, "read after seek");
+	unit_check(ufs_seek(fd, 511, UFS_SEEK_SET) == 511, "seek from start");
+	unit_check(ufs_write(fd, "XY", 2) == 2, "write after seek");
+	unit_check(ufs_seek(fd, -2, UFS_SEEK_CUR) == 511, "seek back");
+	unit_check(ufs_read(fd, buf, 3) == 3 && memcmp(buf, "XYz", 3) == 0,
+		   "read the written data");
+	unit_check(ufs_seek(fd, 1, UFS_SEEK_END) == -1,
+		   "can't seek beyond the end");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_seek(fd, -1, UFS_SEEK_SET) == -1,
+		   "can't seek before the start");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_seek(fd, 0, 100) == -1, "invalid whence");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_seek(-1, 0, UFS_SEEK_SET) == -1, "invalid fd");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+	unit_check(ufs_pwrite(fd, "a", 1, 100 * 1024 * 1024) == -1,
+		   "can't pwrite beyond max file size");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_MEM);
+#ifdef NEED_RESIZE
+	unit_fail_if(ufs_resize(fd, 512) != 0);
+	unit_fail_if(ufs_pwrite(fd, "q", 1, 515) != 1);
+	unit_check(ufs_pread(fd, buf, 4, 512) == 4 &&
+		   memcmp(buf, "\0\0\0q", 4) == 0,
+		   "data cut by resize doesn't come back");
+#endif
+	unit_fail_if(ufs_close(fd) != 0);
+
+#ifdef NEED_OPEN_FLAGS
+	fd = ufs_open("file", UFS_READ_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "a", 1, 0) == -1, "pwrite needs rights");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_PERMISSION);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("file", UFS_WRITE_ONLY);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pread(fd, buf, 1, 0) == -1, "pread needs rights");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_PERMISSION);
+	unit_fail_if(ufs_close(fd) != 0);
+#endif
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_block_size(void)
+{
+	unit_test_start();
+
+	unit_check(ufs_set_min_block_size(0) == -1, "zero block size");
+	unit_check(ufs_errno() == UFS_ERR_INVALID_ARG, "errno is set");
+	unit_check(ufs_set_min_block_size(1000) == -1, "not a power of 2");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_set_min_block_size(2 * 1024 * 1024) == -1,
+		   "bigger than the max block");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+
+	size_t size = 3 * 1024 * 1024 + 12345;
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	for (size_t i = 0; i < size; ++i)
+		data[i] = i * 7 + i / 1000;
+	size_t block_sizes[] = {1, 64, 512, 4096, 1024 * 1024};
+	for (size_t k = 0; k < sizeof(block_sizes) / sizeof(block_sizes[0]);
+	     ++k) {
+		unit_fail_if(ufs_set_min_block_size(block_sizes[k]) != 0);
+		int fd = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		/* Writes of odd sizes to cross the block borders anyhow. */
+		size_t pos = 0;
+		for (size_t len = 1; pos < size; len = len * 3 + 1) {
+			if (len > size - pos)
+				len = size - pos;
+			unit_fail_if(ufs_write(fd, data + pos, len) !=
+				     (ssize_t)len);
+			pos += len;
+		}
+		memset(buf, 0, size);
+		unit_fail_if(ufs_pread(fd, buf, size, 0) != (ssize_t)size);
+		bool ok = memcmp(buf, data, size) == 0;
+		for (size_t i = 0; i < 1000 && ok; ++i) {
+			size_t offset = (i * 7919 * 1000) % size;
+			size_t len = (i * 131) % 5000 + 1;
+			if (len > size - offset)
+				len = size - offset;
+			ok = ufs_pread(fd, buf, len, offset) == (ssize_t)len &&
+			     memcmp(buf, data + offset, len) == 0;
+		}
+		unit_fail_if(!ok);
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("file") != 0);
+	}
+	unit_msg("data is correct with all the min block sizes");
+	unit_fail_if(ufs_set_min_block_size(512) != 0);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_block_reuse(void)
+{
+	unit_test_start();
+
+	char buf[5000];
+	memset(buf, 'x', sizeof(buf));
+	for (int i = 0; i < 100; ++i) {
+		int fd = ufs_open("file", UFS_CREATE);
+		unit_fail_if(fd == -1);
+		unit_fail_if(ufs_write(fd, buf, sizeof(buf)) != sizeof(buf));
+		unit_fail_if(ufs_close(fd) != 0);
+		unit_fail_if(ufs_delete("file") != 0);
+	}
+	unit_msg("files are created and deleted many times");
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_pwrite(fd, "a", 1, sizeof(buf) - 1) == 1,
+		   "a new file takes the freed blocks");
+	unit_fail_if(ufs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf));
+	bool ok = buf[sizeof(buf) - 1] == 'a';
+	for (size_t i = 0; i < sizeof(buf) - 1 && ok; ++i)
+		ok = buf[i] == 0;
+	unit_check(ok, "and doesn't see the old data");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_vectored_io(void)
+{
+	unit_test_start();
+
+	int fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	char big[1500];
+	for (size_t i = 0; i < sizeof(big); ++i)
+		big[i] = 'a' + i % 26;
+	struct iovec out[] = {
+		{.iov_base = "head", .iov_len = 4},
+		{.iov_base = NULL, .iov_len = 0},
+		{.iov_base = big, .iov_len = sizeof(big)},
+		{.iov_base = "tail", .iov_len = 4},
+	};
+	unit_check(ufs_writev(fd, out, 4) == 1508, "writev");
+	unit_check(ufs_writev(fd, out, -1) == -1, "negative count");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_fail_if(ufs_seek(fd, 2, UFS_SEEK_SET) != 2);
+
+	char b1[3], b2[1500], b3[100];
+	struct iovec in[] = {
+		{.iov_base = b1, .iov_len = sizeof(b1)},
+		{.iov_base = b2, .iov_len = sizeof(b2)},
+		{.iov_base = b3, .iov_len = sizeof(b3)},
+	};
+	unit_check(ufs_readv(fd, in, 3) == 1506, "readv to the end");
+	unit_check(memcmp(b1, "ada", 3) == 0 &&
+		   memcmp(b2, big + 1, sizeof(big) - 1) == 0 &&
+		   memcmp(b2 + sizeof(big) - 1, "t", 1) == 0 &&
+		   memcmp(b3, "ail", 3) == 0, "data is scattered in order");
+	unit_check(ufs_readv(fd, in, 3) == 0, "readv at EOF");
+
+	struct ufs_map map;
+	unit_check(ufs_read_map(fd, 4, 10000, &map) == 1504,
+		   "map is cut at the file end");
+	char expected[1504];
+	memcpy(expected, big, sizeof(big));
+	memcpy(expected + sizeof(big), "tail", 4);
+	size_t size = 0;
+	bool ok = true;
+	for (int i = 0; i < map.iovcnt && ok; ++i) {
+		ok = size + map.iov[i].iov_len <= sizeof(expected) &&
+		     memcmp(map.iov[i].iov_base, expected + size,
+			    map.iov[i].iov_len) == 0;
+		size += map.iov[i].iov_len;
+	}
+	unit_check(ok && size == 1504 && map.iovcnt > 1,
+		   "map pieces cover the range");
+	unit_check(ufs_resize(fd, 10) == -1, "can't shrink a mapped file");
+	unit_check(ufs_errno() == UFS_ERR_BUSY, "errno is set");
+	unit_check(ufs_resize(fd, 5000) == 0, "but can grow it");
+	unit_fail_if(ufs_pwrite(fd, "A", 1, 4) != 1);
+	unit_check(*(char *)map.iov[0].iov_base == 'A', "map sees writes");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+	struct iovec *last = &map.iov[map.iovcnt - 1];
+	unit_check(memcmp((char *)last->iov_base + last->iov_len - 4, "tail",
+			  4) == 0,
+		   "map lives after the file is deleted and closed");
+	ufs_read_unmap(&map);
+
+	fd = ufs_open("file", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_read_map(fd, 0, 10, &map) == 0 && map.iovcnt == 0,
+		   "map of an empty file");
+	ufs_read_unmap(&map);
+	unit_fail_if(ufs_write(fd, "abc", 3) != 3);
+	unit_fail_if(ufs_read_map(fd, 0, 3, &map) != 3);
+	ufs_read_unmap(&map);
+	unit_check(ufs_resize(fd, 1) == 0, "can shrink after unmap");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("file") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_save_load(void)
+{
+	unit_test_start();
+
+	const char *path = "test_image.ufs";
+	enum { BIG_SIZE = 3 * 1024 * 1024 + 100 };
+	char *big = malloc(BIG_SIZE);
+	char *buf = malloc(BIG_SIZE + 8);
+	for (int i = 0; i < BIG_SIZE; ++i)
+		big[i] = i * 31 + i / 4096;
+	int fd = ufs_open("big", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, big, BIG_SIZE) != BIG_SIZE);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("small", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, "small", 5) != 5);
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("empty", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_check(ufs_save(path) == 0, "save");
+
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("empty") != 0);
+	int other = ufs_open("other", UFS_CREATE);
+	unit_fail_if(other == -1);
+	unit_check(ufs_load(path) == 0, "load");
+
+	int big_fd = ufs_open("big", 0);
+	unit_fail_if(big_fd == -1);
+	unit_check(ufs_read(big_fd, buf, BIG_SIZE) == BIG_SIZE &&
+		   memcmp(buf, big, BIG_SIZE) == 0, "big file is loaded");
+	int small_fd = ufs_open("small", 0);
+	unit_check(ufs_read(small_fd, buf, 100) == 5 &&
+		   memcmp(buf, "small", 5) == 0, "small file is loaded");
+	int empty_fd = ufs_open("empty", 0);
+	unit_check(empty_fd != -1 && ufs_read(empty_fd, buf, 1) == 0,
+		   "empty file is loaded");
+	unit_check(ufs_read(fd, buf, 1) == 0,
+		   "descriptors of the old files still work");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_write(other, "x", 1) == 1,
+		   "files not in the image stay");
+
+	unit_fail_if(ufs_pwrite(big_fd, "changed", 7, 1000) != 7);
+	unit_fail_if(ufs_write(big_fd, "appended", 8) != 8);
+	unit_fail_if(ufs_write(small_fd, "er", 2) != 2);
+	unit_fail_if(ufs_pread(big_fd, buf, BIG_SIZE + 8, 0) != BIG_SIZE + 8);
+	memcpy(big + 1000, "changed", 7);
+	unit_check(memcmp(buf, big, BIG_SIZE) == 0 &&
+		   memcmp(buf + BIG_SIZE, "appended", 8) == 0,
+		   "loaded files can be changed and grown");
+	unit_check(ufs_pread(small_fd, buf, 100, 0) == 7 &&
+		   memcmp(buf, "smaller", 7) == 0, "including the small one");
+
+	unit_fail_if(ufs_close(big_fd) != 0);
+	unit_fail_if(ufs_close(small_fd) != 0);
+	unit_fail_if(ufs_close(empty_fd) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_check(ufs_load(path) == 0, "load again");
+	big_fd = ufs_open("big", 0);
+	unit_check(ufs_pread(big_fd, buf, BIG_SIZE, 0) == BIG_SIZE &&
+		   memcmp(buf + 1000, "changed", 7) != 0,
+		   "the image is not changed by writes into the loaded files");
+	unit_fail_if(ufs_close(big_fd) != 0);
+	unit_fail_if(ufs_delete("big") != 0);
+	unit_fail_if(ufs_delete("small") != 0);
+	unit_fail_if(ufs_delete("empty") != 0);
+	unit_fail_if(ufs_close(other) != 0);
+	unit_fail_if(ufs_delete("other") != 0);
+
+	FILE *f = fopen(path, "r+");
+	unit_fail_if(f == NULL);
+	unit_fail_if(fwrite("garbage", 1, 7, f) != 7);
+	fclose(f);
+	unit_check(ufs_load(path) == -1, "a corrupted image is not loaded");
+	unit_check(ufs_errno() == UFS_ERR_IO, "errno is set");
+	unlink(path);
+	unit_check(ufs_load(path) == -1, "no image");
+	unit_fail_if(ufs_errno() != UFS_ERR_IO);
+	unit_check(ufs_save("/nonexistent/dir/image") == -1,
+		   "save to a bad path");
+	unit_fail_if(ufs_errno() != UFS_ERR_IO);
+	free(buf);
+	free(big);
+
+	unit_test_finish();
+}
+
+enum {
+	SHARED_FILE_SIZE = 64 * 1024,
+	CHURN_FILE_COUNT = 16,
+};
+
+static char shared_data[SHARED_FILE_SIZE];
+
+/** Write, check and truncate a private file, check the errno is private. */
+static void *
+thread_own_file(void *arg)
+{
+	long id = (long)arg;
+	char name[32];
+	char buf[3000];
+	char data[3000];
+	sprintf(name, "own%ld", id);
+	memset(data, 'a' + id, sizeof(data));
+	for (int i = 0; i < 200; ++i) {
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1)
+			return (void *)false;
+		if (ufs_seek(fd, 0, 100) != -1)
+			return (void *)false;
+		if (ufs_write(fd, data, sizeof(data)) != sizeof(data) ||
+		    ufs_pread(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+		    memcmp(buf, data, sizeof(buf)) != 0 ||
+		    ufs_resize(fd, i) != 0)
+			return (void *)false;
+		/* Other threads fail with other errors meanwhile. */
+		sched_yield();
+		if (ufs_errno() != UFS_ERR_INVALID_ARG)
+			return (void *)false;
+		if (ufs_close(fd) != 0 || ufs_delete(name) != 0)
+			return (void *)false;
+	}
+	return (void *)true;
+}
+
+/** Read random ranges of the shared file and check them. */
+static void *
+thread_shared_reader(void *arg)
+{
+	unsigned seed = (long)arg;
+	int fd = ufs_open("shared", UFS_READ_ONLY);
+	if (fd == -1)
+		return (void *)false;
+	bool ok = true;
+	char buf[5000];
+	for (int i = 0; i < 3000 && ok; ++i) {
+		size_t offset = rand_r(&seed) % SHARED_FILE_SIZE;
+		size_t size = rand_r(&seed) % sizeof(buf);
+		if (size > SHARED_FILE_SIZE - offset)
+			size = SHARED_FILE_SIZE - offset;
+		ok = ufs_pread(fd, buf, size, offset) == (ssize_t)size &&
+		     memcmp(buf, shared_data + offset, size) == 0;
+	}
+	ufs_close(fd);
+	return (void *)ok;
+}
+
+/** Rewrite ranges of the shared file with the same data. */
+static void *
+thread_shared_writer(void *arg)
+{
+	unsigned seed = (long)arg;
+	int fd = ufs_open("shared", UFS_WRITE_ONLY);
+	if (fd == -1)
+		return (void *)false;
+	bool ok = true;
+	for (int i = 0; i < 1000 && ok; ++i) {
+		size_t offset = rand_r(&seed) % SHARED_FILE_SIZE;
+		size_t size = rand_r(&seed) % 5000;
+		if (size > SHARED_FILE_SIZE - offset)
+			size = SHARED_FILE_SIZE - offset;
+		ok = ufs_pwrite(fd, shared_data + offset, size, offset) ==
+		     (ssize_t)size;
+	}
+	ufs_close(fd);
+	return (void *)ok;
+}
+
+/** Open, write and delete files with the names shared between threads. */
+static void *
+thread_churn(void *arg)
+{
+	unsigned seed = (long)arg;
+	char name[32];
+	for (int i = 0; i < 3000; ++i) {
+		sprintf(name, "churn%d", rand_r(&seed) % CHURN_FILE_COUNT);
+		int fd = ufs_open(name, UFS_CREATE);
+		if (fd == -1)
+			return (void *)false;
+		if (ufs_write(fd, name, strlen(name)) != (ssize_t)strlen(name))
+			return (void *)false;
+		/* The file can be already deleted by another thread. */
+		if (ufs_delete(name) != 0 && ufs_errno() != UFS_ERR_NO_FILE)
+			return (void *)false;
+		if (ufs_close(fd) != 0)
+			return (void *)false;
+	}
+	return (void *)true;
+}
+
+static void
+test_clone(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 100 * 1000 };
+	char *data = malloc(SIZE);
+	char *buf = malloc(SIZE);
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = i * 7 + i / 1000;
+	int src = ufs_open("src", UFS_CREATE);
+	unit_fail_if(ufs_write(src, data, SIZE) != SIZE);
+	unit_check(ufs_clone("src", "dst") == 0, "clone");
+	int dst = ufs_open("dst", 0);
+	unit_check(ufs_read(dst, buf, SIZE) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0, "the clone has the data");
+	unit_fail_if(ufs_pwrite(dst, "dst", 3, 50000) != 3);
+	unit_fail_if(ufs_pwrite(src, "src", 3, 60000) != 3);
+	unit_check(ufs_pread(src, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf + 50000, data + 50000, 3) == 0 &&
+		   memcmp(buf + 60000, "src", 3) == 0,
+		   "a write into the clone doesn't change the source");
+	unit_check(ufs_pread(dst, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf + 60000, data + 60000, 3) == 0 &&
+		   memcmp(buf + 50000, "dst", 3) == 0 &&
+		   memcmp(buf, data, 50000) == 0,
+		   "and vice versa");
+
+	unit_fail_if(ufs_resize(src, 10) != 0);
+	unit_fail_if(ufs_clone("src", "dst") != 0);
+	int dst2 = ufs_open("dst", 0);
+	unit_check(ufs_pread(dst, buf, 3, 50000) == 3 &&
+		   memcmp(buf, "dst", 3) == 0,
+		   "a replaced clone stays for its descriptors");
+	unit_fail_if(ufs_resize(src, 20) != 0);
+	unit_check(ufs_pread(src, buf, 20, 0) == 20 &&
+		   memcmp(buf, data, 10) == 0 && buf[10] == 0 && buf[19] == 0,
+		   "growing a clone source zeroes the shared tail");
+	unit_check(ufs_pread(dst2, buf, SIZE, 0) == 10 &&
+		   memcmp(buf, data, 10) == 0, "the clone is not changed");
+	unit_fail_if(ufs_close(dst2) != 0);
+	unit_check(ufs_clone("missing", "dst") == -1, "no source");
+	unit_fail_if(ufs_errno() != UFS_ERR_NO_FILE);
+
+	struct ufs_map map;
+	unit_fail_if(ufs_read_map(src, 0, 10, &map) != 10);
+	unit_fail_if(ufs_clone("src", "dst") != 0);
+	unit_fail_if(ufs_pwrite(src, "changed", 7, 0) != 7);
+	unit_check(memcmp(map.iov[0].iov_base, data, 10) == 0,
+		   "a map keeps a block copied on write");
+	unit_fail_if(ufs_delete("dst") != 0);
+	unit_check(memcmp(map.iov[0].iov_base, data, 10) == 0,
+		   "even if the clone is deleted");
+	ufs_read_unmap(&map);
+
+	unit_fail_if(ufs_close(src) != 0);
+	unit_fail_if(ufs_close(dst) != 0);
+	unit_fail_if(ufs_delete("src") != 0);
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_snapshot(void)
+{
+	unit_test_start();
+
+	char buf[100];
+	int a = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(a, "first", 5) != 5);
+	int b = ufs_open("b", UFS_CREATE);
+	unit_fail_if(ufs_write(b, "second", 6) != 6);
+	struct ufs_snapshot *snapshot = ufs_snapshot_create();
+	unit_check(snapshot != NULL, "snapshot");
+	unit_fail_if(ufs_pwrite(a, "F", 1, 0) != 1);
+	unit_fail_if(ufs_delete("b") != 0);
+	int c = ufs_open("c", UFS_CREATE);
+
+	unit_check(ufs_snapshot_restore(snapshot) == 0, "restore");
+	int fd = ufs_open("a", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "first", 5) == 0, "a change is undone");
+	unit_fail_if(ufs_close(fd) != 0);
+	fd = ufs_open("b", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "second", 6) == 0, "a deleted file is back");
+	unit_check(ufs_open("c", 0) == -1, "a new file is gone");
+	unit_check(ufs_pread(a, buf, sizeof(buf), 0) == 5 &&
+		   memcmp(buf, "First", 5) == 0,
+		   "descriptors keep the old files");
+
+	unit_fail_if(ufs_write(fd, "!", 1) != 1);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_check(ufs_snapshot_restore(snapshot) == 0, "restore again");
+	fd = ufs_open("b", 0);
+	unit_check(ufs_read(fd, buf, sizeof(buf)) == 6,
+		   "the snapshot is not changed by the restored files");
+	unit_fail_if(ufs_close(fd) != 0);
+	ufs_snapshot_delete(snapshot);
+
+	unit_fail_if(ufs_close(a) != 0);
+	unit_fail_if(ufs_close(b) != 0);
+	unit_fail_if(ufs_close(c) != 0);
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+
+	unit_test_finish();
+}
+
+static void
+test_dedup(void)
+{
+	unit_test_start();
+
+	enum { SIZE = 100 * 1000 };
+	char *data = malloc(SIZE);
+	char *buf = malloc(SIZE);
+	for (int i = 0; i < SIZE; ++i)
+		data[i] = i * 13 + i / 500;
+	struct ufs_dedup_stats stats;
+	ufs_set_dedup(true);
+	int a = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(a, data, SIZE) != SIZE);
+	ufs_dedup_stats(&stats);
+	size_t block_count = stats.block_count;
+	size_t bytes = stats.bytes;
+	unit_check(block_count > 0 && bytes <= SIZE && stats.hit_count == 0 &&
+		   stats.logical_bytes == bytes, "full blocks are indexed");
+	int b = ufs_open("b", UFS_CREATE);
+	unit_fail_if(ufs_write(b, data, SIZE) != SIZE);
+	ufs_dedup_stats(&stats);
+	unit_check(stats.block_count == block_count &&
+		   stats.hit_count == block_count &&
+		   stats.logical_bytes == 2 * bytes,
+		   "the same blocks are shared");
+
+	unit_fail_if(ufs_pwrite(b, "b", 1, 0) != 1);
+	unit_check(ufs_pread(a, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf, data, SIZE) == 0,
+		   "a write into a shared block copies it");
+	unit_check(ufs_pread(b, buf, SIZE, 0) == SIZE && buf[0] == 'b' &&
+		   memcmp(buf + 1, data + 1, SIZE - 1) == 0, "and changes it");
+	ufs_dedup_stats(&stats);
+	unit_check(stats.logical_bytes < 2 * bytes, "the copy is not shared");
+
+	unit_fail_if(ufs_close(b) != 0);
+	unit_fail_if(ufs_delete("b") != 0);
+	unit_fail_if(ufs_pwrite(a, "a", 1, 0) != 1);
+	ufs_dedup_stats(&stats);
+	size_t hit_count = stats.hit_count;
+	unit_check(stats.block_count == block_count - 1,
+		   "a private block leaves the index when changed in place");
+	int c = ufs_open("c", UFS_CREATE);
+	unit_fail_if(ufs_write(c, data, SIZE) != SIZE);
+	ufs_dedup_stats(&stats);
+	unit_check(stats.hit_count == hit_count + block_count - 1,
+		   "the old content of a changed block is not found");
+
+	unit_fail_if(ufs_resize(c, 0) != 0);
+	ufs_set_dedup(false);
+	unit_fail_if(ufs_write(c, data, SIZE) != SIZE);
+	ufs_dedup_stats(&stats);
+	unit_check(stats.hit_count == hit_count + block_count - 1,
+		   "no dedup when it is off");
+
+	unit_fail_if(ufs_close(a) != 0);
+	unit_fail_if(ufs_close(c) != 0);
+	unit_fail_if(ufs_delete("a") != 0);
+	unit_fail_if(ufs_delete("c") != 0);
+	ufs_dedup_stats(&stats);
+	unit_check(stats.block_count == 0 && stats.bytes == 0,
+		   "freed blocks leave the index");
+	free(buf);
+	free(data);
+
+	unit_test_finish();
+}
+
+static void
+test_compression(void)
+{
+	unit_test_start();
+
+	/* The noise fills its blocks up, they have no compressible tail. */
+	enum { SIZE = 300 * 1000, NOISE_SIZE = 511 * 512 };
+	char *text = malloc(SIZE);
+	char *noise = malloc(NOISE_SIZE);
+	char *buf = malloc(SIZE);
+	static const char line[] = "a line of a text file which compresses\n";
+	for (int i = 0; i < SIZE; ++i)
+		text[i] = line[i % (sizeof(line) - 1)];
+	for (int i = 0; i < NOISE_SIZE; ++i)
+		noise[i] = rand();
+	int fd = ufs_open("text", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, text, SIZE) != SIZE);
+	int noise_fd = ufs_open("noise", UFS_CREATE);
+	unit_fail_if(ufs_write(noise_fd, noise, NOISE_SIZE) != NOISE_SIZE);
+	struct ufs_compression_stats stats;
+	ufs_compress_cold();
+	ufs_compression_stats(&stats);
+	unit_check(stats.block_count == 0, "written blocks are hot");
+	ufs_compress_cold();
+	ufs_compression_stats(&stats);
+	size_t block_count = stats.block_count;
+	/* The last block is compressed whole. */
+	unit_check(block_count > 0 && stats.raw_bytes < 2 * SIZE &&
+		   stats.compressed_bytes < stats.raw_bytes / 4,
+		   "the text is compressed, the noise is not");
+
+	unit_check(ufs_pread(fd, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf, text, SIZE) == 0, "compressed blocks are read");
+	unit_check(ufs_pread(noise_fd, buf, SIZE, 0) == NOISE_SIZE &&
+		   memcmp(buf, noise, NOISE_SIZE) == 0, "and the other ones");
+	ufs_compression_stats(&stats);
+	size_t miss_count = stats.cache_miss_count;
+	unit_check(miss_count > 0 && stats.block_count == block_count,
+		   "reads decompress into the cache");
+	unit_fail_if(ufs_pread(fd, buf, 10, 100) != 10);
+	ufs_compression_stats(&stats);
+	unit_check(stats.cache_hit_count > 0 &&
+		   stats.cache_miss_count == miss_count, "cache hit");
+
+	unit_fail_if(ufs_pwrite(fd, "changed", 7, 1000) != 7);
+	memcpy(text + 1000, "changed", 7);
+	ufs_compression_stats(&stats);
+	unit_check(stats.block_count == block_count - 1,
+		   "a write decompresses the block");
+	unit_check(ufs_pread(fd, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf, text, SIZE) == 0, "and changes it");
+	unit_fail_if(ufs_clone("text", "text2") != 0);
+	int clone_fd = ufs_open("text2", 0);
+	unit_check(ufs_pread(clone_fd, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf, text, SIZE) == 0, "a clone shares them");
+	unit_fail_if(ufs_close(clone_fd) != 0);
+	unit_fail_if(ufs_delete("text2") != 0);
+
+	ufs_compress_cold();
+	ufs_compress_cold();
+	ufs_compression_stats(&stats);
+	block_count = stats.block_count;
+	struct ufs_map map;
+	unit_fail_if(ufs_read_map(fd, 0, SIZE, &map) != SIZE);
+	size_t done = 0;
+	bool ok = true;
+	for (int i = 0; i < map.iovcnt; ++i) {
+		ok = ok && memcmp(map.iov[i].iov_base, text + done,
+				  map.iov[i].iov_len) == 0;
+		done += map.iov[i].iov_len;
+	}
+	ufs_read_unmap(&map);
+	ufs_compression_stats(&stats);
+	unit_check(ok && stats.block_count < block_count,
+		   "a map decompresses the range");
+
+	const char *path = "test_compression.ufs";
+	ufs_compress_cold();
+	ufs_compress_cold();
+	unit_fail_if(ufs_save(path) != 0);
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("text") != 0);
+	unit_fail_if(ufs_load(path) != 0);
+	unlink(path);
+	fd = ufs_open("text", 0);
+	unit_check(ufs_pread(fd, buf, SIZE, 0) == SIZE &&
+		   memcmp(buf, text, SIZE) == 0,
+		   "compressed blocks are saved");
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_delete("text") != 0);
+
+	unit_check(ufs_set_compression(-1) == -1, "bad interval");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	fd = ufs_open("text", UFS_CREATE);
+	unit_fail_if(ufs_write(fd, text, SIZE) != SIZE);
+	unit_fail_if(ufs_set_compression(10) != 0);
+	for (int i = 0; i < 100 && stats.block_count == 0; ++i) {
+		usleep(10 * 1000);
+		ufs_compression_stats(&stats);
+	}
+	unit_fail_if(ufs_set_compression(0) != 0);
+	unit_check(stats.block_count > 0, "background compression");
+
+	unit_fail_if(ufs_close(fd) != 0);
+	unit_fail_if(ufs_close(noise_fd) != 0);
+	unit_fail_if(ufs_delete("text") != 0);
+	unit_fail_if(ufs_delete("noise") != 0);
+	ufs_compression_stats(&stats);
+	unit_check(stats.block_count == 0 && stats.compressed_bytes == 0,
+		   "deleted blocks are freed");
+	free(buf);
+	free(noise);
+	free(text);
+
+	unit_test_finish();
+}
+
+static off_t
+test_file_size(const char *path)
+{
+	struct stat st;
+	return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void
+test_wal(void)
+{
+	unit_test_start();
+
+	const char *path = "test_wal.ufs";
+	const char *wal_path = "test_wal.ufs.wal";
+	unlink(path);
+	unlink(wal_path);
+	unit_check(ufs_wal_open(path, 0, 0) == -1, "bad batch size");
+	unit_fail_if(ufs_errno() != UFS_ERR_INVALID_ARG);
+	unit_check(ufs_wal_sync() == -1, "sync without a log");
+	unit_check(ufs_wal_open(path, 4, 0) == 0, "open the log");
+	unit_check(ufs_wal_open(path, 4, 0) == -1, "open it twice");
+	unit_fail_if(ufs_errno() != UFS_ERR_BUSY);
+
+	char buf[1000];
+	memset(buf, 'b', sizeof(buf));
+	int a = ufs_open("a", UFS_CREATE);
+	unit_fail_if(ufs_write(a, "hello", 5) != 5);
+	unit_fail_if(ufs_pwrite(a, "J", 1, 0) != 1);
+	int b = ufs_open("b", UFS_CREATE);
+	unit_fail_if(ufs_write(b, buf, sizeof(buf)) != sizeof(buf));
+	unit_fail_if(ufs_resize(b, 10) != 0);
+	int c = ufs_open("c", UFS_CREATE);
+	int d = ufs_open("d", UFS_CREATE);
+	unit_fail_if(ufs_delete("d") != 0);
+	unit_fail_if(ufs_write(d, "deleted", 7) != 7);
+	unit_check(ufs_load(path) == -1, "no load with an open log");
+	unit_fail_if(ufs_errno() != UFS_ERR_BUSY);
+	unit_check(ufs_wal_close() == 0, "close the log");
+	unit_check(test_file_size(wal_path) > 0, "the log is written");
+	unit_fail_if(ufs_close(a) != 0 || ufs_close(b) != 0 ||
+		     ufs_close(c) != 0 || ufs_close(d) != 0);
+	unit_fail_if(ufs_delete("a") != 0 || ufs_delete("b") != 0 ||
+		     ufs_delete("c") != 0);
+
+	/* A torn record of a crash. */
+	off_t wal_size = test_file_size(wal_path);
+	FILE *f = fopen(wal_path, "a");
+	unit_fail_if(f == NULL);
+	unit_fail_if(fwrite(buf, 1, 30, f) != 30);
+	fclose(f);
+	unit_check(ufs_load(path) == 0, "load the log without an image");
+	a = ufs_open("a", 0);
+	unit_check(ufs_read(a, buf, sizeof(buf)) == 5 &&
+		   memcmp(buf, "Jello", 5) == 0, "writes are replayed");
+	b = ufs_open("b", 0);
+	unit_check(ufs_read(b, buf, sizeof(buf)) == 10 && buf[9] == 'b',
+		   "resize is replayed");
+	c = ufs_open("c", 0);
+	unit_check(c != -1 && ufs_read(c, buf, 1) == 0,
+		   "an empty file is replayed");
+	unit_check(ufs_open("d", 0) == -1, "delete is replayed");
+
+	unit_check(ufs_wal_open(path, 1000, 10) == 0, "reopen the log");
+	unit_check(test_file_size(wal_path) == wal_size,
+		   "the torn tail is cut");
+	unit_fail_if(ufs_pwrite(a, "H", 1, 0) != 1);
+	usleep(100 * 1000);
+	unit_check(test_file_size(wal_path) > wal_size,
+		   "an incomplete batch is flushed by the interval");
+	unit_check(ufs_save(path) == 0, "save");
+	unit_check(test_file_size(wal_path) == 0, "save empties the log");
+	unit_fail_if(ufs_pwrite(a, "!", 1, 5) != 1);
+	unit_fail_if(ufs_resize(b, 1) != 0);
+	unit_fail_if(ufs_clone("a", "a2") != 0);
+	unit_check(ufs_wal_sync() == 0, "sync");
+	unit_check(test_file_size(wal_path) > 0, "the sync writes the log");
+	unit_fail_if(ufs_wal_close() != 0);
+	unit_fail_if(ufs_close(a) != 0 || ufs_close(b) != 0 ||
+		     ufs_close(c) != 0);
+	unit_fail_if(ufs_delete("a") != 0 || ufs_delete("b") != 0 ||
+		     ufs_delete("c") != 0);
+
+	unit_check(ufs_load(path) == 0, "load the image and the log");
+	a = ufs_open("a", 0);
+	unit_check(ufs_read(a, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "Hello!", 6) == 0,
+		   "the image and the log are combined");
+	b = ufs_open("b", 0);
+	unit_check(ufs_read(b, buf, sizeof(buf)) == 1, "b is resized");
+	c = ufs_open("a2", 0);
+	unit_check(ufs_read(c, buf, sizeof(buf)) == 6 &&
+		   memcmp(buf, "Hello!", 6) == 0, "a clone is replayed");
+	unit_fail_if(ufs_close(a) != 0 || ufs_close(b) != 0 ||
+		     ufs_close(c) != 0);
+	unit_fail_if(ufs_delete("a") != 0 || ufs_delete("b") != 0 ||
+		     ufs_delete("c") != 0 || ufs_delete("a2") != 0);
+	unlink(path);
+	unlink(wal_path);
+
+	unit_test_finish();
+}
+
+static void
+test_threads(void)
+{
+	unit_test_start();
+
+	for (int i = 0; i < SHARED_FILE_SIZE; ++i)
+		shared_data[i] = i * 13 + i / 256;
+	int fd = ufs_open("shared", UFS_CREATE);
+	unit_fail_if(fd == -1);
+	unit_fail_if(ufs_write(fd, shared_data, SHARED_FILE_SIZE) !=
+		     SHARED_FILE_SIZE);
+	unit_fail_if(ufs_close(fd) != 0);
+
+	void *(*funcs[])(void *) = {
+		thread_own_file, thread_own_file, thread_own_file,
+		thread_shared_reader, thread_shared_reader,
+		thread_shared_reader, thread_shared_writer,
+		thread_churn, thread_churn,
+	};
+	enum { COUNT = sizeof(funcs) / sizeof(funcs[0]) };
+	pthread_t threads[COUNT];
+	for (long i = 0; i < COUNT; ++i)
+		unit_fail_if(pthread_create(&threads[i], NULL, funcs[i],
+					    (void *)i) != 0);
+	bool ok = true;
+	for (int i = 0; i < COUNT; ++i) {
+		void *rc;
+		unit_fail_if(pthread_join(threads[i], &rc) != 0);
+		ok = ok && (bool)rc;
+	}
+	unit_check(ok, "concurrent reads, writes, opens and deletes");
+
+	char name[32];
+	for (int i = 0; i < CHURN_FILE_COUNT; ++i) {
+		sprintf(name, "churn%d", i);
+		ufs_delete(name);
+	}
+	unit_fail_if(ufs_delete("shared") != 0);
+
+	unit_test_finish();
+}
+
 int
 main(void)
 {
@@ -451,9 +1777,24 @@ main(void)
 	test_io();
 	test_delete();
 	test_stress_open();
+	test_name_index();
+	test_dirs();
 	test_max_file_size();
 	test_rights();
 	test_resize();
+	test_sparse();
+	test_stats();
+	test_positional_io();
+	test_block_size();
+	test_block_reuse();
+	test_vectored_io();
+	test_clone();
+	test_snapshot();
+	test_dedup();
+	test_compression();
+	test_save_load();
+	test_wal();
+	test_threads();
 
 	/* Free the memory to make the memory leak detector happy. */
 	ufs_destroy();
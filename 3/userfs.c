@@ -1,64 +1,465 @@
 #include "userfs.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
 
 enum {
-	BLOCK_SIZE = 512,
+	/**
+	 * Blocks of a file grow geometrically: the first one has the
+	 * min block size of the file, each next one is twice bigger, up
+	 * to this size. Then all the blocks are of this size.
+	 */
+	MAX_BLOCK_SHIFT = 20,
+	MAX_BLOCK_SIZE = 1 << MAX_BLOCK_SHIFT,
+	DEFAULT_MIN_BLOCK_SHIFT = 9,
+	/**
+	 * A descriptor number is its slot in the descriptor table and the
+	 * generation of the slot above it, so a closed descriptor doesn't
+	 * work when its slot is taken again.
+	 */
+	FD_SLOT_BITS = 20,
+	MAX_FD_COUNT = 1 << FD_SLOT_BITS,
+	FD_GENERATION_COUNT = 1 << (31 - FD_SLOT_BITS),
+	/** The table isn't shrunk below this. */
+	MIN_FD_CAPACITY = 16,
+	/** Min size of a slab the blocks are cut from. */
+	SLAB_SIZE = 256 * 1024,
+	/** Slots of the directory path cache. */
+	DIR_CACHE_SIZE = 1024,
+	/** Number of independently locked parts of the cache. */
+	DIR_CACHE_LOCK_COUNT = 16,
 	MAX_FILE_SIZE = 1024 * 1024 * 100,
+	/** Alignment of the block memory, like malloc() gives. */
+	BLOCK_ALIGN = 16,
+	/**
+	 * Blocks are compressed by frames of this size at most, so a
+	 * small read decompresses one frame, not the whole block.
+	 */
+	FRAME_SHIFT = 16,
+	FRAME_SIZE = 1 << FRAME_SHIFT,
+	MAX_FRAME_COUNT = MAX_BLOCK_SIZE / FRAME_SIZE,
+	/** Number of the decompressed frames kept for the reads. */
+	BLOCK_CACHE_SIZE = 64,
+	/** Smallest block which memory is given back to the OS. */
+	MIN_RELEASED_BLOCK_SIZE = 64 * 1024,
+	/** Number of the I/O counter sets, the threads are spread over them. */
+	IO_STATS_SHARD_COUNT = 16,
 };
 
-/** Global error code. Set from any function on any error. */
-static enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+/** Error code of the last failed call in this thread. */
+static __thread enum ufs_error_code ufs_error_code = UFS_ERR_NO_ERR;
+
+/** What the holes read as, and the maps of them point at. */
+static char zero_block[MAX_BLOCK_SIZE];
+
+/** Log2 of the min block size of new files. Accessed atomically. */
+static int min_block_shift = DEFAULT_MIN_BLOCK_SHIFT;
+
+enum block_state {
+	BLOCK_RAW,
+	/** A raw block which didn't compress well, not to try again. */
+	BLOCK_INCOMPRESSIBLE,
+	/**
+	 * The memory holds the compressed frames: the offsets of their
+	 * data from the memory start, one more for the end, then the
+	 * data. Such a block and its header are allocated with malloc(),
+	 * and it is never changed: a write replaces it with a raw copy.
+	 */
+	BLOCK_COMPRESSED,
+};
 
 struct block {
-	/** Block memory. */
+	/**
+	 * Block memory, file_block_size() bytes. It is right after the
+	 * header, or in the image the block is loaded from, or is the
+	 * compressed data.
+	 */
+	char *memory;
+	/** The image the memory belongs to, if any. */
+	struct image *image;
+	union {
+		/** Next block of the same size in the free list. */
+		struct block *next_free;
+		/** Hash of the memory, while the block is in the dedup index. */
+		uint64_t hash;
+		/** Size of the data of a compressed block. */
+		uint64_t compressed_size;
+	};
+	/**
+	 * How many files and snapshots share the block. A shared block is
+	 * copied on write. Changed atomically.
+	 */
+	int refs;
+	/** Log2 of the block size. */
+	uint8_t shift;
+	/** The block is in the dedup index. Changed under its lock. */
+	bool is_indexed;
+	/** One of block_state. */
+	uint8_t state;
+	/**
+	 * The block was accessed since the last compression pass, it is
+	 * not cold. Changed atomically.
+	 */
+	bool is_hot;
+};
+
+/**
+ * A file system image loaded with ufs_load(). It is mapped privately, so
+ * the blocks pointing into it are faulted in on first access, and the
+ * kernel copies a page on first write into it. The image is unmapped when
+ * the last of its blocks is dropped.
+ */
+struct image {
+	char *data;
+	size_t size;
+	/** Headers of all the image blocks. */
+	struct block *blocks;
+	/** How many blocks still use the image. Changed atomically. */
+	size_t refs;
+};
+
+/**
+ * Image layout: the header, the file table, then the data of each file
+ * aligned by BLOCK_ALIGN. Numbers are in the host byte order.
+ */
+struct image_header {
+	char magic[8];
+	uint64_t file_count;
+};
+
+/**
+ * File table entry, followed by the path padded to 8 bytes. A directory
+ * path ends with a slash, and it has no data. The directories go before
+ * their entries.
+ */
+struct image_file {
+	/** File size. */
+	uint64_t size;
+	/** Offset of the file data in the image. */
+	uint64_t offset;
+	uint32_t name_len;
+	/** Log2 of the first block size. */
+	uint32_t block_shift;
+};
+
+static const char image_magic[8] = "UFSIMG1";
+
+/**
+ * A chunk of memory cut into blocks of one size. Slabs are never freed
+ * until ufs_destroy(), their blocks are recycled through the free lists.
+ */
+struct slab {
+	struct slab *next;
+	/** Pads the header so as the blocks are aligned like malloc() ones. */
+	size_t unused;
+};
+
+/** Free blocks by log2 of their size. */
+static struct block *block_free_lists[MAX_BLOCK_SHIFT + 1];
+/** All the slabs, for ufs_destroy(). */
+static struct slab *slab_list = NULL;
+/** Protects the free lists and the slab list. */
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Full blocks are deduplicated when written, see ufs_set_dedup(). */
+static bool dedup_is_enabled = false;
+/**
+ * Index of the deduplicated blocks by their memory hash. Open addressing
+ * like the file name index. The index doesn't reference the blocks, they
+ * leave it when freed or changed in place.
+ */
+static struct block **dedup_index = NULL;
+static size_t dedup_index_count = 0;
+static size_t dedup_index_capacity = 0;
+/** Duplicate blocks found since the start. */
+static size_t dedup_hit_count = 0;
+/** Protects the dedup index and the flags of the blocks in it. */
+static pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** A decompressed frame of a compressed block, for the reads. */
+struct block_cache_entry {
+	/** The compressed block, NULL if the entry is free. */
+	struct block *block;
+	size_t frame;
+	/** FRAME_SIZE bytes. */
 	char *memory;
-	/** How many bytes are occupied. */
-	int occupied;
-	/** Next block in the file. */
-	struct block *next;
-	/** Previous block in the file. */
-	struct block *prev;
+	/** When the entry was used last, the oldest one is replaced. */
+	uint64_t last_use;
+};
+
+static struct block_cache_entry block_cache[BLOCK_CACHE_SIZE];
+static uint64_t block_cache_clock = 0;
+static pthread_mutex_t block_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Statistics of the compression, changed atomically. */
+static struct ufs_compression_stats compression_stats;
+
+/** Blocks in use and the memory, see ufs_fs_stats. Changed atomically. */
+static struct block_stats {
+	size_t block_count;
+	size_t allocated_bytes;
+	size_t slab_bytes;
+} block_stats;
+
+/**
+ * I/O counters. Each thread adds to its own set, so the threads doing
+ * I/O don't fight for one cache line. Changed atomically, as a set can
+ * be shared when there are more threads.
+ */
+static struct io_stats {
+	size_t read_count;
+	size_t read_bytes;
+	size_t write_count;
+	size_t write_bytes;
+} __attribute__((aligned(64))) io_stats[IO_STATS_SHARD_COUNT];
+
+static __thread struct io_stats *thread_io_stats = NULL;
+static int io_stats_next_shard = 0;
+
+/**
+ * Background thread compressing the cold blocks. A pass over the files
+ * compresses the blocks not accessed since the previous pass, so a block
+ * is compressed after one to two intervals without access.
+ */
+struct compressor {
+	/** Protects the stop flag. */
+	pthread_mutex_t lock;
+	/** Signaled to stop the thread. */
+	pthread_cond_t cond;
+	pthread_t thread;
+	int interval_ms;
+	bool is_stopped;
+};
 
-	/* PUT HERE OTHER MEMBERS */
+/** The compressor, if enabled. Changed under the lock below. */
+static struct compressor *compressor = NULL;
+static pthread_mutex_t compressor_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * An entry of a directory: a file or a subdirectory. It is the first
+ * member of both. Changed only with the directory locked for write.
+ */
+struct dentry {
+	/** Name in the directory, without slashes. */
+	char *name;
+	/** Hash of the name, for the directory index. */
+	uint32_t hash;
+	bool is_dir;
+	/**
+	 * The directory holding the entry. It is valid while the entry is
+	 * linked, and NULL for the root and the snapshot copies.
+	 */
+	struct dir *parent;
 };
 
 struct file {
-	/** Double-linked list of file blocks. */
-	struct block *block_list;
+	struct dentry entry;
+	/** Protects the blocks and the size. */
+	pthread_rwlock_t lock;
 	/**
-	 * Last block in the list above for fast access to the end
-	 * of file.
+	 * Index of the file blocks. The block sizes depend only on their
+	 * numbers, so the block of any position is found in O(1). All the
+	 * blocks but the last one are full. A NULL block is a hole: it
+	 * reads as zeros and takes no memory until written.
+	 */
+	struct block **blocks;
+	size_t block_count;
+	size_t block_capacity;
+	/** Log2 of the first block size. */
+	int block_shift;
+	/**
+	 * References of the directory link, the descriptors and the whole
+	 * FS traversals. The file is freed with the last one. Changed
+	 * atomically.
 	 */
-	struct block *last_block;
-	/** How many file descriptors are opened on the file. */
 	int refs;
-	/** File name. */
-	char *name;
-	/** Files are stored in a double-linked list. */
-	struct file *next;
-	struct file *prev;
 
-	/* PUT HERE OTHER MEMBERS */
+	/** File size in bytes. */
+	size_t size;
+	/**
+	 * The file is deleted and lives only until the last close. Set
+	 * under the log lock.
+	 */
+	bool is_deleted;
+	/**
+	 * Number of ufs_read_map() maps. The blocks can't be freed while
+	 * there are any. Changed atomically under the read lock.
+	 */
+	int map_count;
+	/**
+	 * Shared blocks replaced by their copies on write while the file
+	 * was mapped. The maps can point at them, so they are released
+	 * with the last map.
+	 */
+	struct block **retired;
+	size_t retired_count;
+};
+
+/**
+ * A directory. Each one has its own lock, so opens and creations of files
+ * in different directories don't contend, and opens in one directory run
+ * in parallel.
+ */
+struct dir {
+	struct dentry entry;
+	/** Protects the index. */
+	pthread_rwlock_t lock;
+	/**
+	 * Hash index of the entries by name. Open addressing with linear
+	 * probing, the capacity is a power of 2 and the load factor is at
+	 * most 1/2. Removed entries are removed with backward shifting, so
+	 * there are no tombstones.
+	 */
+	struct dentry **index;
+	size_t index_count;
+	size_t index_capacity;
+};
+
+static struct dir root_dir = {
+	.entry = {.name = "", .is_dir = true},
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+/**
+ * Cache of the directory paths, so an open of a deep path finds its
+ * directory with one probe instead of a lookup per path component. A path
+ * takes the slot of its hash, evicting the previous one. The cache is
+ * flushed when directories are renamed or removed, which is done with the
+ * fs locked for write, while the lookups lock it for read.
+ */
+struct dir_cache_entry {
+	/** The path, NULL if the slot is free. */
+	char *path;
+	size_t path_len;
+	uint32_t hash;
+	struct dir *dir;
 };
 
-/** List of all files. */
-static struct file *file_list = NULL;
+static struct dir_cache_entry dir_cache[DIR_CACHE_SIZE];
+/** The slot i is protected by the lock i % DIR_CACHE_LOCK_COUNT. */
+static pthread_mutex_t dir_cache_locks[DIR_CACHE_LOCK_COUNT] = {
+	[0 ... DIR_CACHE_LOCK_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
 
 struct filedesc {
 	struct file *file;
+	/** The descriptor number, with the generation. */
+	int fd;
 
-	/* PUT HERE OTHER MEMBERS */
+	/** Position of the next read or write. */
+	size_t pos;
+	/** Access rights, a combination of open_flags. */
+	int flags;
 };
 
 /**
  * An array of file descriptors. When a file descriptor is
  * created, its pointer drops here. When a file descriptor is
- * closed, its place in this array is set to NULL and can be
- * taken by next ufs_open() call.
+ * closed, its place in this array is set to NULL and pushed to
+ * the free slot stack, to be taken by the next ufs_open() call.
  */
 static struct filedesc **file_descriptors = NULL;
 static int file_descriptor_count = 0;
 static int file_descriptor_capacity = 0;
+/** Stack of the free slots, the last freed on top. */
+static int *file_descriptor_free = NULL;
+static int file_descriptor_free_count = 0;
+/**
+ * The table is shrunk when the count falls to this. After a failed try
+ * it is halved, so the tries are rare.
+ */
+static int file_descriptor_shrink_count = 0;
+/** Generation of the next descriptor, never 0, so neither is a number. */
+static int file_descriptor_generation = 1;
+/** Protects the descriptor array, not the descriptors. */
+static pthread_rwlock_t file_descriptors_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+ * Changes of the files and the path lookups take it for read. ufs_save(),
+ * ufs_load(), the log switching, the renames and the directory removals
+ * take it for write, so they see no changes in progress, and no lookup
+ * is inside a directory being moved or freed. It is taken before any
+ * other lock.
+ */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+enum wal_record_type {
+	WAL_CREATE = 1,
+	WAL_WRITE,
+	WAL_RESIZE,
+	WAL_DELETE,
+	WAL_CLONE,
+	WAL_MKDIR,
+	WAL_RMDIR,
+	WAL_RENAME,
+};
+
+/**
+ * Log record, followed by the file name and the data of a write. The log
+ * is a sequence of them, a torn or corrupted tail is ignored.
+ */
+struct wal_record {
+	/** Hash of the rest of the record, the name and the data. */
+	uint64_t checksum;
+	uint32_t type;
+	uint32_t name_len;
+	/** Position of a write. */
+	uint64_t offset;
+	/**
+	 * Size of the write data, the new size of a resize, or the size of
+	 * the source name of a clone or the old name of a rename, which
+	 * follows the name.
+	 */
+	uint64_t size;
+};
+
+/**
+ * Write-ahead log of the file changes. The records are collected in a
+ * buffer and written with one fdatasync() for a batch of them: either by
+ * the writer which completes the batch, or by a background thread when
+ * the flush interval is over. While a batch is written, new records go
+ * to another buffer, and the writers completing the next batch wait, so
+ * they are synced together.
+ */
+struct wal {
+	/** Protects everything below, and the file deletion flags. */
+	pthread_mutex_t lock;
+	/** Signaled when a flush ends, and to stop the flusher thread. */
+	pthread_cond_t cond;
+	int fd;
+	/** Path of the image the log belongs to. */
+	char *image_path;
+	/** Records not written yet. */
+	char *buf;
+	size_t buf_size;
+	size_t buf_capacity;
+	/** Buffer being written by a flush. */
+	char *flush_buf;
+	size_t flush_buf_capacity;
+	/** Records in the buffer. */
+	int pending;
+	int batch_size;
+	int flush_interval_ms;
+	bool is_flushing;
+	/** A write or sync failed, the log is not durable anymore. */
+	bool is_broken;
+	bool is_stopped;
+	pthread_t flusher;
+};
+
+/** The log, if enabled. Changed under the fs lock taken for write. */
+static struct wal *wal = NULL;
 
 enum ufs_error_code
 ufs_errno()
@@ -66,61 +467,3215 @@ ufs_errno()
 	return ufs_error_code;
 }
 
-int
-ufs_open(const char *filename, int flags)
+static size_t
+align_up(size_t size, size_t alignment)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	(void)flags;
-	(void)file_list;
-	(void)file_descriptors;
-	(void)file_descriptor_count;
-	(void)file_descriptor_capacity;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	return (size + alignment - 1) & ~(alignment - 1);
 }
 
-ssize_t
-ufs_write(int fd, const char *buf, size_t size)
+/** Count @a count blocks of @a bytes more in use, or less if negative. */
+static void
+block_stats_add(int count, ssize_t bytes)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	__atomic_add_fetch(&block_stats.block_count, count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&block_stats.allocated_bytes, bytes,
+			   __ATOMIC_RELAXED);
 }
 
-ssize_t
-ufs_read(int fd, char *buf, size_t size)
+static void
+io_stats_add(bool is_write, size_t bytes)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	(void)buf;
-	(void)size;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	struct io_stats *stats = thread_io_stats;
+	if (stats == NULL) {
+		int shard = __atomic_fetch_add(&io_stats_next_shard, 1,
+					       __ATOMIC_RELAXED);
+		stats = &io_stats[shard % IO_STATS_SHARD_COUNT];
+		thread_io_stats = stats;
+	}
+	if (is_write) {
+		__atomic_add_fetch(&stats->write_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats->write_bytes, bytes,
+				   __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&stats->read_count, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats->read_bytes, bytes,
+				   __ATOMIC_RELAXED);
+	}
 }
 
-int
-ufs_close(int fd)
+/** Size of a block with its header, aligned for the next header. */
+static size_t
+block_footprint(int shift)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)fd;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	return align_up(sizeof(struct block), BLOCK_ALIGN) +
+	       align_up((size_t)1 << shift, BLOCK_ALIGN);
 }
 
-int
-ufs_delete(const char *filename)
+/** Take a block of 2^@a shift bytes, the memory is dirty. */
+static struct block *
+block_new(int shift)
+{
+	pthread_mutex_lock(&block_lock);
+	struct block *b = block_free_lists[shift];
+	if (b == NULL) {
+		size_t footprint = block_footprint(shift);
+		size_t count = SLAB_SIZE / footprint;
+		if (count == 0)
+			count = 1;
+		struct slab *slab = malloc(sizeof(*slab) + footprint * count);
+		__atomic_add_fetch(&block_stats.slab_bytes,
+				   sizeof(*slab) + footprint * count,
+				   __ATOMIC_RELAXED);
+		slab->next = slab_list;
+		slab_list = slab;
+		char *pos = (char *)(slab + 1);
+		for (size_t i = 0; i < count; ++i, pos += footprint) {
+			b = (struct block *)pos;
+			b->memory = pos + align_up(sizeof(*b), BLOCK_ALIGN);
+			b->image = NULL;
+			b->shift = shift;
+			b->is_indexed = false;
+			b->state = BLOCK_RAW;
+			b->next_free = block_free_lists[shift];
+			block_free_lists[shift] = b;
+		}
+		b = block_free_lists[shift];
+	}
+	block_free_lists[shift] = b->next_free;
+	pthread_mutex_unlock(&block_lock);
+	block_stats_add(1, (size_t)1 << shift);
+	b->refs = 1;
+	b->state = BLOCK_RAW;
+	b->is_hot = true;
+	return b;
+}
+
+static void
+image_unref(struct image *image)
+{
+	if (__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	munmap(image->data, image->size);
+	free(image->blocks);
+	free(image);
+}
+
+/**
+ * Slot of the block with the same size and memory as @a b, or the empty
+ * slot to insert it at.
+ */
+static size_t
+dedup_index_slot(const struct block *b, uint64_t hash)
+{
+	size_t mask = dedup_index_capacity - 1;
+	size_t i = hash & mask;
+	for (struct block *other; (other = dedup_index[i]) != NULL;
+	     i = (i + 1) & mask) {
+		if (other->hash == hash && other->shift == b->shift &&
+		    memcmp(other->memory, b->memory,
+			   (size_t)1 << b->shift) == 0)
+			break;
+	}
+	return i;
+}
+
+static void
+dedup_index_grow(void)
+{
+	struct block **old = dedup_index;
+	size_t old_capacity = dedup_index_capacity;
+	dedup_index_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+	dedup_index = calloc(dedup_index_capacity, sizeof(*dedup_index));
+	size_t mask = dedup_index_capacity - 1;
+	for (size_t i = 0; i < old_capacity; ++i) {
+		struct block *b = old[i];
+		if (b == NULL)
+			continue;
+		/* The blocks in the index are distinct. */
+		size_t j = b->hash & mask;
+		while (dedup_index[j] != NULL)
+			j = (j + 1) & mask;
+		dedup_index[j] = b;
+	}
+	free(old);
+}
+
+/** Remove @a b from the locked index. */
+static void
+dedup_index_remove(struct block *b)
+{
+	size_t mask = dedup_index_capacity - 1;
+	size_t i = b->hash & mask;
+	while (dedup_index[i] != b)
+		i = (i + 1) & mask;
+	dedup_index[i] = NULL;
+	--dedup_index_count;
+	__atomic_store_n(&b->is_indexed, false, __ATOMIC_RELAXED);
+	/* Backward shift, like in the file name index. */
+	for (size_t j = (i + 1) & mask; dedup_index[j] != NULL;
+	     j = (j + 1) & mask) {
+		size_t home = dedup_index[j]->hash & mask;
+		bool is_between = i <= j ? (i < home && home <= j) :
+					   (i < home || home <= j);
+		if (is_between)
+			continue;
+		dedup_index[i] = dedup_index[j];
+		dedup_index[j] = NULL;
+		i = j;
+	}
+}
+
+/** Forget the decompressed copy of @a b, if any. */
+static void
+block_cache_drop(struct block *b)
+{
+	pthread_mutex_lock(&block_cache_lock);
+	for (int i = 0; i < BLOCK_CACHE_SIZE; ++i) {
+		if (block_cache[i].block == b)
+			block_cache[i].block = NULL;
+	}
+	pthread_mutex_unlock(&block_cache_lock);
+}
+
+/** Return a block to its free list. */
+static void
+block_delete(struct block *b)
+{
+	if (b->state == BLOCK_COMPRESSED) {
+		/* The address can be reused by another compressed block. */
+		block_cache_drop(b);
+		__atomic_sub_fetch(&compression_stats.block_count, 1,
+				   __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&compression_stats.raw_bytes,
+				   (size_t)1 << b->shift, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&compression_stats.compressed_bytes,
+				   b->compressed_size, __ATOMIC_RELAXED);
+		block_stats_add(-1, -(ssize_t)b->compressed_size);
+		free(b->memory);
+		free(b);
+		return;
+	}
+	if (__atomic_load_n(&b->is_indexed, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&dedup_lock);
+		dedup_index_remove(b);
+		pthread_mutex_unlock(&dedup_lock);
+	}
+	block_stats_add(-1, -((ssize_t)1 << b->shift));
+	if (b->image != NULL) {
+		image_unref(b->image);
+		return;
+	}
+	pthread_mutex_lock(&block_lock);
+	b->next_free = block_free_lists[b->shift];
+	block_free_lists[b->shift] = b;
+	pthread_mutex_unlock(&block_lock);
+}
+
+static void
+block_ref(struct block *b)
+{
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+}
+
+/** Drop a reference, free the block if it is the last one. */
+static void
+block_unref(struct block *b)
+{
+	if (__atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		block_delete(b);
+}
+
+static void
+block_touch(struct block *b)
+{
+	if (!__atomic_load_n(&b->is_hot, __ATOMIC_RELAXED))
+		__atomic_store_n(&b->is_hot, true, __ATOMIC_RELAXED);
+}
+
+/** Log2 of the size of the compression frames of @a b. */
+static int
+block_frame_shift(const struct block *b)
+{
+	return b->shift < FRAME_SHIFT ? b->shift : FRAME_SHIFT;
+}
+
+/** Size of the scratch buffer of block_compress(). */
+static size_t
+block_compress_scratch_size(void)
+{
+	return sizeof(uint32_t) * (MAX_FRAME_COUNT + 1) +
+	       MAX_FRAME_COUNT * compressBound(FRAME_SIZE);
+}
+
+/**
+ * Compress a raw block into a new one, using @a scratch of
+ * block_compress_scratch_size() bytes. Returns NULL if the block doesn't
+ * shrink by a quarter at least or zlib fails, then it is not tried again
+ * until changed.
+ */
+static struct block *
+block_compress(struct block *b, char *scratch)
+{
+	size_t size = (size_t)1 << b->shift;
+	size_t frame_size = (size_t)1 << block_frame_shift(b);
+	size_t frame_count = size / frame_size;
+	uint32_t offsets[MAX_FRAME_COUNT + 1];
+	size_t pos = sizeof(*offsets) * (frame_count + 1);
+	for (size_t i = 0; i < frame_count; ++i) {
+		offsets[i] = pos;
+		uLongf frame_compressed_size = compressBound(frame_size);
+		if (compress2((Bytef *)scratch + pos, &frame_compressed_size,
+			      (const Bytef *)b->memory + i * frame_size,
+			      frame_size, Z_BEST_SPEED) != Z_OK) {
+			b->state = BLOCK_INCOMPRESSIBLE;
+			return NULL;
+		}
+		pos += frame_compressed_size;
+	}
+	offsets[frame_count] = pos;
+	if (pos > size - size / 4) {
+		b->state = BLOCK_INCOMPRESSIBLE;
+		return NULL;
+	}
+	memcpy(scratch, offsets, sizeof(*offsets) * (frame_count + 1));
+	struct block *c = malloc(sizeof(*c));
+	c->memory = malloc(pos);
+	memcpy(c->memory, scratch, pos);
+	c->image = NULL;
+	c->compressed_size = pos;
+	c->refs = 1;
+	c->shift = b->shift;
+	c->is_indexed = false;
+	c->state = BLOCK_COMPRESSED;
+	c->is_hot = false;
+	__atomic_add_fetch(&compression_stats.block_count, 1,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&compression_stats.raw_bytes, size,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&compression_stats.compressed_bytes, pos,
+			   __ATOMIC_RELAXED);
+	block_stats_add(1, pos);
+	return c;
+}
+
+/** Decompress the frame number @a i of a compressed block into @a memory. */
+static void
+block_decompress_frame(const struct block *b, size_t i, char *memory)
+{
+	uint32_t offsets[2];
+	memcpy(offsets, b->memory + sizeof(*offsets) * i, sizeof(offsets));
+	uLongf size = (size_t)1 << block_frame_shift(b);
+	int rc = uncompress((Bytef *)memory, &size,
+			    (const Bytef *)b->memory + offsets[0],
+			    offsets[1] - offsets[0]);
+	assert(rc == Z_OK && size == (size_t)1 << block_frame_shift(b));
+	(void)rc;
+}
+
+/** Decompress a compressed block into @a memory of the block size. */
+static void
+block_decompress(const struct block *b, char *memory)
+{
+	size_t frame_size = (size_t)1 << block_frame_shift(b);
+	size_t frame_count = ((size_t)1 << b->shift) / frame_size;
+	for (size_t i = 0; i < frame_count; ++i)
+		block_decompress_frame(b, i, memory + i * frame_size);
+}
+
+/**
+ * Give the memory of a big raw block being freed back to the OS. The
+ * pages are zero filled again on first access.
+ */
+static void
+block_release_memory(struct block *b)
+{
+	size_t size = (size_t)1 << b->shift;
+	if (size < MIN_RELEASED_BLOCK_SIZE)
+		return;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t start = align_up((uintptr_t)b->memory, page_size);
+	uintptr_t end = ((uintptr_t)b->memory + size) & ~(page_size - 1);
+	if (start < end)
+		madvise((void *)start, end - start, MADV_DONTNEED);
+}
+
+/** A cache entry with the frame number @a i of @a b, locked. */
+static struct block_cache_entry *
+block_cache_get(struct block *b, size_t i)
+{
+	struct block_cache_entry *entry = NULL;
+	for (int j = 0; j < BLOCK_CACHE_SIZE && entry == NULL; ++j) {
+		if (block_cache[j].block == b && block_cache[j].frame == i)
+			entry = &block_cache[j];
+	}
+	if (entry != NULL) {
+		__atomic_add_fetch(&compression_stats.cache_hit_count, 1,
+				   __ATOMIC_RELAXED);
+	} else {
+		entry = &block_cache[0];
+		for (int j = 1; j < BLOCK_CACHE_SIZE; ++j) {
+			if (block_cache[j].last_use < entry->last_use)
+				entry = &block_cache[j];
+		}
+		if (entry->memory == NULL)
+			entry->memory = malloc(FRAME_SIZE);
+		block_decompress_frame(b, i, entry->memory);
+		entry->block = b;
+		entry->frame = i;
+		__atomic_add_fetch(&compression_stats.cache_miss_count, 1,
+				   __ATOMIC_RELAXED);
+	}
+	entry->last_use = ++block_cache_clock;
+	return entry;
+}
+
+/** Copy @a len bytes of @a b at @a offset into @a buf. */
+static void
+block_read(struct block *b, size_t offset, char *buf, size_t len)
+{
+	block_touch(b);
+	if (b->state != BLOCK_COMPRESSED) {
+		memcpy(buf, b->memory + offset, len);
+		return;
+	}
+	int frame_shift = block_frame_shift(b);
+	size_t frame_size = (size_t)1 << frame_shift;
+	pthread_mutex_lock(&block_cache_lock);
+	while (len > 0) {
+		size_t frame_offset = offset & (frame_size - 1);
+		size_t frame_len = frame_size - frame_offset;
+		if (frame_len > len)
+			frame_len = len;
+		struct block_cache_entry *entry =
+			block_cache_get(b, offset >> frame_shift);
+		memcpy(buf, entry->memory + frame_offset, frame_len);
+		buf += frame_len;
+		offset += frame_len;
+		len -= frame_len;
+	}
+	pthread_mutex_unlock(&block_cache_lock);
+}
+
+static uint32_t
+name_hash(const char *name, size_t len)
+{
+	/* FNV-1a. */
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static const uint64_t XXH_PRIME1 = 11400714785074694791ULL;
+static const uint64_t XXH_PRIME2 = 14029467366897019727ULL;
+static const uint64_t XXH_PRIME3 = 1609587929392839161ULL;
+static const uint64_t XXH_PRIME4 = 9650029242287828579ULL;
+static const uint64_t XXH_PRIME5 = 2870177450012600261ULL;
+
+static uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static uint64_t
+xxh64_merge(uint64_t acc, uint64_t v)
+{
+	return (acc ^ xxh64_round(0, v)) * XXH_PRIME1 + XXH_PRIME4;
+}
+
+/** XXH64 of the data, fast and good enough for checksums. */
+static uint64_t
+hash64(const void *data, size_t size, uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + size;
+	uint64_t h;
+	if (size >= 32) {
+		uint64_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+		uint64_t v2 = seed + XXH_PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXH_PRIME1;
+		for (; end - p >= 32; p += 32) {
+			v1 = xxh64_round(v1, read64(p));
+			v2 = xxh64_round(v2, read64(p + 8));
+			v3 = xxh64_round(v3, read64(p + 16));
+			v4 = xxh64_round(v4, read64(p + 24));
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) +
+		    rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else {
+		h = seed + XXH_PRIME5;
+	}
+	h += size;
+	for (; end - p >= 8; p += 8)
+		h = rotl64(h ^ xxh64_round(0, read64(p)), 27) * XXH_PRIME1 +
+		    XXH_PRIME4;
+	if (end - p >= 4) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		h = rotl64(h ^ (v * XXH_PRIME1), 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+		h = rotl64(h ^ (*p * XXH_PRIME5), 11) * XXH_PRIME1;
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/** Slot which either holds the entry @a name or is the free one for it. */
+static size_t
+dir_index_slot(const struct dir *d, const char *name, size_t len,
+	       uint32_t hash)
+{
+	size_t mask = d->index_capacity - 1;
+	size_t i = hash & mask;
+	for (struct dentry *e; (e = d->index[i]) != NULL;
+	     i = (i + 1) & mask) {
+		if (e->hash == hash && strncmp(e->name, name, len) == 0 &&
+		    e->name[len] == 0)
+			break;
+	}
+	return i;
+}
+
+static void
+dir_index_grow(struct dir *d)
+{
+	struct dentry **old = d->index;
+	size_t old_capacity = d->index_capacity;
+	d->index_capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+	d->index = calloc(d->index_capacity, sizeof(*d->index));
+	for (size_t i = 0; i < old_capacity; ++i) {
+		struct dentry *e = old[i];
+		if (e != NULL)
+			d->index[dir_index_slot(d, e->name, strlen(e->name),
+						e->hash)] = e;
+	}
+	free(old);
+}
+
+/** Entry @a name of @a len bytes in the locked @a d, NULL if none. */
+static struct dentry *
+dir_index_find(const struct dir *d, const char *name, size_t len)
+{
+	if (d->index_count == 0)
+		return NULL;
+	return d->index[dir_index_slot(d, name, len, name_hash(name, len))];
+}
+
+/** Link @a e into the write locked @a d. */
+static void
+dir_link(struct dir *d, struct dentry *e)
+{
+	if ((d->index_count + 1) * 2 > d->index_capacity)
+		dir_index_grow(d);
+	d->index[dir_index_slot(d, e->name, strlen(e->name), e->hash)] = e;
+	++d->index_count;
+	e->parent = d;
+}
+
+/** Unlink @a e from its write locked directory. */
+static void
+dir_unlink(struct dentry *e)
+{
+	struct dir *d = e->parent;
+	struct dentry **index = d->index;
+	size_t mask = d->index_capacity - 1;
+	size_t i = dir_index_slot(d, e->name, strlen(e->name), e->hash);
+	index[i] = NULL;
+	--d->index_count;
+	/*
+	 * Move back the following entries of the probe sequence which can't
+	 * be found anymore through the freed slot.
+	 */
+	for (size_t j = (i + 1) & mask; index[j] != NULL; j = (j + 1) & mask) {
+		size_t home = index[j]->hash & mask;
+		bool is_between = i <= j ? (i < home && home <= j) :
+					   (i < home || home <= j);
+		if (is_between)
+			continue;
+		index[i] = index[j];
+		index[j] = NULL;
+		i = j;
+	}
+}
+
+static void
+dentry_init(struct dentry *e, const char *name, bool is_dir)
+{
+	e->name = strdup(name);
+	e->hash = name_hash(name, strlen(name));
+	e->is_dir = is_dir;
+	e->parent = NULL;
+}
+
+/** Path of a linked entry from the root, with the fs locked. */
+static char *
+dentry_path(const struct dentry *e)
+{
+	size_t len = strlen(e->name);
+	for (const struct dir *d = e->parent; d != &root_dir;
+	     d = d->entry.parent)
+		len += strlen(d->entry.name) + 1;
+	char *path = malloc(len + 1);
+	path[len] = 0;
+	while (true) {
+		size_t name_len = strlen(e->name);
+		len -= name_len;
+		memcpy(path + len, e->name, name_len);
+		if (e->parent == &root_dir)
+			break;
+		path[--len] = '/';
+		e = &e->parent->entry;
+	}
+	return path;
+}
+
+/** Create a directory in the write locked @a parent. */
+static struct dir *
+dir_new(struct dir *parent, const char *name)
+{
+	struct dir *d = calloc(1, sizeof(*d));
+	dentry_init(&d->entry, name, true);
+	pthread_rwlock_init(&d->lock, NULL);
+	dir_link(parent, &d->entry);
+	return d;
+}
+
+/** Free an unlinked empty directory. */
+static void
+dir_delete(struct dir *d)
+{
+	assert(d->index_count == 0);
+	free(d->index);
+	pthread_rwlock_destroy(&d->lock);
+	free(d->entry.name);
+	free(d);
+}
+
+static void
+dir_cache_flush(void)
+{
+	for (int i = 0; i < DIR_CACHE_SIZE; ++i) {
+		free(dir_cache[i].path);
+		dir_cache[i].path = NULL;
+	}
+}
+
+/** Cached directory of the @a path of @a len bytes, NULL if not cached. */
+static struct dir *
+dir_cache_find(const char *path, size_t len, uint32_t hash)
+{
+	size_t i = hash & (DIR_CACHE_SIZE - 1);
+	struct dir_cache_entry *entry = &dir_cache[i];
+	struct dir *d = NULL;
+	pthread_mutex_lock(&dir_cache_locks[i % DIR_CACHE_LOCK_COUNT]);
+	if (entry->path != NULL && entry->hash == hash &&
+	    entry->path_len == len && memcmp(entry->path, path, len) == 0)
+		d = entry->dir;
+	pthread_mutex_unlock(&dir_cache_locks[i % DIR_CACHE_LOCK_COUNT]);
+	return d;
+}
+
+static void
+dir_cache_add(const char *path, size_t len, uint32_t hash, struct dir *d)
+{
+	size_t i = hash & (DIR_CACHE_SIZE - 1);
+	struct dir_cache_entry *entry = &dir_cache[i];
+	char *old = NULL;
+	char *copy = strndup(path, len);
+	pthread_mutex_lock(&dir_cache_locks[i % DIR_CACHE_LOCK_COUNT]);
+	old = entry->path;
+	entry->path = copy;
+	entry->path_len = len;
+	entry->hash = hash;
+	entry->dir = d;
+	pthread_mutex_unlock(&dir_cache_locks[i % DIR_CACHE_LOCK_COUNT]);
+	free(old);
+}
+
+/**
+ * Skip the leading slash of @a path. Returns NULL if the rest has an empty
+ * component, i.e. repeated or trailing slashes. "" is the root.
+ */
+static const char *
+path_normalize(const char *path)
+{
+	if (*path == '/')
+		++path;
+	if (*path == 0)
+		return path;
+	for (const char *p = path;; ++p) {
+		if (*p == '/' || *p == 0)
+			return NULL;
+		while (*p != '/' && *p != 0)
+			++p;
+		if (*p == 0)
+			return path;
+	}
+}
+
+/**
+ * Directory of the first @a len bytes of the normalized @a path, with the
+ * fs locked. NULL if there is none, or a component is a file. The lookup
+ * takes a probe per component, so the result is cached.
+ */
+static struct dir *
+dir_lookup(const char *path, size_t len)
+{
+	if (len == 0)
+		return &root_dir;
+	uint32_t hash = name_hash(path, len);
+	struct dir *d = dir_cache_find(path, len, hash);
+	if (d != NULL)
+		return d;
+	d = &root_dir;
+	const char *end = path + len;
+	for (const char *p = path; d != NULL && p < end;) {
+		const char *next = memchr(p, '/', end - p);
+		if (next == NULL)
+			next = end;
+		pthread_rwlock_rdlock(&d->lock);
+		struct dentry *e = dir_index_find(d, p, next - p);
+		pthread_rwlock_unlock(&d->lock);
+		d = e != NULL && e->is_dir ? (struct dir *)e : NULL;
+		p = next + 1;
+	}
+	if (d != NULL)
+		dir_cache_add(path, len, hash, d);
+	return d;
+}
+
+/**
+ * Find the directory of the normalized non-root @a path, with the fs
+ * locked. @a name is set to the last path component.
+ */
+static struct dir *
+path_parent(const char *path, const char **name)
+{
+	const char *slash = strrchr(path, '/');
+	*name = slash == NULL ? path : slash + 1;
+	return dir_lookup(path, slash == NULL ? 0 : slash - path);
+}
+
+/**
+ * Normalize the entry @a path and find its directory, with the fs locked.
+ * Sets the error code if there is no such directory or the path is bad.
+ */
+static struct dir *
+path_resolve(const char **path, const char **name)
+{
+	*path = path_normalize(*path);
+	if (*path == NULL || **path == 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return NULL;
+	}
+	struct dir *d = path_parent(*path, name);
+	if (d == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return d;
+}
+
+/** Create a file not linked anywhere. */
+static struct file *
+file_alloc(const char *name)
+{
+	struct file *f = calloc(1, sizeof(*f));
+	dentry_init(&f->entry, name, false);
+	pthread_rwlock_init(&f->lock, NULL);
+	f->block_shift = __atomic_load_n(&min_block_shift, __ATOMIC_RELAXED);
+	return f;
+}
+
+/** Create a file in the write locked @a d. */
+static struct file *
+file_new(struct dir *d, const char *name)
+{
+	struct file *f = file_alloc(name);
+	f->refs = 1;
+	dir_link(d, &f->entry);
+	return f;
+}
+
+/** Log2 of the size of the block number @a i. */
+static int
+file_block_shift(const struct file *f, size_t i)
+{
+	if (i < (size_t)(MAX_BLOCK_SHIFT - f->block_shift))
+		return f->block_shift + i;
+	return MAX_BLOCK_SHIFT;
+}
+
+static size_t
+file_block_size(const struct file *f, size_t i)
+{
+	return (size_t)1 << file_block_shift(f, i);
+}
+
+/** Number of the block containing @a pos, and the offset in it. */
+static size_t
+file_block_index(const struct file *f, size_t pos, size_t *offset)
+{
+	size_t min_size = (size_t)1 << f->block_shift;
+	/* Where the first block of the max size starts. */
+	size_t geometric_end = MAX_BLOCK_SIZE - min_size;
+	if (pos >= geometric_end) {
+		pos -= geometric_end;
+		*offset = pos % MAX_BLOCK_SIZE;
+		return MAX_BLOCK_SHIFT - f->block_shift + pos / MAX_BLOCK_SIZE;
+	}
+	/* Block i starts at min_size * (2^i - 1). */
+	unsigned long long n = (pos >> f->block_shift) + 1;
+	size_t i = sizeof(n) * 8 - 1 - __builtin_clzll(n);
+	*offset = pos - (min_size << i) + min_size;
+	return i;
+}
+
+/** How many blocks hold @a size bytes. */
+static size_t
+file_block_count(const struct file *f, size_t size)
+{
+	size_t offset;
+	return size == 0 ? 0 : file_block_index(f, size - 1, &offset) + 1;
+}
+
+/** How many blocks are full in a file of @a size bytes. */
+static size_t
+file_full_block_count(const struct file *f, size_t size)
+{
+	size_t count = file_block_count(f, size);
+	if (count == 0)
+		return 0;
+	size_t offset;
+	file_block_index(f, size - 1, &offset);
+	return offset + 1 == file_block_size(f, count - 1) ? count : count - 1;
+}
+
+/** Drop the blocks after the first @a new_size bytes. */
+static void
+file_truncate(struct file *f, size_t new_size)
+{
+	size_t count = file_block_count(f, new_size);
+	for (size_t i = count; i < f->block_count; ++i) {
+		if (f->blocks[i] != NULL)
+			block_unref(f->blocks[i]);
+	}
+	f->block_count = count;
+	f->size = new_size;
+	if (count == 0) {
+		free(f->blocks);
+		f->blocks = NULL;
+		f->block_capacity = 0;
+	}
+}
+
+/** Release the retired blocks, when the file is not mapped. */
+static void
+file_release_retired(struct file *f)
+{
+	for (size_t i = 0; i < f->retired_count; ++i)
+		block_unref(f->retired[i]);
+	free(f->retired);
+	f->retired = NULL;
+	f->retired_count = 0;
+}
+
+static void
+file_delete(struct file *f)
+{
+	file_truncate(f, 0);
+	file_release_retired(f);
+	pthread_rwlock_destroy(&f->lock);
+	free(f->entry.name);
+	free(f);
+}
+
+/**
+ * Unlink the file from its write locked directory. It lives until the
+ * last close: the caller drops the link reference with file_unref() after
+ * unlocking the directory.
+ */
+static void
+file_unlink(struct file *f)
+{
+	dir_unlink(&f->entry);
+	f->is_deleted = true;
+}
+
+static void
+file_ref(struct file *f)
+{
+	__atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+}
+
+/** Drop a reference, free the file if it is the last one. */
+static void
+file_unref(struct file *f)
+{
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		file_delete(f);
+}
+
+/**
+ * Put @a b instead of the block number @a i of the write locked @a f. The
+ * old block is kept while the file is mapped, as the maps can point at it.
+ */
+static void
+file_block_replace(struct file *f, size_t i, struct block *b)
+{
+	struct block *old = f->blocks[i];
+	f->blocks[i] = b;
+	if (__atomic_load_n(&f->map_count, __ATOMIC_RELAXED) > 0) {
+		f->retired = realloc(f->retired, sizeof(*f->retired) *
+				     (f->retired_count + 1));
+		f->retired[f->retired_count++] = old;
+	} else {
+		block_unref(old);
+	}
+}
+
+/**
+ * The block number @a i of the write locked @a f, to be changed. A shared
+ * block is replaced by a copy first. Only the holders of a block can share
+ * it further, so a block with one reference stays private to the file.
+ */
+static struct block *
+file_block_writable(struct file *f, size_t i)
+{
+	struct block *b = f->blocks[i];
+	if (b->state == BLOCK_COMPRESSED) {
+		struct block *raw = block_new(b->shift);
+		block_decompress(b, raw->memory);
+		file_block_replace(f, i, raw);
+		return raw;
+	}
+	bool is_private;
+	if (__atomic_load_n(&b->is_indexed, __ATOMIC_RELAXED)) {
+		/*
+		 * A private block leaves the dedup index before the change,
+		 * under its lock, so as nobody finds and shares it meanwhile.
+		 */
+		pthread_mutex_lock(&dedup_lock);
+		is_private = __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1;
+		if (is_private && b->is_indexed)
+			dedup_index_remove(b);
+		pthread_mutex_unlock(&dedup_lock);
+	} else {
+		is_private = __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) == 1;
+	}
+	if (is_private) {
+		b->state = BLOCK_RAW;
+		block_touch(b);
+		return b;
+	}
+	struct block *copy = block_new(b->shift);
+	memcpy(copy->memory, b->memory, (size_t)1 << b->shift);
+	file_block_replace(f, i, copy);
+	return copy;
+}
+
+/**
+ * Look up the block number @a i of the write locked @a f in the dedup
+ * index. The file takes the found twin, or the block is added to the
+ * index. The block is full and private to the file.
+ */
+static void
+file_block_dedup(struct file *f, size_t i)
+{
+	struct block *b = f->blocks[i];
+	uint64_t hash = hash64(b->memory, (size_t)1 << b->shift, b->shift);
+	pthread_mutex_lock(&dedup_lock);
+	if ((dedup_index_count + 1) * 2 > dedup_index_capacity)
+		dedup_index_grow();
+	size_t slot = dedup_index_slot(b, hash);
+	struct block *twin = dedup_index[slot];
+	if (twin == NULL) {
+		b->hash = hash;
+		__atomic_store_n(&b->is_indexed, true, __ATOMIC_RELAXED);
+		dedup_index[slot] = b;
+		++dedup_index_count;
+		pthread_mutex_unlock(&dedup_lock);
+		return;
+	}
+	/* The twin can be being freed already, then it is skipped. */
+	int refs = __atomic_load_n(&twin->refs, __ATOMIC_RELAXED);
+	while (refs > 0 &&
+	       !__atomic_compare_exchange_n(&twin->refs, &refs, refs + 1,
+					    false, __ATOMIC_ACQUIRE,
+					    __ATOMIC_RELAXED)) {
+	}
+	if (refs > 0)
+		++dedup_hit_count;
+	pthread_mutex_unlock(&dedup_lock);
+	if (refs > 0)
+		file_block_replace(f, i, twin);
+}
+
+/** Share the blocks of @a src with the empty @a dst, both locked. */
+static void
+file_share_blocks(struct file *dst, struct file *src)
+{
+	dst->block_shift = src->block_shift;
+	dst->size = src->size;
+	dst->block_count = src->block_count;
+	dst->block_capacity = src->block_count;
+	if (src->block_count == 0)
+		return;
+	dst->blocks = malloc(sizeof(*dst->blocks) * src->block_count);
+	for (size_t i = 0; i < src->block_count; ++i) {
+		if (src->blocks[i] != NULL)
+			block_ref(src->blocks[i]);
+		dst->blocks[i] = src->blocks[i];
+	}
+}
+
+/** Index the blocks to hold @a new_size bytes, the new ones are holes. */
+static void
+file_reserve(struct file *f, size_t new_size)
+{
+	size_t count = file_block_count(f, new_size);
+	if (count <= f->block_count)
+		return;
+	if (count > f->block_capacity) {
+		size_t capacity = f->block_capacity == 0 ? 8 :
+				  f->block_capacity * 2;
+		while (capacity < count)
+			capacity *= 2;
+		f->blocks = realloc(f->blocks, sizeof(*f->blocks) * capacity);
+		f->block_capacity = capacity;
+	}
+	for (size_t i = f->block_count; i < count; ++i)
+		f->blocks[i] = NULL;
+	f->block_count = count;
+}
+
+/** Grow the file with zeros up to @a new_size bytes. */
+static void
+file_extend(struct file *f, size_t new_size)
+{
+	if (new_size <= f->size)
+		return;
+	file_reserve(f, new_size);
+	/*
+	 * The new blocks are holes. Only the tail of the last block can
+	 * hold garbage left after a truncation, so it is zeroed.
+	 */
+	size_t offset;
+	size_t i = file_block_index(f, f->size, &offset);
+	if (f->blocks[i] != NULL) {
+		size_t len = file_block_size(f, i) - offset;
+		if (len > new_size - f->size)
+			len = new_size - f->size;
+		memset(file_block_writable(f, i)->memory + offset, 0, len);
+		if (offset + len == file_block_size(f, i) &&
+		    __atomic_load_n(&dedup_is_enabled, __ATOMIC_RELAXED))
+			file_block_dedup(f, i);
+	}
+	f->size = new_size;
+}
+
+/**
+ * Allocate the hole number @a i starting at @a block_pos, for a write of
+ * @a len bytes at @a offset in it. The rest of it within the file is
+ * zeroed, past the file end it is zeroed by file_extend().
+ */
+static struct block *
+file_hole_fill(struct file *f, size_t i, size_t block_pos, size_t offset,
+	       size_t len)
+{
+	struct block *b = block_new(file_block_shift(f, i));
+	memset(b->memory, 0, offset);
+	size_t end = f->size > block_pos ? f->size - block_pos : 0;
+	if (end > file_block_size(f, i))
+		end = file_block_size(f, i);
+	if (end > offset + len)
+		memset(b->memory + offset + len, 0, end - offset - len);
+	f->blocks[i] = b;
+	return b;
+}
+
+/** Write @a size bytes at @a pos. A gap after the file end is a hole. */
+static void
+file_write_at(struct file *f, const char *buf, size_t size, size_t pos)
+{
+	file_extend(f, pos);
+	file_reserve(f, pos + size);
+	size_t offset;
+	size_t i = file_block_index(f, pos, &offset);
+	for (size_t done = 0; done < size; ++i, offset = 0) {
+		size_t len = file_block_size(f, i) - offset;
+		if (len > size - done)
+			len = size - done;
+		struct block *b = f->blocks[i] != NULL ?
+			file_block_writable(f, i) :
+			file_hole_fill(f, i, pos + done - offset, offset, len);
+		memcpy(b->memory + offset, buf + done, len);
+		/* A block is deduplicated when a write fills it up. */
+		if (offset + len == file_block_size(f, i) &&
+		    __atomic_load_n(&dedup_is_enabled, __ATOMIC_RELAXED))
+			file_block_dedup(f, i);
+		done += len;
+	}
+	if (pos + size > f->size)
+		f->size = pos + size;
+}
+
+/** Numbers of the first and the last blocks of a range, false if empty. */
+static bool
+file_range_blocks(struct file *f, size_t pos, size_t size, size_t *first,
+		  size_t *last)
+{
+	if (pos >= f->size || size == 0)
+		return false;
+	if (size > f->size - pos)
+		size = f->size - pos;
+	size_t offset;
+	*first = file_block_index(f, pos, &offset);
+	*last = file_block_index(f, pos + size - 1, &offset);
+	return true;
+}
+
+static bool
+file_range_is_compressed(struct file *f, size_t pos, size_t size)
+{
+	size_t first, last;
+	if (!file_range_blocks(f, pos, size, &first, &last))
+		return false;
+	for (size_t i = first; i <= last; ++i) {
+		if (f->blocks[i] != NULL &&
+		    f->blocks[i]->state == BLOCK_COMPRESSED)
+			return true;
+	}
+	return false;
+}
+
+/** Replace the compressed blocks of a range with raw ones. */
+static void
+file_range_decompress(struct file *f, size_t pos, size_t size)
+{
+	size_t first, last;
+	if (!file_range_blocks(f, pos, size, &first, &last))
+		return;
+	for (size_t i = first; i <= last; ++i) {
+		if (f->blocks[i] != NULL &&
+		    f->blocks[i]->state == BLOCK_COMPRESSED)
+			file_block_writable(f, i);
+	}
+}
+
+/**
+ * Compress the cold blocks of the write locked @a f, and make the others
+ * cold for the next pass. Only the raw blocks private to the file are
+ * compressed: the images are in the page cache anyway, and the dedup
+ * index compares the raw memory.
+ */
+static void
+file_compress_cold(struct file *f, char *scratch)
+{
+	/* The maps point at the raw memory. */
+	if (__atomic_load_n(&f->map_count, __ATOMIC_RELAXED) > 0)
+		return;
+	for (size_t i = 0; i < f->block_count; ++i) {
+		struct block *b = f->blocks[i];
+		if (b == NULL ||
+		    __atomic_exchange_n(&b->is_hot, false, __ATOMIC_RELAXED) ||
+		    b->state != BLOCK_RAW || b->image != NULL ||
+		    __atomic_load_n(&b->refs, __ATOMIC_ACQUIRE) != 1 ||
+		    __atomic_load_n(&b->is_indexed, __ATOMIC_RELAXED))
+			continue;
+		struct block *compressed = block_compress(b, scratch);
+		if (compressed == NULL)
+			continue;
+		block_release_memory(b);
+		file_block_replace(f, i, compressed);
+	}
+}
+
+/** Read up to @a size bytes at @a pos. Returns how many were read. */
+static size_t
+file_read_at(struct file *f, char *buf, size_t size, size_t pos)
+{
+	if (pos >= f->size)
+		return 0;
+	if (size > f->size - pos)
+		size = f->size - pos;
+	size_t offset;
+	size_t i = file_block_index(f, pos, &offset);
+	for (size_t done = 0; done < size; ++i, offset = 0) {
+		size_t len = file_block_size(f, i) - offset;
+		if (len > size - done)
+			len = size - done;
+		if (f->blocks[i] == NULL)
+			memset(buf + done, 0, len);
+		else
+			block_read(f->blocks[i], offset, buf + done, len);
+		done += len;
+	}
+	return size;
+}
+
+/** @a path with @a suffix appended, to be freed. */
+static char *
+path_with_suffix(const char *path, const char *suffix)
+{
+	size_t path_len = strlen(path);
+	size_t suffix_len = strlen(suffix);
+	char *res = malloc(path_len + suffix_len + 1);
+	memcpy(res, path, path_len);
+	memcpy(res + path_len, suffix, suffix_len + 1);
+	return res;
+}
+
+static bool
+write_all(int fd, const char *data, size_t size)
+{
+	while (size > 0) {
+		ssize_t rc = write(fd, data, size);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+/** Lock the log, if any, to append records. */
+static void
+wal_lock(void)
+{
+	if (wal != NULL)
+		pthread_mutex_lock(&wal->lock);
+}
+
+static void
+wal_unlock(void)
+{
+	if (wal != NULL)
+		pthread_mutex_unlock(&wal->lock);
+}
+
+/** Append a record to the locked log, if any. */
+static void
+wal_append(enum wal_record_type type, const char *name, size_t offset,
+	   size_t size, const char *data)
+{
+	if (wal == NULL || wal->is_broken)
+		return;
+	struct wal_record record = {
+		.type = type,
+		.name_len = strlen(name),
+		.offset = offset,
+		.size = size,
+	};
+	size_t data_size = type == WAL_WRITE || type == WAL_CLONE ||
+			   type == WAL_RENAME ? size : 0;
+	size_t total = sizeof(record) + record.name_len + data_size;
+	if (wal->buf_size + total > wal->buf_capacity) {
+		wal->buf_capacity = wal->buf_capacity * 2 + total;
+		wal->buf = realloc(wal->buf, wal->buf_capacity);
+	}
+	char *pos = wal->buf + wal->buf_size;
+	memcpy(pos + sizeof(record), name, record.name_len);
+	if (data_size > 0)
+		memcpy(pos + sizeof(record) + record.name_len, data, data_size);
+	uint64_t hash = hash64(pos + sizeof(record),
+			       record.name_len + data_size, 0);
+	record.checksum = hash64((char *)&record + sizeof(record.checksum),
+				 sizeof(record) - sizeof(record.checksum),
+				 hash);
+	memcpy(pos, &record, sizeof(record));
+	wal->buf_size += total;
+	++wal->pending;
+}
+
+/** Log a change of @a f, unless it is deleted and so is not durable. */
+static void
+wal_log_file(struct file *f, enum wal_record_type type, size_t offset,
+	     size_t size, const char *data)
+{
+	if (wal == NULL)
+		return;
+	pthread_mutex_lock(&wal->lock);
+	if (!f->is_deleted) {
+		char *path = dentry_path(&f->entry);
+		wal_append(type, path, offset, size, data);
+		free(path);
+	}
+	pthread_mutex_unlock(&wal->lock);
+}
+
+/**
+ * Write and sync the buffered records. Called and returns with the log
+ * locked, but unlocks it for the I/O.
+ */
+static void
+wal_flush(struct wal *w)
+{
+	while (w->is_flushing)
+		pthread_cond_wait(&w->cond, &w->lock);
+	if (w->buf_size == 0)
+		return;
+	char *data = w->buf;
+	size_t size = w->buf_size;
+	size_t capacity = w->buf_capacity;
+	w->buf = w->flush_buf;
+	w->buf_capacity = w->flush_buf_capacity;
+	w->buf_size = 0;
+	w->flush_buf = data;
+	w->flush_buf_capacity = capacity;
+	w->pending = 0;
+	w->is_flushing = true;
+	pthread_mutex_unlock(&w->lock);
+	bool ok = write_all(w->fd, data, size) && fdatasync(w->fd) == 0;
+	pthread_mutex_lock(&w->lock);
+	w->is_flushing = false;
+	if (!ok)
+		w->is_broken = true;
+	pthread_cond_broadcast(&w->cond);
+}
+
+/** Flush the log if a batch is complete. Called after each change. */
+static void
+wal_commit(void)
+{
+	if (wal == NULL)
+		return;
+	pthread_mutex_lock(&wal->lock);
+	if (wal->pending >= wal->batch_size)
+		wal_flush(wal);
+	pthread_mutex_unlock(&wal->lock);
+}
+
+/** Flush the log each flush interval. */
+static void *
+wal_flusher_f(void *arg)
+{
+	struct wal *w = arg;
+	pthread_mutex_lock(&w->lock);
+	while (!w->is_stopped) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		long nsec = deadline.tv_nsec +
+			    (w->flush_interval_ms % 1000) * 1000000L;
+		deadline.tv_sec += w->flush_interval_ms / 1000 +
+				   nsec / 1000000000L;
+		deadline.tv_nsec = nsec % 1000000000L;
+		while (!w->is_stopped &&
+		       pthread_cond_timedwait(&w->cond, &w->lock,
+					      &deadline) != ETIMEDOUT) {
+		}
+		wal_flush(w);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/** Start a change of @a f: lock the FS for read and the file for write. */
+static void
+file_change_begin(struct file *f)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	pthread_rwlock_wrlock(&f->lock);
+}
+
+static void
+file_change_end(struct file *f)
+{
+	pthread_rwlock_unlock(&f->lock);
+	wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+}
+
+/** Drop the log records, they are in the image now. */
+static void
+wal_reset(struct wal *w)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->is_flushing)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->buf_size = 0;
+	w->pending = 0;
+	if (ftruncate(w->fd, 0) != 0)
+		w->is_broken = true;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Descriptor @a fd. Descriptors are not refcounted: closing one while
+ * another thread uses it is not allowed, like with the OS descriptors.
+ */
+static struct filedesc *
+filedesc_get(int fd)
+{
+	int slot = fd & (MAX_FD_COUNT - 1);
+	pthread_rwlock_rdlock(&file_descriptors_lock);
+	struct filedesc *desc = NULL;
+	if (fd >= 0 && slot < file_descriptor_capacity)
+		desc = file_descriptors[slot];
+	if (desc != NULL && desc->fd != fd)
+		desc = NULL;
+	pthread_rwlock_unlock(&file_descriptors_lock);
+	if (desc == NULL)
+		ufs_error_code = UFS_ERR_NO_FILE;
+	return desc;
+}
+
+/**
+ * Resize the descriptor table to @a capacity slots, with the table locked.
+ * The slots cut off are free. The free slot stack is rebuilt, the low
+ * slots on top.
+ */
+static void
+filedesc_table_resize(int capacity)
+{
+	file_descriptors = realloc(file_descriptors,
+				   sizeof(*file_descriptors) * capacity);
+	file_descriptor_free = realloc(file_descriptor_free,
+				       sizeof(*file_descriptor_free) *
+				       capacity);
+	for (int slot = file_descriptor_capacity; slot < capacity; ++slot)
+		file_descriptors[slot] = NULL;
+	file_descriptor_capacity = capacity;
+	file_descriptor_free_count = 0;
+	for (int slot = capacity - 1; slot >= 0; --slot) {
+		if (file_descriptors[slot] == NULL)
+			file_descriptor_free[file_descriptor_free_count++] = slot;
+	}
+	file_descriptor_shrink_count = capacity / 4;
+}
+
+/**
+ * Shrink the sparse descriptor table, with the table locked. Only the free
+ * slots at the end can be cut, the numbers of the open descriptors stay.
+ */
+static void
+filedesc_table_shrink(void)
+{
+	int top = file_descriptor_capacity - 1;
+	while (top >= 0 && file_descriptors[top] == NULL)
+		--top;
+	int capacity = file_descriptor_capacity;
+	while (capacity / 2 > top && capacity / 2 >= MIN_FD_CAPACITY &&
+	       capacity / 2 >= file_descriptor_count * 2)
+		capacity /= 2;
+	if (capacity < file_descriptor_capacity)
+		filedesc_table_resize(capacity);
+	else
+		file_descriptor_shrink_count = file_descriptor_count / 2;
+}
+
+/**
+ * Position of the descriptor, under the file lock. The file could be
+ * shrunk by another descriptor, then the position is moved to the end.
+ */
+static size_t
+filedesc_pos(struct filedesc *desc)
+{
+	if (desc->pos > desc->file->size)
+		desc->pos = desc->file->size;
+	return desc->pos;
+}
+
+int
+ufs_open(const char *filename, int flags)
+{
+	bool is_create = (flags & UFS_CREATE) != 0;
+	pthread_rwlock_rdlock(&fs_lock);
+	const char *name;
+	struct dir *d = path_resolve(&filename, &name);
+	if (d == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+	if (is_create)
+		pthread_rwlock_wrlock(&d->lock);
+	else
+		pthread_rwlock_rdlock(&d->lock);
+	struct dentry *e = dir_index_find(d, name, strlen(name));
+	if (e == NULL && is_create) {
+		e = &file_new(d, name)->entry;
+		wal_lock();
+		wal_append(WAL_CREATE, filename, 0, 0, NULL);
+		wal_unlock();
+	}
+	if (e == NULL || e->is_dir) {
+		pthread_rwlock_unlock(&d->lock);
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = e == NULL ? UFS_ERR_NO_FILE :
+					     UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = (struct file *)e;
+	file_ref(f);
+	pthread_rwlock_unlock(&d->lock);
+	if (is_create)
+		wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+
+	struct filedesc *desc = malloc(sizeof(*desc));
+	desc->file = f;
+	desc->pos = 0;
+	desc->flags = flags & (UFS_READ_ONLY | UFS_WRITE_ONLY | UFS_READ_WRITE);
+	if (desc->flags == 0)
+		desc->flags = UFS_READ_WRITE;
+
+	pthread_rwlock_wrlock(&file_descriptors_lock);
+	if (file_descriptor_free_count == 0) {
+		if (file_descriptor_capacity == MAX_FD_COUNT) {
+			pthread_rwlock_unlock(&file_descriptors_lock);
+			file_unref(f);
+			free(desc);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		filedesc_table_resize(file_descriptor_capacity == 0 ?
+				      MIN_FD_CAPACITY :
+				      file_descriptor_capacity * 2);
+	}
+	int slot = file_descriptor_free[--file_descriptor_free_count];
+	desc->fd = file_descriptor_generation << FD_SLOT_BITS | slot;
+	if (++file_descriptor_generation == FD_GENERATION_COUNT)
+		file_descriptor_generation = 1;
+	file_descriptors[slot] = desc;
+	++file_descriptor_count;
+	pthread_rwlock_unlock(&file_descriptors_lock);
+	return desc->fd;
+}
+
+/** Descriptor @a fd if it allows to write, NULL otherwise. */
+static struct filedesc *
+filedesc_get_writable(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return NULL;
+	if ((desc->flags & (UFS_WRITE_ONLY | UFS_READ_WRITE)) == 0) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return desc;
+}
+
+/** Descriptor @a fd if it allows to read, NULL otherwise. */
+static struct filedesc *
+filedesc_get_readable(int fd)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return NULL;
+	if ((desc->flags & (UFS_READ_ONLY | UFS_READ_WRITE)) == 0) {
+		ufs_error_code = UFS_ERR_NO_PERMISSION;
+		return NULL;
+	}
+	return desc;
+}
+
+ssize_t
+ufs_write(int fd, const char *buf, size_t size)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	file_change_begin(f);
+	size_t pos = filedesc_pos(desc);
+	if (size > MAX_FILE_SIZE - pos) {
+		file_change_end(f);
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	file_write_at(f, buf, size, pos);
+	wal_log_file(f, WAL_WRITE, pos, size, buf);
+	desc->pos = pos + size;
+	file_change_end(f);
+	io_stats_add(true, size);
+	return size;
+}
+
+ssize_t
+ufs_read(int fd, char *buf, size_t size)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t pos = filedesc_pos(desc);
+	size = file_read_at(f, buf, size, pos);
+	desc->pos = pos + size;
+	pthread_rwlock_unlock(&f->lock);
+	io_stats_add(false, size);
+	return size;
+}
+
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	if (offset > MAX_FILE_SIZE || size > MAX_FILE_SIZE - offset) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *f = desc->file;
+	file_change_begin(f);
+	file_write_at(f, buf, size, offset);
+	wal_log_file(f, WAL_WRITE, offset, size, buf);
+	file_change_end(f);
+	io_stats_add(true, size);
+	return size;
+}
+
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size = file_read_at(f, buf, size, offset);
+	pthread_rwlock_unlock(&f->lock);
+	io_stats_add(false, size);
+	return size;
+}
+
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = desc->file;
+	file_change_begin(f);
+	size_t pos = filedesc_pos(desc);
+	size_t size = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (iov[i].iov_len > MAX_FILE_SIZE - pos - size) {
+			file_change_end(f);
+			ufs_error_code = UFS_ERR_NO_MEM;
+			return -1;
+		}
+		size += iov[i].iov_len;
+	}
+	for (int i = 0; i < iovcnt; ++i) {
+		file_write_at(f, iov[i].iov_base, iov[i].iov_len, pos);
+		wal_log_file(f, WAL_WRITE, pos, iov[i].iov_len,
+			     iov[i].iov_base);
+		pos += iov[i].iov_len;
+	}
+	desc->pos = pos;
+	file_change_end(f);
+	io_stats_add(true, size);
+	return size;
+}
+
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	if (iovcnt < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t start = filedesc_pos(desc);
+	size_t pos = start;
+	for (int i = 0; i < iovcnt && pos < f->size; ++i)
+		pos += file_read_at(f, iov[i].iov_base, iov[i].iov_len, pos);
+	desc->pos = pos;
+	pthread_rwlock_unlock(&f->lock);
+	io_stats_add(false, pos - start);
+	return pos - start;
+}
+
+ssize_t
+ufs_read_map(int fd, size_t offset, size_t size, struct ufs_map *map)
+{
+	struct filedesc *desc = filedesc_get_readable(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	/* The map keeps the file alive like a descriptor. */
+	file_ref(f);
+	pthread_rwlock_rdlock(&f->lock);
+	bool is_compressed = file_range_is_compressed(f, offset, size);
+	if (is_compressed) {
+		/* The map points at the raw memory, the range is decompressed. */
+		pthread_rwlock_unlock(&f->lock);
+		file_change_begin(f);
+		file_range_decompress(f, offset, size);
+	}
+	if (offset >= f->size)
+		size = 0;
+	else if (size > f->size - offset)
+		size = f->size - offset;
+	map->iov = NULL;
+	map->iovcnt = 0;
+	map->file = f;
+	if (size > 0) {
+		size_t offset_in_block;
+		size_t first = file_block_index(f, offset, &offset_in_block);
+		size_t last_offset;
+		size_t last = file_block_index(f, offset + size - 1,
+					       &last_offset);
+		map->iovcnt = last - first + 1;
+		map->iov = malloc(sizeof(*map->iov) * map->iovcnt);
+		size_t done = 0;
+		for (size_t i = first; i <= last; ++i, offset_in_block = 0) {
+			size_t len = file_block_size(f, i) - offset_in_block;
+			if (len > size - done)
+				len = size - done;
+			struct iovec *v = &map->iov[i - first];
+			struct block *b = f->blocks[i];
+			v->iov_base = (b != NULL ? b->memory : zero_block) +
+				      offset_in_block;
+			v->iov_len = len;
+			done += len;
+		}
+	}
+	__atomic_add_fetch(&f->map_count, 1, __ATOMIC_RELAXED);
+	if (is_compressed)
+		file_change_end(f);
+	else
+		pthread_rwlock_unlock(&f->lock);
+	io_stats_add(false, size);
+	return size;
+}
+
+void
+ufs_read_unmap(struct ufs_map *map)
+{
+	struct file *f = map->file;
+	if (__atomic_sub_fetch(&f->map_count, 1, __ATOMIC_RELAXED) == 0) {
+		pthread_rwlock_wrlock(&f->lock);
+		if (__atomic_load_n(&f->map_count, __ATOMIC_RELAXED) == 0)
+			file_release_retired(f);
+		pthread_rwlock_unlock(&f->lock);
+	}
+	file_unref(f);
+	free(map->iov);
+	map->iov = NULL;
+	map->iovcnt = 0;
+	map->file = NULL;
+}
+
+off_t
+ufs_seek(int fd, off_t offset, int whence)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	off_t size = f->size;
+	off_t base;
+	switch (whence) {
+	case UFS_SEEK_SET:
+		base = 0;
+		break;
+	case UFS_SEEK_CUR:
+		base = filedesc_pos(desc);
+		break;
+	case UFS_SEEK_END:
+		base = size;
+		break;
+	default:
+		pthread_rwlock_unlock(&f->lock);
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_rwlock_unlock(&f->lock);
+	if (offset < -base || offset > size - base) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	desc->pos = base + offset;
+	return desc->pos;
+}
+
+/**
+ * The first position at or after @a pos which is in data if @a is_data,
+ * or in a hole otherwise. The file size if there is none.
+ */
+static size_t
+file_find_extent(struct file *f, size_t pos, bool is_data)
+{
+	if (pos >= f->size)
+		return f->size;
+	size_t offset;
+	size_t i = file_block_index(f, pos, &offset);
+	for (; pos < f->size; ++i, offset = 0) {
+		if ((f->blocks[i] != NULL) == is_data)
+			return pos;
+		pos += file_block_size(f, i) - offset;
+	}
+	return f->size;
+}
+
+static off_t
+file_seek_extent(int fd, off_t offset, bool is_data)
+{
+	struct filedesc *desc = filedesc_get(fd);
+	if (desc == NULL)
+		return -1;
+	if (offset < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = desc->file;
+	pthread_rwlock_rdlock(&f->lock);
+	size_t pos = file_find_extent(f, offset, is_data);
+	pthread_rwlock_unlock(&f->lock);
+	return pos;
+}
+
+off_t
+ufs_seek_data(int fd, off_t offset)
+{
+	return file_seek_extent(fd, offset, true);
+}
+
+off_t
+ufs_seek_hole(int fd, off_t offset)
+{
+	return file_seek_extent(fd, offset, false);
+}
+
+int
+ufs_close(int fd)
+{
+	int slot = fd & (MAX_FD_COUNT - 1);
+	pthread_rwlock_wrlock(&file_descriptors_lock);
+	struct filedesc *desc = NULL;
+	if (fd >= 0 && slot < file_descriptor_capacity)
+		desc = file_descriptors[slot];
+	if (desc != NULL && desc->fd == fd) {
+		file_descriptors[slot] = NULL;
+		file_descriptor_free[file_descriptor_free_count++] = slot;
+		if (--file_descriptor_count <= file_descriptor_shrink_count &&
+		    file_descriptor_capacity > MIN_FD_CAPACITY)
+			filedesc_table_shrink();
+	} else {
+		desc = NULL;
+	}
+	pthread_rwlock_unlock(&file_descriptors_lock);
+	if (desc == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	file_unref(desc->file);
+	free(desc);
+	return 0;
+}
+
+int
+ufs_delete(const char *filename)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	const char *name;
+	struct dir *d = path_resolve(&filename, &name);
+	if (d == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&d->lock);
+	struct dentry *e = dir_index_find(d, name, strlen(name));
+	if (e == NULL || e->is_dir) {
+		pthread_rwlock_unlock(&d->lock);
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = e == NULL ? UFS_ERR_NO_FILE :
+					     UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *f = (struct file *)e;
+	/*
+	 * The deletion flag is set under the log lock, so writes into the
+	 * file can't be logged after its deletion.
+	 */
+	wal_lock();
+	wal_append(WAL_DELETE, filename, 0, 0, NULL);
+	file_unlink(f);
+	wal_unlock();
+	pthread_rwlock_unlock(&d->lock);
+	file_unref(f);
+	wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+	return 0;
+}
+
+/**
+ * Make @a dst_name a copy of @a src_name sharing its blocks, with the fs
+ * locked. An old file @a dst_name is replaced, like by a deletion.
+ */
+static int
+file_clone(const char *src_name, const char *dst_name)
+{
+	const char *name;
+	struct dir *src_dir = path_resolve(&src_name, &name);
+	if (src_dir == NULL)
+		return -1;
+	pthread_rwlock_rdlock(&src_dir->lock);
+	struct dentry *e = dir_index_find(src_dir, name, strlen(name));
+	if (e == NULL || e->is_dir) {
+		pthread_rwlock_unlock(&src_dir->lock);
+		ufs_error_code = e == NULL ? UFS_ERR_NO_FILE :
+					     UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct file *src = (struct file *)e;
+	file_ref(src);
+	pthread_rwlock_unlock(&src_dir->lock);
+	struct dir *d = path_resolve(&dst_name, &name);
+	if (d == NULL) {
+		file_unref(src);
+		return -1;
+	}
+	/*
+	 * The source is locked until the clone is logged, so as its
+	 * writes are logged either before the clone or after it.
+	 */
+	pthread_rwlock_rdlock(&src->lock);
+	pthread_rwlock_wrlock(&d->lock);
+	struct dentry *old = dir_index_find(d, name, strlen(name));
+	wal_lock();
+	if ((wal != NULL && src->is_deleted) ||
+	    (old != NULL && old->is_dir)) {
+		/*
+		 * A source deleted and logged already can't be cloned on the
+		 * replay, and a directory is not replaced by a file.
+		 */
+		wal_unlock();
+		pthread_rwlock_unlock(&d->lock);
+		pthread_rwlock_unlock(&src->lock);
+		file_unref(src);
+		ufs_error_code = old != NULL && old->is_dir ?
+				 UFS_ERR_INVALID_ARG : UFS_ERR_NO_FILE;
+		return -1;
+	}
+	wal_append(WAL_CLONE, dst_name, 0, strlen(src_name), src_name);
+	if (old != NULL)
+		file_unlink((struct file *)old);
+	wal_unlock();
+	struct file *f = file_new(d, name);
+	file_share_blocks(f, src);
+	pthread_rwlock_unlock(&d->lock);
+	pthread_rwlock_unlock(&src->lock);
+	file_unref(src);
+	if (old != NULL)
+		file_unref((struct file *)old);
+	return 0;
+}
+
+int
+ufs_clone(const char *src_name, const char *dst_name)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	int rc = file_clone(src_name, dst_name);
+	wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+	return rc;
+}
+
+/** Remove all the entries of @a d, with the fs locked for write. */
+static void
+dir_clear(struct dir *d)
+{
+	for (size_t i = 0; i < d->index_capacity; ++i) {
+		struct dentry *e = d->index[i];
+		if (e == NULL)
+			continue;
+		if (e->is_dir) {
+			struct dir *subdir = (struct dir *)e;
+			dir_clear(subdir);
+			dir_delete(subdir);
+		} else {
+			struct file *f = (struct file *)e;
+			f->is_deleted = true;
+			file_unref(f);
+		}
+	}
+	free(d->index);
+	d->index = NULL;
+	d->index_count = 0;
+	d->index_capacity = 0;
+}
+
+/**
+ * Remove @a e from its directory, with the fs locked for write: unlink a
+ * file, or free a directory with all its entries.
+ */
+static void
+dentry_remove(struct dentry *e)
+{
+	dir_unlink(e);
+	if (e->is_dir) {
+		dir_clear((struct dir *)e);
+		dir_delete((struct dir *)e);
+		dir_cache_flush();
+	} else {
+		struct file *f = (struct file *)e;
+		f->is_deleted = true;
+		file_unref(f);
+	}
+}
+
+int
+ufs_mkdir(const char *path)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	const char *name;
+	struct dir *parent = path_resolve(&path, &name);
+	if (parent == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		return -1;
+	}
+	pthread_rwlock_wrlock(&parent->lock);
+	if (dir_index_find(parent, name, strlen(name)) != NULL) {
+		pthread_rwlock_unlock(&parent->lock);
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_EXISTS;
+		return -1;
+	}
+	dir_new(parent, name);
+	wal_lock();
+	wal_append(WAL_MKDIR, path, 0, 0, NULL);
+	wal_unlock();
+	pthread_rwlock_unlock(&parent->lock);
+	wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+	return 0;
+}
+
+/** Remove the empty directory @a path, with the fs locked for write. */
+static int
+dir_remove(const char *path)
+{
+	const char *name;
+	struct dir *parent = path_resolve(&path, &name);
+	if (parent == NULL)
+		return -1;
+	struct dentry *e = dir_index_find(parent, name, strlen(name));
+	if (e == NULL || !e->is_dir) {
+		ufs_error_code = e == NULL ? UFS_ERR_NO_FILE :
+					     UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	if (((struct dir *)e)->index_count > 0) {
+		ufs_error_code = UFS_ERR_NOT_EMPTY;
+		return -1;
+	}
+	wal_lock();
+	wal_append(WAL_RMDIR, path, 0, 0, NULL);
+	wal_unlock();
+	dentry_remove(e);
+	return 0;
+}
+
+int
+ufs_rmdir(const char *path)
+{
+	/* No lookups while the directory is freed and the cache flushed. */
+	pthread_rwlock_wrlock(&fs_lock);
+	int rc = dir_remove(path);
+	wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+	return rc;
+}
+
+/** Rename @a old_path into @a new_path, with the fs locked for write. */
+static int
+dentry_rename(const char *old_path, const char *new_path)
+{
+	const char *old_name;
+	const char *new_name;
+	struct dir *old_dir = path_resolve(&old_path, &old_name);
+	if (old_dir == NULL)
+		return -1;
+	struct dir *new_dir = path_resolve(&new_path, &new_name);
+	if (new_dir == NULL)
+		return -1;
+	struct dentry *e = dir_index_find(old_dir, old_name, strlen(old_name));
+	if (e == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	struct dentry *old = dir_index_find(new_dir, new_name,
+					    strlen(new_name));
+	if (old == e)
+		return 0;
+	for (struct dir *d = new_dir; e->is_dir && d != NULL;
+	     d = d->entry.parent) {
+		if (&d->entry == e) {
+			/* A directory can't be moved into itself. */
+			ufs_error_code = UFS_ERR_INVALID_ARG;
+			return -1;
+		}
+	}
+	if (old != NULL && old->is_dir != e->is_dir) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	if (old != NULL && old->is_dir &&
+	    ((struct dir *)old)->index_count > 0) {
+		ufs_error_code = UFS_ERR_NOT_EMPTY;
+		return -1;
+	}
+	wal_lock();
+	wal_append(WAL_RENAME, new_path, 0, strlen(old_path), old_path);
+	wal_unlock();
+	if (old != NULL)
+		dentry_remove(old);
+	dir_unlink(e);
+	free(e->name);
+	e->name = strdup(new_name);
+	e->hash = name_hash(new_name, strlen(new_name));
+	dir_link(new_dir, e);
+	/* The cached paths of the directory subtree are not valid anymore. */
+	if (e->is_dir)
+		dir_cache_flush();
+	return 0;
+}
+
+int
+ufs_rename(const char *old_path, const char *new_path)
+{
+	/* No lookups while the entry moves. */
+	pthread_rwlock_wrlock(&fs_lock);
+	int rc = dentry_rename(old_path, new_path);
+	wal_commit();
+	pthread_rwlock_unlock(&fs_lock);
+	return rc;
+}
+
+struct ufs_dir {
+	struct ufs_dirent *entries;
+	size_t count;
+	/** Number of the next entry to return. */
+	size_t pos;
+	/** Names of the entries one after another. */
+	char *names;
+};
+
+struct ufs_dir *
+ufs_opendir(const char *path)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	path = path_normalize(path);
+	struct dir *d = path == NULL ? NULL : dir_lookup(path, strlen(path));
+	if (d == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = path == NULL ? UFS_ERR_INVALID_ARG :
+						UFS_ERR_NO_FILE;
+		return NULL;
+	}
+	pthread_rwlock_rdlock(&d->lock);
+	size_t names_size = 0;
+	for (size_t i = 0; i < d->index_capacity; ++i) {
+		if (d->index[i] != NULL)
+			names_size += strlen(d->index[i]->name) + 1;
+	}
+	struct ufs_dir *dir = malloc(sizeof(*dir));
+	dir->entries = malloc(sizeof(*dir->entries) * d->index_count);
+	dir->count = d->index_count;
+	dir->pos = 0;
+	dir->names = malloc(names_size);
+	char *name = dir->names;
+	size_t count = 0;
+	for (size_t i = 0; i < d->index_capacity; ++i) {
+		struct dentry *e = d->index[i];
+		if (e == NULL)
+			continue;
+		size_t size = strlen(e->name) + 1;
+		memcpy(name, e->name, size);
+		dir->entries[count].name = name;
+		dir->entries[count].is_dir = e->is_dir;
+		++count;
+		name += size;
+	}
+	pthread_rwlock_unlock(&d->lock);
+	pthread_rwlock_unlock(&fs_lock);
+	return dir;
+}
+
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir)
+{
+	if (dir->pos == dir->count)
+		return NULL;
+	return &dir->entries[dir->pos++];
+}
+
+void
+ufs_closedir(struct ufs_dir *dir)
+{
+	free(dir->entries);
+	free(dir->names);
+	free(dir);
+}
+
+int
+ufs_resize(int fd, size_t new_size)
+{
+	struct filedesc *desc = filedesc_get_writable(fd);
+	if (desc == NULL)
+		return -1;
+	if (new_size > MAX_FILE_SIZE) {
+		ufs_error_code = UFS_ERR_NO_MEM;
+		return -1;
+	}
+	struct file *f = desc->file;
+	file_change_begin(f);
+	if (new_size < f->size) {
+		if (__atomic_load_n(&f->map_count, __ATOMIC_RELAXED) > 0) {
+			file_change_end(f);
+			ufs_error_code = UFS_ERR_BUSY;
+			return -1;
+		}
+		file_truncate(f, new_size);
+	} else {
+		file_extend(f, new_size);
+	}
+	wal_log_file(f, WAL_RESIZE, 0, new_size, NULL);
+	file_change_end(f);
+	return 0;
+}
+
+int
+ufs_set_min_block_size(size_t size)
+{
+	if (size == 0 || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	__atomic_store_n(&min_block_shift, __builtin_ctzll(size),
+			 __ATOMIC_RELAXED);
+	return 0;
+}
+
+void
+ufs_set_dedup(bool is_enabled)
+{
+	__atomic_store_n(&dedup_is_enabled, is_enabled, __ATOMIC_RELAXED);
+}
+
+void
+ufs_dedup_stats(struct ufs_dedup_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	pthread_mutex_lock(&dedup_lock);
+	for (size_t i = 0; i < dedup_index_capacity; ++i) {
+		struct block *b = dedup_index[i];
+		if (b == NULL)
+			continue;
+		size_t size = (size_t)1 << b->shift;
+		++stats->block_count;
+		stats->bytes += size;
+		stats->logical_bytes += size *
+			__atomic_load_n(&b->refs, __ATOMIC_RELAXED);
+	}
+	stats->hit_count = dedup_hit_count;
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+/**
+ * All the entries for a whole FS traversal, with the fs locked. Each
+ * directory goes before its entries. The files are referenced.
+ */
+static struct dentry **
+dentry_collect_all(size_t *count)
+{
+	struct dentry **entries = NULL;
+	size_t capacity = 0;
+	*count = 0;
+	/* The collected entries are the queue of the directories to visit. */
+	size_t next = 0;
+	for (struct dir *d = &root_dir; d != NULL;) {
+		pthread_rwlock_rdlock(&d->lock);
+		for (size_t i = 0; i < d->index_capacity; ++i) {
+			struct dentry *e = d->index[i];
+			if (e == NULL)
+				continue;
+			if (*count == capacity) {
+				capacity = capacity == 0 ? 64 : capacity * 2;
+				entries = realloc(entries,
+						  sizeof(*entries) * capacity);
+			}
+			if (!e->is_dir)
+				file_ref((struct file *)e);
+			entries[(*count)++] = e;
+		}
+		pthread_rwlock_unlock(&d->lock);
+		d = NULL;
+		for (; next < *count && d == NULL; ++next) {
+			if (entries[next]->is_dir)
+				d = (struct dir *)entries[next];
+		}
+	}
+	return entries;
+}
+
+/** Referenced files of the whole FS, with the fs locked. */
+static struct file **
+file_collect_all(size_t *count)
+{
+	size_t entry_count;
+	struct dentry **entries = dentry_collect_all(&entry_count);
+	*count = 0;
+	for (size_t i = 0; i < entry_count; ++i) {
+		if (!entries[i]->is_dir)
+			entries[(*count)++] = entries[i];
+	}
+	return (struct file **)entries;
+}
+
+void
+ufs_compress_cold(void)
+{
+	char *scratch = malloc(block_compress_scratch_size());
+	size_t count;
+	pthread_rwlock_rdlock(&fs_lock);
+	struct file **files = file_collect_all(&count);
+	pthread_rwlock_unlock(&fs_lock);
+	for (size_t i = 0; i < count; ++i) {
+		file_change_begin(files[i]);
+		file_compress_cold(files[i], scratch);
+		file_change_end(files[i]);
+		file_unref(files[i]);
+	}
+	free(files);
+	free(scratch);
+}
+
+static void *
+compressor_f(void *arg)
+{
+	struct compressor *c = arg;
+	pthread_mutex_lock(&c->lock);
+	while (!c->is_stopped) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		long nsec = deadline.tv_nsec +
+			    (c->interval_ms % 1000) * 1000000L;
+		deadline.tv_sec += c->interval_ms / 1000 + nsec / 1000000000L;
+		deadline.tv_nsec = nsec % 1000000000L;
+		while (!c->is_stopped &&
+		       pthread_cond_timedwait(&c->cond, &c->lock,
+					      &deadline) != ETIMEDOUT) {
+		}
+		if (c->is_stopped)
+			break;
+		pthread_mutex_unlock(&c->lock);
+		ufs_compress_cold();
+		pthread_mutex_lock(&c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return NULL;
+}
+
+int
+ufs_set_compression(int interval_ms)
+{
+	if (interval_ms < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_mutex_lock(&compressor_lock);
+	struct compressor *c = compressor;
+	if (c != NULL) {
+		pthread_mutex_lock(&c->lock);
+		c->is_stopped = true;
+		pthread_cond_signal(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+		pthread_join(c->thread, NULL);
+		pthread_mutex_destroy(&c->lock);
+		pthread_cond_destroy(&c->cond);
+		free(c);
+		compressor = NULL;
+	}
+	if (interval_ms > 0) {
+		c = calloc(1, sizeof(*c));
+		pthread_mutex_init(&c->lock, NULL);
+		pthread_cond_init(&c->cond, NULL);
+		c->interval_ms = interval_ms;
+		pthread_create(&c->thread, NULL, compressor_f, c);
+		compressor = c;
+	}
+	pthread_mutex_unlock(&compressor_lock);
+	return 0;
+}
+
+void
+ufs_compression_stats(struct ufs_compression_stats *stats)
+{
+	stats->block_count = __atomic_load_n(&compression_stats.block_count,
+					     __ATOMIC_RELAXED);
+	stats->raw_bytes = __atomic_load_n(&compression_stats.raw_bytes,
+					   __ATOMIC_RELAXED);
+	stats->compressed_bytes =
+		__atomic_load_n(&compression_stats.compressed_bytes,
+				__ATOMIC_RELAXED);
+	stats->cache_hit_count =
+		__atomic_load_n(&compression_stats.cache_hit_count,
+				__ATOMIC_RELAXED);
+	stats->cache_miss_count =
+		__atomic_load_n(&compression_stats.cache_miss_count,
+				__ATOMIC_RELAXED);
+}
+
+/** Memory of @a b, the compressed size if it is compressed. */
+static size_t
+block_allocated_size(const struct block *b)
+{
+	return b->state == BLOCK_COMPRESSED ? b->compressed_size :
+					      (size_t)1 << b->shift;
+}
+
+/** Stats of the read locked @a f. */
+static void
+file_stat(struct file *f, struct ufs_stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->size = f->size;
+	for (size_t i = 0; i < f->block_count; ++i) {
+		if (f->blocks[i] == NULL)
+			continue;
+		++st->block_count;
+		st->allocated_bytes += block_allocated_size(f->blocks[i]);
+	}
+	if (f->size == 0)
+		return;
+	size_t offset;
+	size_t i = file_block_index(f, f->size - 1, &offset);
+	if (f->blocks[i] != NULL)
+		st->slack_bytes = file_block_size(f, i) - offset - 1;
+}
+
+int
+ufs_stat(const char *path, struct ufs_stat *st)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	path = path_normalize(path);
+	if (path == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	struct dentry *e = &root_dir.entry;
+	if (*path != 0) {
+		const char *name;
+		struct dir *d = path_parent(path, &name);
+		e = NULL;
+		if (d != NULL) {
+			pthread_rwlock_rdlock(&d->lock);
+			e = dir_index_find(d, name, strlen(name));
+			if (e != NULL && !e->is_dir)
+				file_ref((struct file *)e);
+			pthread_rwlock_unlock(&d->lock);
+		}
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	if (e == NULL) {
+		ufs_error_code = UFS_ERR_NO_FILE;
+		return -1;
+	}
+	if (e->is_dir) {
+		memset(st, 0, sizeof(*st));
+		st->is_dir = true;
+		return 0;
+	}
+	struct file *f = (struct file *)e;
+	pthread_rwlock_rdlock(&f->lock);
+	file_stat(f, st);
+	pthread_rwlock_unlock(&f->lock);
+	file_unref(f);
+	return 0;
+}
+
+void
+ufs_fs_stats(struct ufs_fs_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	size_t count;
+	pthread_rwlock_rdlock(&fs_lock);
+	struct dentry **entries = dentry_collect_all(&count);
+	pthread_rwlock_unlock(&fs_lock);
+	for (size_t i = 0; i < count; ++i) {
+		if (entries[i]->is_dir) {
+			++stats->dir_count;
+			continue;
+		}
+		struct file *f = (struct file *)entries[i];
+		struct ufs_stat st;
+		pthread_rwlock_rdlock(&f->lock);
+		file_stat(f, &st);
+		pthread_rwlock_unlock(&f->lock);
+		file_unref(f);
+		++stats->file_count;
+		stats->logical_bytes += st.size;
+		if (st.slack_bytes > 0) {
+			++stats->partial_block_count;
+			stats->slack_bytes += st.slack_bytes;
+		}
+	}
+	free(entries);
+	stats->block_count = __atomic_load_n(&block_stats.block_count,
+					     __ATOMIC_RELAXED);
+	stats->allocated_bytes =
+		__atomic_load_n(&block_stats.allocated_bytes,
+				__ATOMIC_RELAXED);
+	stats->slab_bytes = __atomic_load_n(&block_stats.slab_bytes,
+					    __ATOMIC_RELAXED);
+	pthread_rwlock_rdlock(&file_descriptors_lock);
+	stats->open_descriptor_count = file_descriptor_count;
+	pthread_rwlock_unlock(&file_descriptors_lock);
+	for (int i = 0; i < IO_STATS_SHARD_COUNT; ++i) {
+		struct io_stats *s = &io_stats[i];
+		stats->read_count += __atomic_load_n(&s->read_count,
+						     __ATOMIC_RELAXED);
+		stats->read_bytes += __atomic_load_n(&s->read_bytes,
+						     __ATOMIC_RELAXED);
+		stats->write_count += __atomic_load_n(&s->write_count,
+						      __ATOMIC_RELAXED);
+		stats->write_bytes += __atomic_load_n(&s->write_bytes,
+						      __ATOMIC_RELAXED);
+	}
+}
+
+/** Name of @a e in the image: the path, with a slash for a directory. */
+static char *
+image_entry_name(const struct dentry *e)
+{
+	char *path = dentry_path(e);
+	if (!e->is_dir)
+		return path;
+	size_t len = strlen(path);
+	path = realloc(path, len + 2);
+	path[len] = '/';
+	path[len + 1] = 0;
+	return path;
+}
+
+static size_t
+image_entry_size(const struct dentry *e)
+{
+	return e->is_dir ? 0 : ((const struct file *)e)->size;
+}
+
+/** Write the image of @a entries, with the fs locked. */
+static bool
+image_write(FILE *out, struct dentry **entries, size_t count)
+{
+	struct image_header header;
+	memcpy(header.magic, image_magic, sizeof(header.magic));
+	header.file_count = count;
+	fwrite(&header, sizeof(header), 1, out);
+	char **names = malloc(sizeof(*names) * count);
+	size_t table_end = sizeof(header);
+	for (size_t i = 0; i < count; ++i) {
+		names[i] = image_entry_name(entries[i]);
+		table_end += sizeof(struct image_file) +
+			     align_up(strlen(names[i]), 8);
+	}
+	static const char zeros[BLOCK_ALIGN > 8 ? BLOCK_ALIGN : 8];
+	size_t offset = table_end;
+	for (size_t i = 0; i < count; ++i) {
+		offset = align_up(offset, BLOCK_ALIGN);
+		struct image_file entry = {
+			.size = image_entry_size(entries[i]),
+			.offset = offset,
+			.name_len = strlen(names[i]),
+			.block_shift = entries[i]->is_dir ? 0 :
+				((struct file *)entries[i])->block_shift,
+		};
+		fwrite(&entry, sizeof(entry), 1, out);
+		fwrite(names[i], 1, entry.name_len, out);
+		fwrite(zeros, 1, align_up(entry.name_len, 8) - entry.name_len,
+		       out);
+		offset += entry.size;
+		free(names[i]);
+	}
+	free(names);
+	offset = table_end;
+	char *raw = NULL;
+	for (size_t i = 0; i < count; ++i) {
+		fwrite(zeros, 1, align_up(offset, BLOCK_ALIGN) - offset, out);
+		offset = align_up(offset, BLOCK_ALIGN);
+		if (entries[i]->is_dir)
+			continue;
+		struct file *f = (struct file *)entries[i];
+		size_t pos = 0;
+		for (size_t j = 0; pos < f->size; ++j) {
+			size_t len = file_block_size(f, j);
+			if (len > f->size - pos)
+				len = f->size - pos;
+			struct block *b = f->blocks[j];
+			const char *data = b != NULL ? b->memory : zero_block;
+			if (b != NULL && b->state == BLOCK_COMPRESSED) {
+				/* Past the cache, not to evict the hot blocks. */
+				if (raw == NULL)
+					raw = malloc(MAX_BLOCK_SIZE);
+				block_decompress(b, raw);
+				data = raw;
+			}
+			fwrite(data, 1, len, out);
+			pos += len;
+		}
+		offset += f->size;
+	}
+	free(raw);
+	return ferror(out) == 0;
+}
+
+int
+ufs_save(const char *path)
+{
+	/* No changes while saving, to save a consistent state. */
+	pthread_rwlock_wrlock(&fs_lock);
+	size_t count;
+	struct dentry **entries = dentry_collect_all(&count);
+	char *tmp_path = path_with_suffix(path, ".tmp");
+	bool ok = false;
+	FILE *out = fopen(tmp_path, "wb");
+	if (out != NULL) {
+		setvbuf(out, NULL, _IOFBF, 1 << 20);
+		ok = image_write(out, entries, count) && fflush(out) == 0 &&
+		     fsync(fileno(out)) == 0;
+		ok = fclose(out) == 0 && ok;
+		/* The old image is replaced only by a complete new one. */
+		ok = ok && rename(tmp_path, path) == 0;
+		if (!ok)
+			unlink(tmp_path);
+	}
+	free(tmp_path);
+	for (size_t i = 0; i < count; ++i) {
+		if (!entries[i]->is_dir)
+			file_unref((struct file *)entries[i]);
+	}
+	free(entries);
+	if (ok && wal != NULL && strcmp(wal->image_path, path) == 0)
+		wal_reset(wal);
+	pthread_rwlock_unlock(&fs_lock);
+	if (!ok) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+/** Check a path from an image or a log, they are stored normalized. */
+static bool
+path_is_valid(const char *path)
+{
+	return *path != 0 && path_normalize(path) == path;
+}
+
+/**
+ * Get the directory of the first @a len bytes of the valid @a path for
+ * loading, with the fs locked for write. It is created with its parents
+ * if needed, replacing the files in the way.
+ */
+static struct dir *
+dir_load(const char *path, size_t len)
+{
+	struct dir *d = &root_dir;
+	const char *end = path + len;
+	for (const char *p = path; p < end;) {
+		const char *next = memchr(p, '/', end - p);
+		if (next == NULL)
+			next = end;
+		struct dentry *e = dir_index_find(d, p, next - p);
+		if (e != NULL && !e->is_dir) {
+			dentry_remove(e);
+			e = NULL;
+		}
+		if (e == NULL) {
+			char *name = strndup(p, next - p);
+			e = &dir_new(d, name)->entry;
+			free(name);
+		}
+		d = (struct dir *)e;
+		p = next + 1;
+	}
+	return d;
+}
+
+/**
+ * Get the file of the valid @a path for loading, with the fs locked for
+ * write. It is created with its directories if needed, or if @a is_new,
+ * replacing an old entry.
+ */
+static struct file *
+file_load(const char *path, bool is_new)
+{
+	const char *slash = strrchr(path, '/');
+	const char *name = slash == NULL ? path : slash + 1;
+	struct dir *d = dir_load(path, slash == NULL ? 0 : slash - path);
+	struct dentry *old = dir_index_find(d, name, strlen(name));
+	if (old != NULL && !old->is_dir && !is_new)
+		return (struct file *)old;
+	if (old != NULL)
+		dentry_remove(old);
+	return file_new(d, name);
+}
+
+struct ufs_snapshot {
+	/**
+	 * Copies of the entries in the order of dentry_collect_all(),
+	 * named by their paths. The file copies share the blocks and are
+	 * not linked anywhere.
+	 */
+	struct dentry **entries;
+	size_t entry_count;
+};
+
+struct ufs_snapshot *
+ufs_snapshot_create(void)
+{
+	/* No changes while taking the snapshot, to take a consistent one. */
+	pthread_rwlock_wrlock(&fs_lock);
+	struct ufs_snapshot *snapshot = malloc(sizeof(*snapshot));
+	snapshot->entries = dentry_collect_all(&snapshot->entry_count);
+	for (size_t i = 0; i < snapshot->entry_count; ++i) {
+		struct dentry *e = snapshot->entries[i];
+		char *path = dentry_path(e);
+		if (e->is_dir) {
+			struct dentry *copy = malloc(sizeof(*copy));
+			dentry_init(copy, path, true);
+			snapshot->entries[i] = copy;
+		} else {
+			struct file *f = (struct file *)e;
+			struct file *copy = file_alloc(path);
+			pthread_rwlock_rdlock(&f->lock);
+			file_share_blocks(copy, f);
+			pthread_rwlock_unlock(&f->lock);
+			file_unref(f);
+			snapshot->entries[i] = &copy->entry;
+		}
+		free(path);
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	return snapshot;
+}
+
+int
+ufs_snapshot_restore(const struct ufs_snapshot *snapshot)
+{
+	pthread_rwlock_wrlock(&fs_lock);
+	if (wal != NULL) {
+		/* The restored files would not be in the log. */
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_BUSY;
+		return -1;
+	}
+	dir_clear(&root_dir);
+	dir_cache_flush();
+	for (size_t i = 0; i < snapshot->entry_count; ++i) {
+		struct dentry *copy = snapshot->entries[i];
+		if (copy->is_dir) {
+			dir_load(copy->name, strlen(copy->name));
+			continue;
+		}
+		struct file *f = file_load(copy->name, true);
+		file_share_blocks(f, (struct file *)copy);
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	return 0;
+}
+
+void
+ufs_snapshot_delete(struct ufs_snapshot *snapshot)
+{
+	for (size_t i = 0; i < snapshot->entry_count; ++i) {
+		struct dentry *copy = snapshot->entries[i];
+		if (copy->is_dir) {
+			free(copy->name);
+			free(copy);
+		} else {
+			file_delete((struct file *)copy);
+		}
+	}
+	free(snapshot->entries);
+	free(snapshot);
+}
+
+/**
+ * Check the image file table. Returns the number of the blocks which are
+ * loaded in place, or -1 if the image is corrupted.
+ */
+static ssize_t
+image_check(const char *data, size_t size)
+{
+	const struct image_header *header = (const void *)data;
+	if (size < sizeof(*header) ||
+	    memcmp(header->magic, image_magic, sizeof(header->magic)) != 0)
+		return -1;
+	size_t pos = sizeof(*header);
+	size_t block_count = 0;
+	for (uint64_t i = 0; i < header->file_count; ++i) {
+		const struct image_file *entry = (const void *)(data + pos);
+		if (size - pos < sizeof(*entry))
+			return -1;
+		pos += sizeof(*entry);
+		if (entry->name_len == 0 ||
+		    align_up(entry->name_len, 8) > size - pos ||
+		    memchr(data + pos, 0, entry->name_len) != NULL)
+			return -1;
+		bool is_dir = data[pos + entry->name_len - 1] == '/';
+		char *name = strndup(data + pos, entry->name_len - is_dir);
+		bool is_valid = path_is_valid(name);
+		free(name);
+		if (!is_valid || (is_dir && entry->size != 0) ||
+		    entry->size > MAX_FILE_SIZE ||
+		    entry->block_shift > MAX_BLOCK_SHIFT ||
+		    entry->offset % BLOCK_ALIGN != 0 || entry->offset > size ||
+		    entry->size > size - entry->offset)
+			return -1;
+		pos += align_up(entry->name_len, 8);
+		struct file f = {.block_shift = entry->block_shift};
+		block_count += file_full_block_count(&f, entry->size);
+	}
+	return block_count;
+}
+
+/**
+ * Make the file or the directory of the image @a entry. The full blocks
+ * point into the image, the last one is copied if it is not full: the
+ * file can grow into it, and the image has the next file there.
+ */
+static void
+image_load_file(struct image *image, const struct image_file *entry,
+		size_t *next_block)
+{
+	const char *name = (const char *)(entry + 1);
+	if (name[entry->name_len - 1] == '/') {
+		dir_load(name, entry->name_len - 1);
+		return;
+	}
+	char *path = strndup(name, entry->name_len);
+	struct file *f = file_load(path, true);
+	free(path);
+	pthread_rwlock_wrlock(&f->lock);
+
+	f->block_shift = entry->block_shift;
+	size_t count = file_block_count(f, entry->size);
+	f->blocks = malloc(sizeof(*f->blocks) * count);
+	f->block_capacity = count;
+	f->block_count = count;
+	size_t pos = 0;
+	for (size_t i = 0; i < count; ++i) {
+		size_t size = file_block_size(f, i);
+		const char *src = image->data + entry->offset + pos;
+		if (size <= entry->size - pos) {
+			struct block *b = &image->blocks[(*next_block)++];
+			b->memory = (char *)src;
+			b->image = image;
+			b->next_free = NULL;
+			b->refs = 1;
+			b->shift = file_block_shift(f, i);
+			b->is_indexed = false;
+			b->state = BLOCK_RAW;
+			b->is_hot = false;
+			block_stats_add(1, size);
+			f->blocks[i] = b;
+			pos += size;
+		} else {
+			f->blocks[i] = block_new(file_block_shift(f, i));
+			memcpy(f->blocks[i]->memory, src, entry->size - pos);
+			pos = entry->size;
+		}
+	}
+	f->size = entry->size;
+	pthread_rwlock_unlock(&f->lock);
+}
+
+/**
+ * Load the image at @a path, with the fs locked for write. Returns 1 if
+ * there is no image.
+ */
+static int
+image_load(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct stat st;
+	char *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	ssize_t block_count = image_check(data, st.st_size);
+	if (block_count < 0) {
+		munmap(data, st.st_size);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct image *image = malloc(sizeof(*image));
+	image->data = data;
+	image->size = st.st_size;
+	image->blocks = malloc(sizeof(*image->blocks) * (block_count + 1));
+	/* A reference of the loading itself, the image can have no blocks. */
+	image->refs = block_count + 1;
+
+	const struct image_header *header = (const void *)data;
+	size_t pos = sizeof(*header);
+	size_t next_block = 0;
+	for (uint64_t i = 0; i < header->file_count; ++i) {
+		const struct image_file *entry = (const void *)(data + pos);
+		image_load_file(image, entry, &next_block);
+		pos += sizeof(*entry) + align_up(entry->name_len, 8);
+	}
+	image_unref(image);
+	return 0;
+}
+
+/** Apply a log record, with the fs locked for write. */
+static bool
+wal_apply(const struct wal_record *record, const char *name_data,
+	  const char *data)
+{
+	char *name = strndup(name_data, record->name_len);
+	if (record->type == WAL_CLONE || record->type == WAL_RENAME) {
+		char *src_name = strndup(data, record->size);
+		if (record->type == WAL_CLONE)
+			file_clone(src_name, name);
+		else
+			dentry_rename(src_name, name);
+		free(src_name);
+		free(name);
+		return true;
+	}
+	if (!path_is_valid(name)) {
+		free(name);
+		return true;
+	}
+	if (record->type == WAL_MKDIR || record->type == WAL_RMDIR ||
+	    record->type == WAL_DELETE) {
+		if (record->type == WAL_MKDIR) {
+			dir_load(name, strlen(name));
+		} else if (record->type == WAL_RMDIR) {
+			dir_remove(name);
+		} else {
+			const char *base;
+			struct dir *d = path_parent(name, &base);
+			struct dentry *e = d == NULL ? NULL :
+					   dir_index_find(d, base, strlen(base));
+			if (e != NULL && !e->is_dir)
+				dentry_remove(e);
+		}
+		free(name);
+		return true;
+	}
+	struct file *f = file_load(name, false);
+	free(name);
+	file_ref(f);
+	bool ok = true;
+	pthread_rwlock_wrlock(&f->lock);
+	if (record->type == WAL_WRITE) {
+		file_write_at(f, data, record->size, record->offset);
+	} else if (record->type == WAL_RESIZE) {
+		if (record->size >= f->size)
+			file_extend(f, record->size);
+		else if (__atomic_load_n(&f->map_count, __ATOMIC_RELAXED) > 0)
+			ok = false;
+		else
+			file_truncate(f, record->size);
+	}
+	pthread_rwlock_unlock(&f->lock);
+	file_unref(f);
+	return ok;
+}
+
+/**
+ * Walk the valid records of the log @a data, applying them if @a is_apply.
+ * Returns the size of the valid prefix, or -1 if a record can't be applied.
+ */
+static ssize_t
+wal_replay(const char *data, size_t size, bool is_apply)
+{
+	size_t pos = 0;
+	while (size - pos >= sizeof(struct wal_record)) {
+		struct wal_record record;
+		memcpy(&record, data + pos, sizeof(record));
+		size_t rest = size - pos - sizeof(record);
+		bool has_src = record.type == WAL_CLONE ||
+			       record.type == WAL_RENAME;
+		size_t data_size = record.type == WAL_WRITE || has_src ?
+				   record.size : 0;
+		if (record.type < WAL_CREATE || record.type > WAL_RENAME ||
+		    record.name_len == 0 || record.name_len > rest ||
+		    record.size > MAX_FILE_SIZE ||
+		    record.offset > MAX_FILE_SIZE - record.size ||
+		    data_size > rest - record.name_len)
+			break;
+		const char *name = data + pos + sizeof(record);
+		uint64_t hash = hash64(name, record.name_len + data_size, 0);
+		if (record.checksum != hash64((char *)&record +
+					      sizeof(record.checksum),
+					      sizeof(record) -
+					      sizeof(record.checksum), hash) ||
+		    memchr(name, 0, record.name_len) != NULL ||
+		    (has_src &&
+		     (record.size == 0 || memchr(name + record.name_len, 0,
+						 record.size) != NULL)))
+			break;
+		if (is_apply &&
+		    !wal_apply(&record, name, name + record.name_len)) {
+			ufs_error_code = UFS_ERR_BUSY;
+			return -1;
+		}
+		pos += sizeof(record) + record.name_len + data_size;
+	}
+	return pos;
+}
+
+/**
+ * Replay the log of the image at @a path, with the fs locked for write.
+ * Returns 1 if there is no log.
+ */
+static int
+wal_load(const char *path)
+{
+	char *wal_path = path_with_suffix(path, ".wal");
+	int fd = open(wal_path, O_RDONLY);
+	free(wal_path);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	ssize_t rc = wal_replay(data, st.st_size, true);
+	munmap(data, st.st_size);
+	return rc < 0 ? -1 : 0;
+}
+
+int
+ufs_load(const char *path)
+{
+	pthread_rwlock_wrlock(&fs_lock);
+	int rc;
+	if (wal != NULL) {
+		/* The loaded files would not be in the log. */
+		ufs_error_code = UFS_ERR_BUSY;
+		rc = -1;
+	} else {
+		rc = image_load(path);
+		if (rc >= 0) {
+			int wal_rc = wal_load(path);
+			if (rc == 1 && wal_rc == 1)
+				ufs_error_code = UFS_ERR_IO;
+			rc = wal_rc < 0 || (rc == 1 && wal_rc == 1) ? -1 : 0;
+		}
+	}
+	pthread_rwlock_unlock(&fs_lock);
+	return rc;
+}
+
+int
+ufs_wal_open(const char *path, int batch_size, int flush_interval_ms)
+{
+	if (batch_size < 1 || flush_interval_ms < 0) {
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_rwlock_wrlock(&fs_lock);
+	if (wal != NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_BUSY;
+		return -1;
+	}
+	char *wal_path = path_with_suffix(path, ".wal");
+	int fd = open(wal_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	free(wal_path);
+	struct stat st;
+	bool ok = fd >= 0 && fstat(fd, &st) == 0;
+	if (ok && st.st_size > 0) {
+		/* Cut a torn tail, so as new records follow the valid ones. */
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+				  fd, 0);
+		ok = data != MAP_FAILED;
+		if (ok) {
+			ssize_t valid = wal_replay(data, st.st_size, false);
+			munmap(data, st.st_size);
+			ok = valid == st.st_size || ftruncate(fd, valid) == 0;
+		}
+	}
+	if (!ok) {
+		if (fd >= 0)
+			close(fd);
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	struct wal *w = calloc(1, sizeof(*w));
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->fd = fd;
+	w->image_path = strdup(path);
+	w->batch_size = batch_size;
+	w->flush_interval_ms = flush_interval_ms;
+	if (flush_interval_ms > 0)
+		pthread_create(&w->flusher, NULL, wal_flusher_f, w);
+	wal = w;
+	pthread_rwlock_unlock(&fs_lock);
+	return 0;
+}
+
+int
+ufs_wal_sync(void)
+{
+	pthread_rwlock_rdlock(&fs_lock);
+	if (wal == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_mutex_lock(&wal->lock);
+	wal_flush(wal);
+	bool is_broken = wal->is_broken;
+	pthread_mutex_unlock(&wal->lock);
+	pthread_rwlock_unlock(&fs_lock);
+	if (is_broken) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
+}
+
+int
+ufs_wal_close(void)
 {
-	/* IMPLEMENT THIS FUNCTION */
-	(void)filename;
-	ufs_error_code = UFS_ERR_NOT_IMPLEMENTED;
-	return -1;
+	pthread_rwlock_wrlock(&fs_lock);
+	struct wal *w = wal;
+	if (w == NULL) {
+		pthread_rwlock_unlock(&fs_lock);
+		ufs_error_code = UFS_ERR_INVALID_ARG;
+		return -1;
+	}
+	pthread_mutex_lock(&w->lock);
+	w->is_stopped = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	if (w->flush_interval_ms > 0)
+		pthread_join(w->flusher, NULL);
+	pthread_mutex_lock(&w->lock);
+	wal_flush(w);
+	pthread_mutex_unlock(&w->lock);
+	bool ok = close(w->fd) == 0 && !w->is_broken;
+	wal = NULL;
+	pthread_rwlock_unlock(&fs_lock);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->cond);
+	free(w->image_path);
+	free(w->buf);
+	free(w->flush_buf);
+	free(w);
+	if (!ok) {
+		ufs_error_code = UFS_ERR_IO;
+		return -1;
+	}
+	return 0;
 }
 
 void
 ufs_destroy(void)
 {
+	ufs_set_compression(0);
+	if (wal != NULL)
+		ufs_wal_close();
+	for (int slot = 0; slot < file_descriptor_capacity; ++slot) {
+		struct filedesc *desc = file_descriptors[slot];
+		if (desc != NULL) {
+			file_unref(desc->file);
+			free(desc);
+		}
+	}
+	free(file_descriptors);
+	file_descriptors = NULL;
+	file_descriptor_count = 0;
+	file_descriptor_capacity = 0;
+	free(file_descriptor_free);
+	file_descriptor_free = NULL;
+	file_descriptor_free_count = 0;
+	file_descriptor_shrink_count = 0;
+	dir_clear(&root_dir);
+	dir_cache_flush();
+	free(dedup_index);
+	dedup_index = NULL;
+	dedup_index_count = 0;
+	dedup_index_capacity = 0;
+	dedup_hit_count = 0;
+	for (int i = 0; i < BLOCK_CACHE_SIZE; ++i)
+		free(block_cache[i].memory);
+	memset(block_cache, 0, sizeof(block_cache));
+	block_cache_clock = 0;
+	memset(&compression_stats, 0, sizeof(compression_stats));
+	memset(io_stats, 0, sizeof(io_stats));
+	while (slab_list != NULL) {
+		struct slab *next = slab_list->next;
+		free(slab_list);
+		slab_list = next;
+	}
+	block_stats.slab_bytes = 0;
+	memset(block_free_lists, 0, sizeof(block_free_lists));
 }
@@ -1,12 +1,25 @@
 #pragma once
 
+#include <stdbool.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 /**
  * User-defined in-memory filesystem. It is as simple as possible.
- * Each file lies in the memory as an array of blocks. A file
- * has an unique file name, and there are no directories, so the
- * FS is a monolithic flat contiguous folder.
+ * Each file lies in the memory as an array of blocks. Files are
+ * sparse: the blocks never written are holes, which read as zeros
+ * and take no memory. Files and directories are named by paths of
+ * components separated by slashes, like "dir/subdir/file", relative
+ * to the root directory. A leading slash is allowed, repeated and
+ * trailing ones are not. A file is created only in an existing
+ * directory, see ufs_mkdir().
+ *
+ * All the functions but ufs_destroy() can be called from any
+ * threads. Reads of a file run in parallel, and so do operations
+ * on different files. A descriptor position is not synchronized
+ * though: a descriptor shared by threads should be used with
+ * ufs_pread() and ufs_pwrite(), and must not be closed while
+ * another thread uses it.
  */
 
 /**
@@ -23,6 +36,8 @@
  * It is important to define these macros here, in the header,
  * because it is used by tests.
  */
+#define NEED_OPEN_FLAGS
+#define NEED_RESIZE
 
 /**
  * Flags for ufs_open call.
@@ -65,9 +80,25 @@ enum ufs_error_code {
 
 	UFS_ERR_NO_PERMISSION,
 #endif
+
+	UFS_ERR_INVALID_ARG,
+	UFS_ERR_BUSY,
+	UFS_ERR_IO,
+	UFS_ERR_EXISTS,
+	UFS_ERR_NOT_EMPTY,
+};
+
+/** Origin of a ufs_seek() offset. */
+enum ufs_seek_whence {
+	/** From the file beginning. */
+	UFS_SEEK_SET = 0,
+	/** From the current descriptor position. */
+	UFS_SEEK_CUR,
+	/** From the file end. */
+	UFS_SEEK_END,
 };
 
-/** Get code of the last error. */
+/** Get code of the last error in the calling thread. */
 enum ufs_error_code
 ufs_errno();
 
@@ -76,10 +107,13 @@ ufs_errno();
  * @param filename Name of a file to open.
  * @param flags Bitwise combination of open_flags.
  *
- * @retval > 0 File descriptor.
+ * @retval > 0 File descriptor. Its number stays invalid after
+ *     the close even if a new descriptor takes its place.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file, and UFS_CREATE flag is
- *       not specified.
+ *       not specified, or no such directory.
+ *     - UFS_ERR_INVALID_ARG - bad path, or it is a directory.
+ *     - UFS_ERR_NO_MEM - too many open descriptors.
  */
 int
 ufs_open(const char *filename, int flags);
@@ -112,12 +146,159 @@ ufs_write(int fd, const char *buf, size_t size);
 ssize_t
 ufs_read(int fd, char *buf, size_t size);
 
+/**
+ * Write data to the file at the given offset. The descriptor
+ * position is not used and not changed. If @a offset is beyond
+ * the file end, the gap reads as zeros.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to write.
+ * @param size Size of @a buf.
+ * @param offset Position in the file to write at.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ */
+ssize_t
+ufs_pwrite(int fd, const char *buf, size_t size, size_t offset);
+
+/**
+ * Read data from the file at the given offset. The descriptor
+ * position is not used and not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param buf Buffer to read into.
+ * @param size Maximum bytes to read.
+ * @param offset Position in the file to read from.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 @a offset is at or beyond the file end.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_pread(int fd, char *buf, size_t size, size_t offset);
+
+/**
+ * Write data from several buffers to the file, like ufs_write()
+ * does with one buffer. The buffers are written as a whole, other
+ * writers of the file don't get between them.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to write.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval >= 0 How many bytes were written.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_MEM - not enough memory.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * Read data from the file into several buffers, like ufs_read()
+ * does with one buffer. A buffer is filled up before going to the
+ * next one.
+ * @param fd File descriptor from ufs_open().
+ * @param iov Buffers to read into.
+ * @param iovcnt Number of the buffers.
+ *
+ * @retval > 0 How many bytes were read.
+ * @retval 0 EOF.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a iovcnt.
+ */
+ssize_t
+ufs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/** A read-only view of a file range, see ufs_read_map(). */
+struct ufs_map {
+	/** Pieces of the range in order, pointing into the file. */
+	struct iovec *iov;
+	/** Number of the pieces. */
+	int iovcnt;
+	/** The mapped file, private. */
+	void *file;
+};
+
+/**
+ * Get the file data without copying. The map points right at the
+ * file memory. It sees later writes into the range, except those
+ * copying a block shared with a clone or a snapshot: the map keeps
+ * the old block. It stays valid until ufs_read_unmap() even if the
+ * file is deleted and closed. Shrinking a mapped file fails.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Start of the range.
+ * @param size Size of the range. It is cut at the file end.
+ * @param[out] map The map to fill.
+ *
+ * @retval >= 0 How many bytes are mapped.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ */
+ssize_t
+ufs_read_map(int fd, size_t offset, size_t size, struct ufs_map *map);
+
+/** Release a map from ufs_read_map(). */
+void
+ufs_read_unmap(struct ufs_map *map);
+
+/**
+ * Move the descriptor position. The new position can't be beyond
+ * the file end, use ufs_pwrite() or ufs_resize() to grow a file.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Offset relative to @a whence, can be negative.
+ * @param whence One of ufs_seek_whence.
+ *
+ * @retval >= 0 The new position.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - invalid @a whence, or the new
+ *       position is negative or beyond the file end.
+ */
+off_t
+ufs_seek(int fd, off_t offset, int whence);
+
+/**
+ * Find where data starts at or after @a offset, to skip the holes
+ * when copying a file. The data is stored with the block
+ * granularity, so it can include zeros. The descriptor position
+ * is not changed.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Position to search from.
+ *
+ * @retval >= 0 Start of the data, or the file size if there is no
+ *     more data.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a offset.
+ */
+off_t
+ufs_seek_data(int fd, off_t offset);
+
+/**
+ * Find where a hole starts at or after @a offset. There is an
+ * implicit hole at the file end. The descriptor position is not
+ * changed.
+ * @param fd File descriptor from ufs_open().
+ * @param offset Position to search from.
+ *
+ * @retval >= 0 Start of the hole, the file size at most.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_INVALID_ARG - negative @a offset.
+ */
+off_t
+ufs_seek_hole(int fd, off_t offset);
+
 /**
  * Close a file.
  * @param fd File descriptor from ufs_open().
  * @retval 0 Success.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
- *     - UFS_ERR_NO_FILE - invalid file descriptor.
+ *     - UFS_ERR_NO_FILE - invalid or closed file descriptor.
  */
 int
 ufs_close(int fd);
@@ -133,19 +314,155 @@ ufs_close(int fd);
  * @param filename Name of a file to delete.
  * @retval -1 Error occurred. Check ufs_errno() for a code.
  *     - UFS_ERR_NO_FILE - no such file.
+ *     - UFS_ERR_INVALID_ARG - bad path, or it is a directory.
  */
 int
 ufs_delete(const char *filename);
 
+/**
+ * Create a directory. Each directory has its own hash index of
+ * the entries, so a path is looked up in O(its depth), and the
+ * directory paths are cached, so an open of a deep path usually
+ * takes two lookups.
+ * @param path Path of the new directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no parent directory.
+ *     - UFS_ERR_EXISTS - there is a file or a directory @a path.
+ *     - UFS_ERR_INVALID_ARG - bad path.
+ */
+int
+ufs_mkdir(const char *path);
+
+/**
+ * Remove an empty directory.
+ * @param path Path of the directory.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_NOT_EMPTY - the directory has entries.
+ *     - UFS_ERR_INVALID_ARG - bad path, or it is a file.
+ */
+int
+ufs_rmdir(const char *path);
+
+/**
+ * Move a file or a directory with its entries to another path,
+ * in O(1) of the number of the entries. An existing file, or an
+ * empty directory, @a new_path is replaced. Opened descriptors
+ * keep working with the moved files.
+ * @param old_path Path of the file or the directory.
+ * @param new_path Its new path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no @a old_path, or no directory for
+ *       @a new_path.
+ *     - UFS_ERR_NOT_EMPTY - @a new_path is a directory with
+ *       entries.
+ *     - UFS_ERR_INVALID_ARG - bad path, a directory is moved
+ *       into itself, or @a new_path is of another type.
+ */
+int
+ufs_rename(const char *old_path, const char *new_path);
+
+/** An entry of a directory, see ufs_readdir(). */
+struct ufs_dirent {
+	/** Name in the directory. */
+	const char *name;
+	bool is_dir;
+};
+
+/** A directory listing, see ufs_opendir(). */
+struct ufs_dir;
+
+/**
+ * List a directory. The listing is taken at once, in O(number of
+ * the entries), and isn't affected by later changes. The entries
+ * are in no particular order.
+ * @param path Path of the directory, "" or "/" for the root.
+ *
+ * @retval Listing to read with ufs_readdir() and close with
+ *     ufs_closedir().
+ * @retval NULL Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such directory.
+ *     - UFS_ERR_INVALID_ARG - bad path.
+ */
+struct ufs_dir *
+ufs_opendir(const char *path);
+
+/**
+ * Get the next entry of a listing. It is valid until
+ * ufs_closedir().
+ * @retval NULL There are no more entries.
+ */
+const struct ufs_dirent *
+ufs_readdir(struct ufs_dir *dir);
+
+void
+ufs_closedir(struct ufs_dir *dir);
+
+/**
+ * Copy a file in O(1) of its size. The copy shares the memory
+ * blocks with the source, and a block is copied only when one of
+ * the files changes it. An existing file @a dst_name is replaced,
+ * like after ufs_delete().
+ * @param src_name Name of the file to copy.
+ * @param dst_name Name of the copy.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no file @a src_name, or no directory
+ *       for @a dst_name.
+ *     - UFS_ERR_INVALID_ARG - bad path, or one is a directory.
+ */
+int
+ufs_clone(const char *src_name, const char *dst_name);
+
+/** A copy of all the files, see ufs_snapshot_create(). */
+struct ufs_snapshot;
+
+/**
+ * Take a snapshot of all the files. Like with ufs_clone(), the
+ * files share the blocks with the snapshot until they are changed,
+ * so it takes O(number of blocks) time and little memory. Writers
+ * wait until the snapshot is taken.
+ * @retval Snapshot to be deleted with ufs_snapshot_delete().
+ */
+struct ufs_snapshot *
+ufs_snapshot_create(void);
+
+/**
+ * Bring all the files and directories back to the state of
+ * @a snapshot. The ones created after the snapshot are deleted.
+ * Opened descriptors keep working with the old files, like after
+ * ufs_delete(). The snapshot stays and can be restored again.
+ * @param snapshot Snapshot from ufs_snapshot_create().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_BUSY - the log of ufs_wal_open() is open, it would
+ *       not have the restored files.
+ */
+int
+ufs_snapshot_restore(const struct ufs_snapshot *snapshot);
+
+/** Delete a snapshot, the blocks only it holds are freed. */
+void
+ufs_snapshot_delete(struct ufs_snapshot *snapshot);
+
 #ifdef NEED_RESIZE
 
 /**
  * Resize a file opened by the file descriptor @a fd. If current
- * file size is less than @a new_size, then new empty blocks are
- * created and positions of opened file descriptors are not
- * changed. If the current size is bigger than @a new_size, then
- * the blocks are truncated. Opened file descriptors behind the
- * new file size should proceed from the new file end.
+ * file size is less than @a new_size, then the file grows by a
+ * hole, which takes no memory until written, and positions of
+ * opened file descriptors are not changed. If the current size is
+ * bigger than @a new_size, then the blocks are truncated. Opened
+ * file descriptors behind the new file size should proceed from
+ * the new file end.
  *
  * @param fd File descriptor from ufs_open().
  * @param new_size New file size.
@@ -156,12 +473,272 @@ ufs_delete(const char *filename);
  *       UFS_WRITE_ONLY or UFS_READ_WRITE permissions.
  *     - UFS_ERR_NO_MEM - not enough memory. Can appear only when
  *       @a new_size is bigger than the current size.
+ *     - UFS_ERR_BUSY - the file is shrunk but has ufs_read_map()
+ *       maps.
  */
 int
 ufs_resize(int fd, size_t new_size);
 
 #endif
 
+/**
+ * Set the min block size of the files created after the call. The
+ * first block of a file has this size, and the next ones grow
+ * twice until 1MB. Small files waste less memory with small
+ * blocks, big files with big blocks need less allocations.
+ * @param size Power of 2, not bigger than 1MB. 512 by default.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - @a size is not a power of 2 or is
+ *       too big.
+ */
+int
+ufs_set_min_block_size(size_t size);
+
+/**
+ * Turn the block deduplication on or off, it is off by default.
+ * When a write fills a block up to its end, the block is hashed
+ * and looked up among the blocks written before. If the same
+ * block is found, the file shares it instead, like a clone does,
+ * and it is copied on a later write. The dedup saves memory when
+ * the files have identical regions aligned the same way relative
+ * to the block boundaries, at the cost of hashing the written
+ * blocks.
+ * @param is_enabled True to deduplicate the blocks written next.
+ */
+void
+ufs_set_dedup(bool is_enabled);
+
+struct ufs_dedup_stats {
+	/** Distinct blocks found by the dedup. */
+	size_t block_count;
+	/** Memory of these blocks. */
+	size_t bytes;
+	/**
+	 * Memory they would take without sharing: each block counted
+	 * once per file or snapshot holding it. The dedup ratio is
+	 * logical_bytes / bytes, and logical_bytes - bytes is saved.
+	 */
+	size_t logical_bytes;
+	/** How many written blocks turned out to be duplicates. */
+	size_t hit_count;
+};
+
+/** Get the dedup statistics, see ufs_set_dedup(). */
+void
+ufs_dedup_stats(struct ufs_dedup_stats *stats);
+
+/**
+ * Start or stop the background compression of the cold blocks. A
+ * thread runs ufs_compress_cold() each @a interval_ms, so a block
+ * not accessed for one to two intervals is compressed. Off by
+ * default.
+ * @param interval_ms Interval of the compression passes, 0 stops
+ *     the compression. The compressed blocks stay compressed.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - negative @a interval_ms.
+ */
+int
+ufs_set_compression(int interval_ms);
+
+/**
+ * Run a compression pass over all the files right now. The blocks
+ * not accessed since the previous pass are compressed with zlib,
+ * and the other ones are marked as not accessed. A compressed
+ * block is read through a small cache of decompressed blocks, and
+ * is decompressed back on a write or ufs_read_map(). Only the
+ * blocks held by one file and shrinking by a quarter at least are
+ * compressed; the blocks of mapped files, the ones loaded by
+ * ufs_load() and the deduplicated ones are not.
+ */
+void
+ufs_compress_cold(void);
+
+struct ufs_compression_stats {
+	/** Compressed blocks. */
+	size_t block_count;
+	/** Their size before the compression. */
+	size_t raw_bytes;
+	/** And after it. */
+	size_t compressed_bytes;
+	/** Reads of the compressed blocks found in the cache. */
+	size_t cache_hit_count;
+	/** And the ones decompressing a block. */
+	size_t cache_miss_count;
+};
+
+/** Get the compression statistics, see ufs_compress_cold(). */
+void
+ufs_compression_stats(struct ufs_compression_stats *stats);
+
+struct ufs_stat {
+	/** It is a directory, then the rest is zero. */
+	bool is_dir;
+	/** File size. */
+	size_t size;
+	/** Blocks holding the data, the holes are not counted. */
+	size_t block_count;
+	/**
+	 * Memory of these blocks, the compressed size of the compressed
+	 * ones. A block shared with clones or snapshots is counted in
+	 * each of them.
+	 */
+	size_t allocated_bytes;
+	/**
+	 * Unused bytes at the end of the last block, the internal
+	 * fragmentation of the file.
+	 */
+	size_t slack_bytes;
+};
+
+/**
+ * Get the size and the memory of a file or a directory.
+ * @param path Path of the file or the directory.
+ * @param[out] st The stats to fill.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_NO_FILE - no such file or directory.
+ *     - UFS_ERR_INVALID_ARG - bad path.
+ */
+int
+ufs_stat(const char *path, struct ufs_stat *st);
+
+struct ufs_fs_stats {
+	/** Files in the directories. */
+	size_t file_count;
+	/** Directories, not counting the root. */
+	size_t dir_count;
+	/** Sum of the file sizes. */
+	size_t logical_bytes;
+	/**
+	 * Blocks in use by the files, the deleted ones still open,
+	 * the snapshots and the maps. A shared block is counted once.
+	 */
+	size_t block_count;
+	/** Their memory, the compressed size of the compressed ones. */
+	size_t allocated_bytes;
+	/**
+	 * Memory taken for the uncompressed blocks, with the free
+	 * ones. The blocks loaded by ufs_load() are in the image.
+	 */
+	size_t slab_bytes;
+	/** Files whose last block is partially used. */
+	size_t partial_block_count;
+	/** Unused bytes of these blocks, the internal fragmentation. */
+	size_t slack_bytes;
+	/** Open file descriptors. */
+	size_t open_descriptor_count;
+	/** Reads, and the bytes read, ufs_read_map() included. */
+	size_t read_count;
+	size_t read_bytes;
+	/** Writes, and the bytes written. */
+	size_t write_count;
+	size_t write_bytes;
+};
+
+/**
+ * Get the statistics of the whole file system. The I/O counters
+ * run since the start or ufs_destroy(). The file counts and sizes
+ * are collected by a walk over all the files, the other numbers
+ * are kept up to date.
+ */
+void
+ufs_fs_stats(struct ufs_fs_stats *stats);
+
+/**
+ * Save all the files into an image file. The files are saved in
+ * a consistent state: writers wait until the saving ends. The
+ * image is written next to @a path and renamed into it, so an old
+ * image is replaced only by a complete new one. If the log of
+ * ufs_wal_open() is open for @a path, it is emptied: its records
+ * are in the image.
+ * @param path Image file path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - can't write the image.
+ */
+int
+ufs_save(const char *path);
+
+/**
+ * Load the files from an image of ufs_save(). They replace the
+ * existing files with the same names, other files stay. So do the
+ * directories, a file or a directory in the way of a loaded one is
+ * deleted. The image is mapped into memory instead of reading, its
+ * data is read from the disk on first access to it. The image file
+ * can be deleted or replaced by ufs_save() after loading, but must
+ * not be changed in place: the loaded files would see the changes
+ * or even crash on a truncation. Then the log of ufs_wal_open() is
+ * replayed, if there is one. Its records are applied up to a torn
+ * or corrupted one, which is where a crash has interrupted it. The
+ * image can be absent if the log is present.
+ * @param path Image file path.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_IO - can't read the image or the log, the image is
+ *       corrupted, or there is neither of them.
+ *     - UFS_ERR_BUSY - a log is open, or the log shrinks a file
+ *       mapped by ufs_read_map().
+ */
+int
+ufs_load(const char *path);
+
+/**
+ * Open the write-ahead log of the image at @a path. The log is the
+ * file @a path with ".wal" suffix. File creations, writes, resizes
+ * and deletions, and the directory changes are appended to it, and
+ * ufs_load() replays them after the image. The records are synced
+ * to the disk in batches with one fdatasync() for all of them
+ * (group commit): a change returns right after its record is
+ * buffered, except the one which completes a batch - it writes and
+ * syncs the batch, and the changes completing the next batch
+ * meanwhile wait for it and are synced together. So only the last
+ * batch can be lost on a crash. The log must be opened after
+ * loading the image, and the image is saved by ufs_save() which
+ * empties the log.
+ * @param path Image file path.
+ * @param batch_size Number of records synced together. 1 makes
+ *     each change durable before it returns.
+ * @param flush_interval_ms If not 0, a background thread syncs an
+ *     incomplete batch after this time.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - bad batch size or interval.
+ *     - UFS_ERR_BUSY - a log is open already.
+ *     - UFS_ERR_IO - can't open the log.
+ */
+int
+ufs_wal_open(const char *path, int batch_size, int flush_interval_ms);
+
+/**
+ * Write and sync the buffered log records.
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no log is open.
+ *     - UFS_ERR_IO - a write or sync of the log has failed.
+ */
+int
+ufs_wal_sync(void);
+
+/**
+ * Sync and close the log of ufs_wal_open().
+ *
+ * @retval 0 Success.
+ * @retval -1 Error occurred. Check ufs_errno() for a code.
+ *     - UFS_ERR_INVALID_ARG - no log is open.
+ *     - UFS_ERR_IO - a write or sync of the log has failed.
+ */
+int
+ufs_wal_close(void);
+
 /**
  * Destroy all the global variables, free all the memory, close and delete all
  * the files. After the destruction neither of the ufs functions are supposed to